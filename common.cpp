@@ -1,13 +1,28 @@
-#include "common.h"
+#include <stdarg.h>
 
-FILE *f;  // the compressed file
+#include "common.h"
 
-std::vector<ColorVal> grey; // a pixel with values in the middle of the bounds
 
 const std::vector<std::string> transforms = {"YIQ","BND","ACB","PLT","PLA","FRS","DUP","FRA","???"};
 
-int64_t pixels_todo = 0;
-int64_t pixels_done = 0;
+static int verbosity = 1;
+
+void v_printf(const int v, const char *format, ...) {
+    if (verbosity < v) return;
+    va_list args;
+    va_start(args, format);
+    vfprintf(stdout, format, args);
+    fflush(stdout);
+    va_end(args);
+}
+
+void increase_verbosity() {
+    verbosity++;
+}
+
+int get_verbosity() {
+    return verbosity;
+}
 
 const int NB_PROPERTIES_scanlines[] = {7,8,9,7};
 const int NB_PROPERTIES_scanlinesA[] = {8,9,10,7};
@@ -34,19 +49,38 @@ void initPropRanges_scanlines(Ranges &propRanges, const ColorRanges &ranges, int
     propRanges.push_back(std::make_pair(mind,maxd));
 }
 
-ColorVal predict_and_calcProps_scanlines(Properties &properties, const ColorRanges *ranges, const Image &image, const int p, const uint32_t r, const uint32_t c, ColorVal &min, ColorVal &max) {
+PredictorRows::PredictorRows(const Image &image, const int z, const int p, const uint32_t r) {
+    const uint32_t rowsize = image.zoom_rowpixelsize(z);
+    step = image.zoom_colpixelsize(z);
+    cols = image.cols(z);
+    rows = image.rows(z);
+    nump = image.numPlanes();
+    for (int pp = 0; pp < nump; pp++) {
+        planes[pp] = image.row_pointer(pp, r*rowsize);
+        wide[pp] = image.wide_plane(pp);
+    }
+    row = planes[p];
+    top = (r > 0 ? image.row_pointer(p, (r-1)*rowsize) : NULL);
+    toptop = (r > 1 ? image.row_pointer(p, (r-2)*rowsize) : NULL);
+    bottom = (r+1 < rows ? image.row_pointer(p, (r+1)*rowsize) : NULL);
+}
+
+template <typename pixel_t>
+static ColorVal predict_and_calcProps_scanlines_plane(const FLIFContext &ctx, Properties &properties, const FlatColorRanges *ranges, const PredictorRows &rows, const int p, const uint32_t r, const uint32_t c, ColorVal &min, ColorVal &max) {
+    const pixel_t *row = (const pixel_t*) rows.row;
+    const pixel_t *above = (const pixel_t*) rows.top;
     ColorVal guess;
     int which = 0;
     int index=0;
     if (p != 3) {
       for (int pp = 0; pp < p; pp++) {
-        properties[index++] = image(pp,r,c);
+        properties[index++] = rows.plane(pp,c);
       }
-      if (image.numPlanes()>3) properties[index++] = image(3,r,c);
+      if (rows.nump>3) properties[index++] = rows.plane(3,c);
     }
-    ColorVal left = (c>0 ? image(p,r,c-1) : grey[p]);;
-    ColorVal top = (r>0 ? image(p,r-1,c) : grey[p]);
-    ColorVal topleft = (r>0 && c>0 ? image(p,r-1,c-1) : grey[p]);
+    ColorVal left = (c>0 ? row[c-1] : ctx.grey[p]);;
+    ColorVal top = (r>0 ? above[c] : ctx.grey[p]);
+    ColorVal topleft = (r>0 && c>0 ? above[c-1] : ctx.grey[p]);
     ColorVal gradientTL = left + top - topleft;
     guess = median3(gradientTL, left, top);
     ranges->snap(p,properties,min,max,guess);
@@ -60,15 +94,20 @@ ColorVal predict_and_calcProps_scanlines(Properties &properties, const ColorRang
     if (c > 0 && r > 0) { properties[index++] = left - topleft; properties[index++] = topleft - top; }
                  else   { properties[index++] = 0; properties[index++] = 0;  }
 
-    if (c+1 < image.cols() && r > 0) properties[index++] = top - image(p,r-1,c+1); // top - topright
+    if (c+1 < rows.cols && r > 0) properties[index++] = top - above[c+1]; // top - topright
                  else   properties[index++] = 0;
-    if (r > 1) properties[index++] = image(p,r-2,c)-top;    // toptop - top
+    if (r > 1) properties[index++] = ((const pixel_t*) rows.toptop)[c]-top;    // toptop - top
          else properties[index++] = 0;
-    if (c > 1) properties[index++] = image(p,r,c-2)-left;    // leftleft - left
+    if (c > 1) properties[index++] = row[c-2]-left;    // leftleft - left
          else properties[index++] = 0;
     return guess;
 }
 
+ColorVal predict_and_calcProps_scanlines(const FLIFContext &ctx, Properties &properties, const FlatColorRanges *ranges, const PredictorRows &rows, const int p, const uint32_t r, const uint32_t c, ColorVal &min, ColorVal &max) {
+    if (rows.wide[p]) return predict_and_calcProps_scanlines_plane<int32_t>(ctx, properties, ranges, rows, p, r, c, min, max);
+    else return predict_and_calcProps_scanlines_plane<int16_t>(ctx, properties, ranges, rows, p, r, c, min, max);
+}
+
 
 const int NB_PROPERTIES[] = {8,7,8,8};
 const int NB_PROPERTIESA[] = {9,8,9,8};
@@ -98,111 +137,43 @@ void initPropRanges(Ranges &propRanges, const ColorRanges &ranges, int p)
     }
 }
 
-// Actual prediction. Also sets properties. Property vector should already have the right size before calling this.
-ColorVal predict_and_calcProps(Properties &properties, const ColorRanges *ranges, const Image &image, const int z, const int p, const uint32_t r, const uint32_t c, ColorVal &min, ColorVal &max) {
-    ColorVal guess;
-    int which = 0;
-    int index = 0;
-
-    if (p != 3) {
-    for (int pp = 0; pp < p; pp++) {
-        properties[index++] = image(pp,z,r,c);
-    }
-    if (image.numPlanes()>3) properties[index++] = image(3,z,r,c);
-    }
-    ColorVal left;
-    ColorVal top;
-    ColorVal topleft = (r>0 && c>0 ? image(p,z,r-1,c-1) : grey[p]);
-    ColorVal topright = (r>0 && c+1 < image.cols(z) ? image(p,z,r-1,c+1) : grey[p]);
-    ColorVal bottomleft = (r+1 < image.rows(z) && c>0 ? image(p,z,r+1,c-1) : grey[p]);
-    if (z%2 == 0) { // filling horizontal lines
-      left = (c>0 ? image(p,z,r,c-1) : grey[p]);
-      top = image(p,z,r-1,c);
-      ColorVal gradientTL = left + top - topleft;
-      ColorVal bottom = (r+1 < image.rows(z) ? image(p,z,r+1,c) : top); //grey[p]);
-      ColorVal gradientBL = left + bottom - bottomleft;
-      ColorVal avg = (top + bottom)/2;
-      guess = median3(gradientTL, gradientBL, avg);
-      ranges->snap(p,properties,min,max,guess);
-      if (guess == avg) which = 0;
-      else if (guess == gradientTL) which = 1;
-      else if (guess == gradientBL) which = 2;
-      properties[index++] = top-bottom;
-
-    } else { // filling vertical lines
-      left = image(p,z,r,c-1);
-      top = (r>0 ? image(p,z,r-1,c) : grey[p]);
-      ColorVal gradientTL = left + top - topleft;
-      ColorVal right = (c+1 < image.cols(z) ? image(p,z,r,c+1) : left); //grey[p]);
-      ColorVal gradientTR = right + top - topright;
-      ColorVal avg = (left + right      )/2;
-      guess = median3(gradientTL, gradientTR, avg);
-      ranges->snap(p,properties,min,max,guess);
-      if (guess == avg) which = 0;
-      else if (guess == gradientTL) which = 1;
-      else if (guess == gradientTR) which = 2;
-      properties[index++] = left-right;
-    }
-    properties[index++]=guess;
-    properties[index++]=which;
-
-    if (c > 0 && r > 0) { properties[index++]=left - topleft; properties[index++]=topleft - top; }
-                 else   { properties[index++]=0; properties[index++]=0; }
-
-    if (c+1 < image.cols(z) && r > 0) properties[index++]=top - topright;
-                 else   properties[index++]=0;
-
-    if (p == 0 || p == 3) {
-     if (r > 1) properties[index++]=image(p,z,r-2,c)-top;    // toptop - top
-         else properties[index++]=0;
-     if (c > 1) properties[index++]=image(p,z,r,c-2)-left;    // leftleft - left
-         else properties[index++]=0;
-    }
-    return guess;
-}
-
 int plane_zoomlevels(const Image &image, const int beginZL, const int endZL) {
     return image.numPlanes() * (beginZL - endZL + 1);
 }
 
-std::pair<int, int> plane_zoomlevel(const Image &image, const int beginZL, const int endZL, int i) {
-    assert(i >= 0);
-    assert(i < plane_zoomlevels(image, beginZL, endZL));
+std::vector<PlaneZoomlevel> plane_zoomlevel_schedule(const Image &image, const int beginZL, const int endZL) {
+    std::vector<PlaneZoomlevel> schedule;
+    const int n = plane_zoomlevels(image, beginZL, endZL);
+    const int np = image.numPlanes();
+    schedule.reserve(n);
     // simple order: interleave planes, zoom in
-//    int p = i % image.numPlanes();
-//    int zl = beginZL - (i / image.numPlanes());
+//    for (int i = 0; i < n; i++) schedule.push_back(PlaneZoomlevel(image, i % np, beginZL - (i / np)));
 
     // more advanced order: give priority to more important plane(s)
     // assumption: plane 0 is Y, plane 1 is I, plane 2 is Q, plane 3 is perhaps alpha, next planes (not used at the moment) are not important
     const int max_behind[] = {0, 2, 4, 0, 16, 18, 20, 22};
-    int np = image.numPlanes();
     if (np>7) {
       // too many planes, do something simple
-      int p = i % image.numPlanes();
-      int zl = beginZL - (i / image.numPlanes());
-      return std::pair<int, int>(p,zl);
+      for (int i = 0; i < n; i++) schedule.push_back(PlaneZoomlevel(image, i % np, beginZL - (i / np)));
+      return schedule;
     }
-    std::vector<int> czl(np);
-    for (int &pzl : czl) pzl = beginZL+1;
+    std::vector<int> czl(np, beginZL+1);
     int highest_priority_plane = 0;
     if (np >= 4) highest_priority_plane = 3; // alpha first
     int nextp = highest_priority_plane;
-    while (i >= 0) {
-      czl[nextp]--;
-      i--;
-      if (i<0) break;
-      nextp=highest_priority_plane;
-      for (int p=0; p<np; p++) {
-        if (czl[p] > czl[highest_priority_plane] + max_behind[p]) {
-          nextp = p; break;
+    for (int i = 0; i < n; i++) {
+      if (i > 0) {
+        nextp=highest_priority_plane;
+        for (int p=0; p<np; p++) {
+          if (czl[p] > czl[highest_priority_plane] + max_behind[p]) {
+            nextp = p; break;
+          }
         }
+        // ensure that nextp is not at the most detailed zoomlevel yet
+        while (czl[nextp] <= endZL) nextp = (nextp+1)%np;
       }
-      // ensure that nextp is not at the most detailed zoomlevel yet
-      while (czl[nextp] <= endZL) nextp = (nextp+1)%np;
+      czl[nextp]--;
+      schedule.push_back(PlaneZoomlevel(image, nextp, czl[nextp]));
     }
-    int p = nextp;
-    int zl = czl[p];
-
-    return std::pair<int, int>(p,zl);
+    return schedule;
 }
-
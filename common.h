@@ -3,6 +3,9 @@
 
 #include <string>
 #include <string.h>
+#include <utility>
+#include <thread>
+#include <algorithm>
 
 #include "maniac/rac.h"
 #include "maniac/compound.h"
@@ -12,12 +15,21 @@
 #include "transform/factory.h"
 
 #include "flif_config.h"
+#include "timings.h"
 
-extern FILE *f;  // the compressed file
 
-extern std::vector<ColorVal> grey; // a pixel with values in the middle of the bounds
-extern int64_t pixels_todo;
-extern int64_t pixels_done;
+// state of a single encode or decode call (kept out of globals so calls can run concurrently)
+struct FLIFContext {
+    std::vector<ColorVal> grey; // a pixel with values in the middle of the bounds
+    int64_t pixels_todo;
+    int64_t pixels_done;
+    FLIFTimings *timings;       // NULL unless the caller wants a timings report
+    unsigned int threads;       // the most threads a stage of the call may use (1: everything in the calling thread)
+    FLIFContext() : pixels_todo(0), pixels_done(0), timings(NULL), threads(1) {}
+};
+
+// the threads a call may use for a thread option n (0: one per hardware thread)
+inline unsigned int thread_budget(const int n) { return n > 0 ? n : std::max(1u, std::thread::hardware_concurrency()); }
 
 #define MAX_TRANSFORM 8
 
@@ -25,6 +37,8 @@ extern const std::vector<std::string> transforms;
 
 
 void v_printf(const int v, const char *format, ...);
+void increase_verbosity();
+int get_verbosity();
 
 typedef SimpleBitChance                         FLIFBitChancePass1;
 
@@ -44,9 +58,26 @@ extern const int NB_PROPERTIESA[];
 extern const int NB_PROPERTIES_scanlines[];
 extern const int NB_PROPERTIES_scanlinesA[];
 
+// The rows around row r of plane p at zoomlevel z, looked up once per row so the predictors can
+// fetch neighbours through a pointer instead of going through Image::operator() for each of them.
+struct PredictorRows {
+    const void *toptop, *top, *row, *bottom; // rows r-2, r-1, r and r+1 of plane p (NULL outside the image)
+    const void *planes[4];                   // row r of every plane (for the properties taken from other planes)
+    bool wide[4];                            // see Image::wide_plane()
+    uint32_t step;                           // distance between two columns at this zoomlevel
+    uint32_t cols, rows;                     // size of the zoomlevel
+    int nump;
+
+    PredictorRows(const Image &image, const int z, const int p, const uint32_t r);
+
+    ColorVal plane(const int pp, const uint32_t c) const {
+        return wide[pp] ? ((const int32_t*)planes[pp])[c*step] : ((const int16_t*)planes[pp])[c*step];
+    }
+};
+
 void initPropRanges_scanlines(Ranges &propRanges, const ColorRanges &ranges, int p);
 
-ColorVal predict_and_calcProps_scanlines(Properties &properties, const ColorRanges *ranges, const Image &image, const int p, const uint32_t r, const uint32_t c, ColorVal &min, ColorVal &max);
+ColorVal predict_and_calcProps_scanlines(const FLIFContext &ctx, Properties &properties, const FlatColorRanges *ranges, const PredictorRows &rows, const int p, const uint32_t r, const uint32_t c, ColorVal &min, ColorVal &max);
 
 void initPropRanges(Ranges &propRanges, const ColorRanges &ranges, int p);
 
@@ -66,11 +97,150 @@ inline ColorVal predict(const Image &image, int z, int p, uint32_t r, uint32_t c
     }
 }
 
+// The role of a plane in the interlaced per-pixel loops, which are compiled separately for each role:
+// Y and alpha have two extra properties, the chroma planes use the planes before them as properties.
+enum PlaneRole { PLANE_Y = 0, PLANE_CHROMA = 1, PLANE_ALPHA = 3 };
+
 // Actual prediction. Also sets properties. Property vector should already have the right size before calling this.
-ColorVal predict_and_calcProps(Properties &properties, const ColorRanges *ranges, const Image &image, const int z, const int p, const uint32_t r, const uint32_t c, ColorVal &min, ColorVal &max);
+// horizontal: z%2 == 0 (filling horizontal lines), alpha: the image has an alpha plane.
+// At zoomlevel z, the pixels of a row are rows.step apart; pixel_t is the storage type of plane p.
+template <typename pixel_t, bool horizontal, bool alpha, int role>
+inline ColorVal predict_and_calcProps_plane(const FLIFContext &ctx, Properties &properties, const FlatColorRanges *ranges, const PredictorRows &rows, const int p, const uint32_t r, const uint32_t c, ColorVal &min, ColorVal &max) {
+    const uint32_t s = rows.step;
+    const pixel_t *row = (const pixel_t*) rows.row;
+    const pixel_t *above = (const pixel_t*) rows.top;
+    const pixel_t *below = (const pixel_t*) rows.bottom;
+    ColorVal guess;
+    int which = 0;
+    int index = 0;
+
+    if (role == PLANE_CHROMA) {
+    for (int pp = 0; pp < p; pp++) {
+        properties[index++] = rows.plane(pp,c);
+    }
+    }
+    if (role != PLANE_ALPHA && alpha) properties[index++] = rows.plane(3,c);
+    ColorVal left;
+    ColorVal top;
+    ColorVal topleft = (r>0 && c>0 ? above[(c-1)*s] : ctx.grey[p]);
+    ColorVal topright = (r>0 && c+1 < rows.cols ? above[(c+1)*s] : ctx.grey[p]);
+    ColorVal bottomleft = (r+1 < rows.rows && c>0 ? below[(c-1)*s] : ctx.grey[p]);
+    if (horizontal) { // filling horizontal lines
+      left = (c>0 ? row[(c-1)*s] : ctx.grey[p]);
+      top = above[c*s];
+      ColorVal gradientTL = left + top - topleft;
+      ColorVal bottom = (r+1 < rows.rows ? below[c*s] : top); //grey[p]);
+      ColorVal gradientBL = left + bottom - bottomleft;
+      ColorVal avg = (top + bottom)/2;
+      guess = median3(gradientTL, gradientBL, avg);
+      ranges->snap(p,properties,min,max,guess);
+      if (guess == avg) which = 0;
+      else if (guess == gradientTL) which = 1;
+      else if (guess == gradientBL) which = 2;
+      properties[index++] = top-bottom;
+
+    } else { // filling vertical lines
+      left = row[(c-1)*s];
+      top = (r>0 ? above[c*s] : ctx.grey[p]);
+      ColorVal gradientTL = left + top - topleft;
+      ColorVal right = (c+1 < rows.cols ? row[(c+1)*s] : left); //grey[p]);
+      ColorVal gradientTR = right + top - topright;
+      ColorVal avg = (left + right      )/2;
+      guess = median3(gradientTL, gradientTR, avg);
+      ranges->snap(p,properties,min,max,guess);
+      if (guess == avg) which = 0;
+      else if (guess == gradientTL) which = 1;
+      else if (guess == gradientTR) which = 2;
+      properties[index++] = left-right;
+    }
+    properties[index++]=guess;
+    properties[index++]=which;
+
+    if (c > 0 && r > 0) { properties[index++]=left - topleft; properties[index++]=topleft - top; }
+                 else   { properties[index++]=0; properties[index++]=0; }
+
+    if (c+1 < rows.cols && r > 0) properties[index++]=top - topright;
+                 else   properties[index++]=0;
+
+    if (role != PLANE_CHROMA) {
+     if (r > 1) properties[index++]=((const pixel_t*) rows.toptop)[c*s]-top;    // toptop - top
+         else properties[index++]=0;
+     if (c > 1) properties[index++]=row[(c-2)*s]-left;    // leftleft - left
+         else properties[index++]=0;
+    }
+    return guess;
+}
+
+template <bool horizontal, bool alpha, int role>
+inline ColorVal predict_and_calcProps(const FLIFContext &ctx, Properties &properties, const FlatColorRanges *ranges, const PredictorRows &rows, const int p, const uint32_t r, const uint32_t c, ColorVal &min, ColorVal &max) {
+    if (rows.wide[p]) return predict_and_calcProps_plane<int32_t, horizontal, alpha, role>(ctx, properties, ranges, rows, p, r, c, min, max);
+    else return predict_and_calcProps_plane<int16_t, horizontal, alpha, role>(ctx, properties, ranges, rows, p, r, c, min, max);
+}
+
+// Calls K::run<horizontal, alpha, role>(args...) with the template arguments that match
+// zoomlevel z and plane p, so there is one dispatch per (plane, zoomlevel) step.
+template <typename K, bool horizontal, bool alpha, typename... Args>
+inline bool dispatch_plane_role(const int p, Args&&... args) {
+    if (p == 0) return K::template run<horizontal, alpha, PLANE_Y>(std::forward<Args>(args)...);
+    else if (p == 3) return K::template run<horizontal, alpha, PLANE_ALPHA>(std::forward<Args>(args)...);
+    else return K::template run<horizontal, alpha, PLANE_CHROMA>(std::forward<Args>(args)...);
+}
+
+template <typename K, typename... Args>
+inline bool dispatch_zoomlevel(const int nump, const int p, const int z, Args&&... args) {
+    if (z%2 == 0) {
+      if (nump > 3) return dispatch_plane_role<K, true, true>(p, std::forward<Args>(args)...);
+      else return dispatch_plane_role<K, true, false>(p, std::forward<Args>(args)...);
+    } else {
+      if (nump > 3) return dispatch_plane_role<K, false, true>(p, std::forward<Args>(args)...);
+      else return dispatch_plane_role<K, false, false>(p, std::forward<Args>(args)...);
+    }
+}
 
 int plane_zoomlevels(const Image &image, const int beginZL, const int endZL);
 
-std::pair<int, int> plane_zoomlevel(const Image &image, const int beginZL, const int endZL, int i);
+// one step of the interlaced scheme: plane p at zoomlevel z
+struct PlaneZoomlevel {
+    int p;
+    int z;
+    int64_t pixels;  // pixels added by this step
+    long bytes;      // bytes written by this step (only filled in by the encoder)
+    PlaneZoomlevel(const Image &image, int pIn, int zIn) : p(pIn), z(zIn), pixels(image.cols(zIn)*image.rows(zIn)/2), bytes(0) {}
+};
+
+// the order in which planes and zoomlevels are encoded, from beginZL down to endZL
+std::vector<PlaneZoomlevel> plane_zoomlevel_schedule(const Image &image, const int beginZL, const int endZL);
+
+// encoding 1: scanlines, plane by plane; 2: interlaced; 3: scanlines, all planes of a row before the next row
+// (row-interleaved, still images only, so it can be decoded row by row in a few rows of memory);
+// 4: scanlines, plane by plane, every plane in its own RAC stream (so the planes can be decoded concurrently);
+// 5: tiles, each one a separate FLIF file in one of the other encodings
+inline bool scanline_encoding(const int encoding) {
+    return encoding == 1 || encoding == 3 || encoding == 4;
+}
+
+// checksum of row-interleaved files: like Image::checksum(), but row by row (all planes of a row) instead of plane by plane
+class RowChecksum {
+    uint_fast32_t crc;
+public:
+    RowChecksum(const uint32_t width, const uint32_t height) : crc(0) {
+        crc32k_transform(crc,width & 255);
+        crc32k_transform(crc,width / 256);
+        crc32k_transform(crc,height & 255);
+        crc32k_transform(crc,height / 256);
+    }
+    void add_row(const Image &image, const uint32_t r) {
+        for (int p=0; p<image.numPlanes(); p++) {
+            for (uint32_t c=0; c<image.cols(); c++) {
+                ColorVal d = image(p,r,c);
+                crc32k_transform(crc,d & 255);
+                crc32k_transform(crc,d / 256);
+            }
+        }
+    }
+    uint32_t value() const {
+        return (~crc & 0xFFFFFFFF);
+    }
+};
 
 #endif // __COMMMON_H__
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef _MSC_VER
+#include <io.h>
+#define open _open
+#define read _read
+#define write _write
+#define close _close
+#define lseek _lseek
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+#endif
+
+#include "fileio.h"
+
+FileIO::FileIO(const char *filename, bool write)
+    : writing(write), past_end(false), buffer(BLOCK_SIZE), offset(0) {
+    if (writing) fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    else fd = open(filename, O_RDONLY | O_BINARY);
+    pos = &buffer[0];
+    end = writing ? pos + BLOCK_SIZE : pos;
+}
+
+FileIO::~FileIO() {
+    if (fd < 0) return;
+    flush();
+    close(fd);
+}
+
+int FileIO::refill() {
+    offset += end - &buffer[0];
+    pos = end = &buffer[0];
+    if (fd >= 0) {
+        long n = ::read(fd, &buffer[0], BLOCK_SIZE);
+        if (n > 0) end = pos + n;
+    }
+    if (pos == end) {
+        past_end = true;
+        return 0;
+    }
+    return *pos++;
+}
+
+bool FileIO::at_end() {
+    if (pos < end || writing) return false;
+    refill();
+    if (past_end) return true;
+    pos--;
+    return false;
+}
+
+size_t FileIO::read_block(uint8_t *dst, size_t n) {
+    size_t got = 0;
+    while (got < n) {
+        if (pos == end) {
+            offset += end - &buffer[0];
+            pos = end = &buffer[0];
+            long r = (fd >= 0 ? ::read(fd, &buffer[0], BLOCK_SIZE) : 0);
+            if (r <= 0) { past_end = true; break; }
+            end = pos + r;
+        }
+        size_t k = std::min<size_t>(n - got, end - pos);
+        memcpy(dst + got, pos, k);
+        pos += k;
+        got += k;
+    }
+    return got;
+}
+
+void FileIO::skip(uint64_t n) {
+    const uint64_t buffered = std::min<uint64_t>(n, end - pos);
+    pos += buffered;
+    n -= buffered;
+    if (n == 0) return;
+    off_t cur = lseek(fd, 0, SEEK_CUR), size = lseek(fd, 0, SEEK_END);
+    if (cur < 0 || size < 0) {
+        // not seekable (a pipe): read through
+        std::vector<uint8_t> scratch(BLOCK_SIZE);
+        while (n > 0 && !past_end) n -= read_block(&scratch[0], std::min<uint64_t>(n, BLOCK_SIZE));
+        return;
+    }
+    // the buffer is used up, so the file position is the one of end
+    const off_t target = std::min<uint64_t>(cur + n, size);
+    lseek(fd, target, SEEK_SET);
+    offset = tell() + (target - cur);
+    pos = end = &buffer[0];
+    if ((uint64_t)cur + n > (uint64_t)size) past_end = true;
+}
+
+void FileIO::drain() {
+    uint8_t *p = &buffer[0];
+    long todo = pos - p;
+    while (todo > 0 && fd >= 0) {
+        long n = ::write(fd, p, todo);
+        if (n <= 0) { fprintf(stderr,"Error writing output file\n"); break; }
+        p += n;
+        todo -= n;
+    }
+    offset += pos - &buffer[0];
+    pos = &buffer[0];
+}
+
+
+MmapIO::MmapIO(const char *filename) : map(NULL), length(0) {
+    int fd = open(filename, O_RDONLY | O_BINARY);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        length = st.st_size;
+#ifndef _MSC_VER
+        map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) map = NULL;
+        else madvise(map, length, MADV_SEQUENTIAL);
+#endif
+        if (map) setSpan((const uint8_t*) map, length);
+        else {
+            copy.resize(length);
+            size_t got = 0;
+            while (got < length) {
+                long n = ::read(fd, &copy[got], length - got);
+                if (n <= 0) break;
+                got += n;
+            }
+            setSpan(&copy[0], got);
+        }
+    }
+    close(fd);
+}
+
+MmapIO::~MmapIO() {
+#ifndef _MSC_VER
+    if (map) munmap(map, length);
+#endif
+}
@@ -0,0 +1,170 @@
+#ifndef _FILEIO_H_
+#define _FILEIO_H_ 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+// IO policies for RacInput/RacOutput (and the raw header bytes around the RAC stream).
+// All of them implement the same small interface:
+//   int read()          next byte, or 0 when reading past the end (which sets eof())
+//   void write(int)     append a byte
+//   void flush()        push buffered output to the underlying sink
+//   bool eof()          has a read past the end been attempted?
+//   long tell()         number of bytes read/written so far
+// The per-byte calls are inline and only touch a buffer pointer; the underlying
+// file/memory is only accessed once per block.
+
+
+// large-block buffered reader/writer on a file descriptor
+class FileIO
+{
+public:
+    static const size_t BLOCK_SIZE = 1 << 16;
+private:
+    int fd;
+    bool writing;
+    bool past_end;
+    std::vector<uint8_t> buffer;
+    uint8_t *pos;
+    uint8_t *end;
+    long offset;  // file position of buffer[0]
+
+    int refill();
+    void drain();
+
+    FileIO(const FileIO&) = delete;
+    FileIO& operator=(const FileIO&) = delete;
+public:
+    FileIO(const char *filename, bool write);
+    ~FileIO();
+
+    bool isOpen() const { return fd >= 0; }
+
+    int inline read() {
+        if (pos < end) return *pos++;
+        return refill();
+    }
+    void inline write(int byte) {
+        if (pos == end) drain();
+        *pos++ = byte;
+    }
+    void flush() {
+        if (writing) drain();
+    }
+    bool eof() const { return past_end; }
+    // all bytes have been read (reading)
+    bool at_end();
+    long tell() const { return offset + (pos - &buffer[0]); }
+    // reads up to n bytes into dst, returns the number of bytes read (fewer at the end of the file, which sets eof())
+    size_t read_block(uint8_t *dst, size_t n);
+    // skips n bytes (with a seek where the file allows it), sets eof() if the file ends before
+    void skip(uint64_t n);
+};
+
+
+// reader on a read-only span of memory
+class BlobReader
+{
+protected:
+    const uint8_t *begin;
+    const uint8_t *pos;
+    const uint8_t *end;
+    bool past_end;
+
+    BlobReader() : begin(NULL), pos(NULL), end(NULL), past_end(false) {}
+    void setSpan(const uint8_t *data, size_t size) { begin = pos = data; end = data + size; past_end = false; }
+public:
+    BlobReader(const uint8_t *data, size_t size) : begin(data), pos(data), end(data+size), past_end(false) {}
+
+    int inline read() {
+        if (pos < end) return *pos++;
+        past_end = true;
+        return 0;
+    }
+    void write(int byte) {}  // cannot write to a read-only span
+    void flush() {}
+    bool eof() const { return past_end; }
+    bool at_end() const { return pos >= end; }
+    long tell() const { return pos - begin; }
+    // points data to the next n bytes in place and skips them; returns how many of them there are
+    // (fewer at the end, which sets eof())
+    size_t span(uint64_t n, const uint8_t *&data) {
+        data = pos;
+        if (n > (uint64_t)(end - pos)) { n = end - pos; past_end = true; }
+        pos += n;
+        return n;
+    }
+    void skip(uint64_t n) {
+        const uint8_t *data;
+        span(n, data);
+    }
+};
+
+
+// read-only memory mapped file (falls back to reading the whole file where mmap is not available)
+class MmapIO : public BlobReader
+{
+private:
+    void *map;
+    size_t length;
+    std::vector<uint8_t> copy;
+
+    MmapIO(const MmapIO&) = delete;
+    MmapIO& operator=(const MmapIO&) = delete;
+public:
+    MmapIO(const char *filename);
+    ~MmapIO();
+
+    bool isOpen() const { return begin != NULL; }
+};
+
+
+// growable in-memory output buffer (which can also be read back)
+class BlobIO
+{
+private:
+    std::vector<uint8_t> data;
+    size_t rpos;
+    bool past_end;
+public:
+    BlobIO() : rpos(0), past_end(false) { data.reserve(FileIO::BLOCK_SIZE); }
+
+    int inline read() {
+        if (rpos < data.size()) return data[rpos++];
+        past_end = true;
+        return 0;
+    }
+    void inline write(int byte) { data.push_back(byte); }
+    void flush() {}
+    bool eof() const { return past_end; }
+    long tell() const { return data.size(); }
+
+    const std::vector<uint8_t> &buffer() const { return data; }
+    std::vector<uint8_t> &buffer() { return data; }
+};
+
+
+// unsigned number as big-endian groups of 7 bits, with the high bit set in every byte but the last
+template <typename IO> void write_varint(IO& io, uint64_t n)
+{
+    int shift = 0;
+    while (shift + 7 < 64 && (n >> (shift + 7))) shift += 7;
+    for (; shift > 0; shift -= 7) io.write(0x80 | ((n >> shift) & 0x7F));
+    io.write(n & 0x7F);
+}
+
+// false on a read past the end or a number that does not fit in 64 bits
+template <typename IO> bool read_varint(IO& io, uint64_t &n)
+{
+    n = 0;
+    for (int i = 0; i < 10; i++) {
+        int byte = io.read();
+        if (io.eof()) return false;
+        n = (n << 7) | (byte & 0x7F);
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+#endif
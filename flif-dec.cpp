@@ -1,5 +1,10 @@
 #include <string>
 #include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 #include "maniac/rac.h"
 #include "maniac/compound.h"
@@ -11,6 +16,7 @@
 #include "flif_config.h"
 
 #include "common.h"
+#include "flif-dec.h"
 
 template<typename RAC> std::string static read_name(RAC& rac)
 {
@@ -19,54 +25,253 @@ template<typename RAC> std::string static read_name(RAC& rac)
     return transforms[nb];
 }
 
-template<typename Coder> void decode_scanlines_inner(std::vector<Coder*> &coders, Images &images, const ColorRanges *ranges)
-{
+// encoding 4: how many rows of every plane have been decoded, so that a plane can wait before row r until the planes
+// its properties are taken from (the planes before it, and alpha) have decoded row r
+class PlaneProgress {
+    std::atomic<uint32_t> rows[4];
+    std::mutex mutex;
+    std::condition_variable cond;
+    const int nump;
+
+    bool depends(const int p, const int pp) const {
+        return p != 3 && (pp < p || (pp == 3 && nump > 3));
+    }
+public:
+    // the waiting planes are only woken up every this many rows
+    static const uint32_t ROWS_STEP = 16;
 
+    PlaneProgress(const int numpIn) : nump(numpIn) { for (std::atomic<uint32_t> &r : rows) r = 0; }
+
+    void wait(const int p, const uint32_t r) {
+        for (int pp = 0; pp < nump; pp++) {
+            if (!depends(p, pp) || rows[pp] > r) continue;
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [&]{ return rows[pp] > r; });
+        }
+    }
+    // rows 0..r-1 of plane p are decoded
+    void done(const int p, const uint32_t r) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            rows[p] = r;
+        }
+        cond.notify_all();
+    }
+};
+
+// progress: if not NULL, plane p is decoded concurrently with the other planes (see PlaneProgress)
+template<typename Coder> void decode_scanlines_plane(FLIFContext &ctx, Coder &coder, Images &images, const FlatColorRanges *ranges, const int p, PlaneProgress *progress)
+{
     ColorVal min,max;
+    int nump = images[0].numPlanes();
+    Properties properties((nump>3?NB_PROPERTIES_scanlinesA[p]:NB_PROPERTIES_scanlines[p]));
+    StageTimer timer(ctx.timings, "plane " + std::to_string(p), (uint64_t)images[0].cols()*images[0].rows()*images.size());
+    for (uint32_t r = 0; r < images[0].rows(); r++) {
+        if (progress) progress->wait(p, r);
+        for (int fr=0; fr< (int)images.size(); fr++) {
+          Image& image = images[fr];
+          uint32_t begin=image.col_begin[r], end=image.col_end[r];
+          if (image.seen_before >= 0) { for(uint32_t c=0; c<image.cols(); c++) image.set(p,r,c,images[image.seen_before](p,r,c)); continue; }
+          const PredictorRows prows(image, 0, p, r);
+          if (fr>0) {
+            for (uint32_t c = 0; c < begin; c++)
+               if (nump>3 && p<3 && image(3,r,c) == 0) image.set(p,r,c,predict_and_calcProps_scanlines(ctx,properties,ranges,prows,p,r,c,min,max));
+               else {
+                 int oldframe=fr-1;  image.set(p,r,c,images[oldframe](p,r,c));
+                 while(p == 3 && image(p,r,c) < 0) {oldframe += image(p,r,c); assert(oldframe>=0); image.set(p,r,c,images[oldframe](p,r,c));}
+               }
+          } else {
+            if (nump>3 && p<3) { begin=0; end=image.cols(); }
+          }
+          for (uint32_t c = begin; c < end; c++) {
+            ColorVal guess = predict_and_calcProps_scanlines(ctx,properties,ranges,prows,p,r,c,min,max);
+            if (p==3 && min < -fr) min = -fr;
+            if (nump>3 && p<3 && image(3,r,c) <= 0) { if (image(3,r,c) == 0) image.set(p,r,c,guess); else image.set(p,r,c,images[fr+image(3,r,c)](p,r,c)); continue;}
+            ColorVal curr = coder.read_int(properties, min - guess, max - guess) + guess;
+            image.set(p,r,c, curr);
+          }
+          if (fr>0) {
+            for (uint32_t c = end; c < image.cols(); c++)
+               if (nump>3 && p<3 && image(3,r,c) == 0) image.set(p,r,c,predict_and_calcProps_scanlines(ctx,properties,ranges,prows,p,r,c,min,max));
+               else {
+                 int oldframe=fr-1;  image.set(p,r,c,images[oldframe](p,r,c));
+                 while(p == 3 && image(p,r,c) < 0) {oldframe += image(p,r,c); assert(oldframe>=0); image.set(p,r,c,images[oldframe](p,r,c));}
+               }
+          }
+        }
+        if (progress && ((r+1) % PlaneProgress::ROWS_STEP == 0 || r+1 == images[0].rows())) progress->done(p, r+1);
+    }
+}
+
+template<typename Coder> void decode_scanlines_inner(FLIFContext &ctx, std::vector<Coder*> &coders, Images &images, const FlatColorRanges *ranges)
+{
     int nump = images[0].numPlanes();
     int beginp = (nump>3 ? 3 : 0);
     for (int p = beginp, i=0; i++ < nump; p = (p+1)%nump) {
-        Properties properties((nump>3?NB_PROPERTIES_scanlinesA[p]:NB_PROPERTIES_scanlines[p]));
-        v_printf(2,"\r%i%% done [%i/%i] DEC[%ux%u]    ",(int)(100*pixels_done/pixels_todo),i,nump,images[0].cols(),images[0].rows());
+        v_printf(2,"\r%i%% done [%i/%i] DEC[%ux%u]    ",(int)(100*ctx.pixels_done/ctx.pixels_todo),i,nump,images[0].cols(),images[0].rows());
         v_printf(4,"\n");
-        pixels_done += images[0].cols()*images[0].rows();
+        ctx.pixels_done += images[0].cols()*images[0].rows();
         if (ranges->min(p) >= ranges->max(p)) continue;
-        for (uint32_t r = 0; r < images[0].rows(); r++) {
-            for (int fr=0; fr< (int)images.size(); fr++) {
-              Image& image = images[fr];
-              uint32_t begin=image.col_begin[r], end=image.col_end[r];
-              if (image.seen_before >= 0) { for(uint32_t c=0; c<image.cols(); c++) image.set(p,r,c,images[image.seen_before](p,r,c)); continue; }
-              if (fr>0) {
-                for (uint32_t c = 0; c < begin; c++)
-                   if (nump>3 && p<3 && image(3,r,c) == 0) image.set(p,r,c,predict_and_calcProps_scanlines(properties,ranges,image,p,r,c,min,max));
-                   else {
-                     int oldframe=fr-1;  image.set(p,r,c,images[oldframe](p,r,c));
-                     while(p == 3 && image(p,r,c) < 0) {oldframe += image(p,r,c); assert(oldframe>=0); image.set(p,r,c,images[oldframe](p,r,c));}
-                   }
-              } else {
-                if (nump>3 && p<3) { begin=0; end=image.cols(); }
-              }
-              for (uint32_t c = begin; c < end; c++) {
-                ColorVal guess = predict_and_calcProps_scanlines(properties,ranges,image,p,r,c,min,max);
-                if (p==3 && min < -fr) min = -fr;
-                if (nump>3 && p<3 && image(3,r,c) <= 0) { if (image(3,r,c) == 0) image.set(p,r,c,guess); else image.set(p,r,c,images[fr+image(3,r,c)](p,r,c)); continue;}
-                ColorVal curr = coders[p]->read_int(properties, min - guess, max - guess) + guess;
-                image.set(p,r,c, curr);
-              }
-              if (fr>0) {
-                for (uint32_t c = end; c < image.cols(); c++)
-                   if (nump>3 && p<3 && image(3,r,c) == 0) image.set(p,r,c,predict_and_calcProps_scanlines(properties,ranges,image,p,r,c,min,max));
-                   else {
-                     int oldframe=fr-1;  image.set(p,r,c,images[oldframe](p,r,c));
-                     while(p == 3 && image(p,r,c) < 0) {oldframe += image(p,r,c); assert(oldframe>=0); image.set(p,r,c,images[oldframe](p,r,c));}
-                   }
-              }
+        decode_scanlines_plane(ctx, *coders[p], images, ranges, p, NULL);
+    }
+}
+
+template<typename IO, typename Rac, typename Coder> void decode_scanlines_pass(FLIFContext &ctx, IO& io, Rac &rac, Images &images, const FlatColorRanges *ranges, std::vector<Tree> &forest)
+{
+    std::vector<Coder*> coders;
+    for (int p = 0; p < images[0].numPlanes(); p++) {
+        Ranges propRanges;
+        initPropRanges_scanlines(propRanges, *ranges, p);
+        coders.push_back(new Coder(rac, propRanges, forest[p]));
+    }
+    decode_scanlines_inner(ctx, coders, images, ranges);
+    for (int p = 0; p < images[0].numPlanes(); p++) {
+        delete coders[p];
+    }
+}
+
+// the next n bytes of io, in place for a reader on memory and read into copy otherwise;
+// size is how many of them there are (fewer if the file ends before)
+template<typename IO> void read_span(IO& io, const uint64_t n, std::vector<uint8_t> &copy, const uint8_t *&data, size_t &size)
+{
+    // in blocks, so a corrupt length does not allocate more than the file has
+    const size_t block = 1 << 20;
+    size = 0;
+    while (size < n && !io.eof()) {
+        copy.resize(size + std::min<uint64_t>(block, n - size));
+        size += io.read_block(&copy[size], copy.size() - size);
+    }
+    copy.resize(size);
+    data = copy.empty() ? NULL : &copy[0];
+}
+inline void read_span(BlobReader& io, const uint64_t n, std::vector<uint8_t> &copy, const uint8_t *&data, size_t &size)
+{
+    size = io.span(n, data);
+}
+
+// encoding 4: decodes the plane streams that follow the main RAC stream (see encode_scanlines_planar_pass), with the
+// lengths from the header, all planes at the same time, each in its own thread; returns false if the file ends
+// before the last stream does
+template<typename IO, typename Coder> bool decode_scanlines_planar_pass(FLIFContext &ctx, IO& io, Images &images, const FlatColorRanges *ranges, std::vector<Tree> &forest, const std::vector<uint64_t> &lengths)
+{
+    const int nump = images[0].numPlanes();
+    if ((int)lengths.size() != nump) { fprintf(stderr,"Wrong number of plane streams: %i\n", (int)lengths.size()); return false; }
+    bool complete = true;
+    std::vector<std::vector<uint8_t> > copies(nump);
+    std::vector<const uint8_t*> streams(nump, NULL);
+    std::vector<size_t> sizes(nump, 0);
+    for (int p = 0; p < nump; p++) {
+        read_span(io, lengths[p], copies[p], streams[p], sizes[p]);
+        if (sizes[p] < lengths[p]) complete = false;
+    }
+    if (!complete) v_printf(1,"Plane streams are incomplete (partial file?)\n");
+
+    std::vector<BlobReader*> readers;
+    std::vector<RacIn<BlobReader>*> racs;
+    std::vector<Coder*> coders;
+    for (int p = 0; p < nump; p++) {
+        Ranges propRanges;
+        initPropRanges_scanlines(propRanges, *ranges, p);
+        readers.push_back(new BlobReader(streams[p], sizes[p]));
+        racs.push_back(new RacIn<BlobReader>(*readers[p]));
+        coders.push_back(new Coder(*racs[p], propRanges, forest[p]));
+    }
+
+    const unsigned int nb_threads = std::min<unsigned int>(ctx.threads, nump);
+    if (nb_threads < 2) {
+        // nothing to gain from threads: the planes one after the other, as in encoding 1
+        decode_scanlines_inner(ctx, coders, images, ranges);
+    } else {
+        v_printf(2,"\rDecoding %i planes concurrently DEC[%ux%u]    ",nump,images[0].cols(),images[0].rows());
+        v_printf(4,"\n");
+        PlaneProgress progress(nump);
+        std::vector<FLIFContext> pctx(nump, ctx);
+        for (int p = 0; p < nump; p++) pctx[p].timings = NULL;
+        // the planes are handed out in order, so the planes a plane waits for have been started before it
+        std::atomic<int> next(0);
+        auto work = [&]() {
+            for (int p; (p = next++) < nump; ) {
+                if (ranges->min(p) < ranges->max(p)) decode_scanlines_plane(pctx[p], *coders[p], images, ranges, p, &progress);
+                else progress.done(p, images[0].rows());
+            }
+        };
+        std::vector<std::thread> workers;
+        for (unsigned int i = 0; i < nb_threads; i++) workers.push_back(std::thread(work));
+        for (std::thread &w : workers) w.join();
+        ctx.pixels_done += (int64_t)images[0].cols()*images[0].rows()*nump;
+    }
+
+    for (int p = 0; p < nump; p++) {
+        delete coders[p];
+        delete racs[p];
+        delete readers[p];
+    }
+    return complete;
+}
+
+// Passes the rows of a row-interleaved file (encoding 3) to FLIFDecodeOptions::row_callback as soon as they are decoded,
+// after the inverse transforms (the ones for still images only work on single pixels), so the image is never stored.
+template<typename IO> class RowStreamer {
+    const FLIFDecodeOptions &options;
+    const std::vector<Transform<IO>*> &transforms;
+    const uint32_t rows;
+public:
+    bool ok;
+    RowStreamer(const FLIFDecodeOptions &o, const std::vector<Transform<IO>*> &t, const uint32_t r) : options(o), transforms(t), rows(r), ok(true) {}
+
+    // row wr of the window is row r of the image
+    void emit(const Image &window, const uint32_t wr, const uint32_t r) {
+        Images row(1);
+        row[0].init(window.cols(), 1, 0, window.max(0), window.numPlanes());
+        row[0].palette = window.palette;
+        for (int p = 0; p < window.numPlanes(); p++)
+            memcpy(row[0].row_pointer(p,0), window.row_pointer(p,wr), window.cols() * (window.wide_plane(p) ? sizeof(int32_t) : sizeof(int16_t)));
+        for (int i = transforms.size()-1; i >= 0; i--) transforms[i]->invData(row);
+        if (!options.row_callback(row[0], r, rows, options.row_user)) ok = false;
+        row[0].clear();
+    }
+};
+
+// encoding 3: all planes of a row before the next row. Decodes into image, or, if streamer is not NULL, into a window
+// of the last three rows (all the scanline predictor looks at), passing every row on to the streamer.
+template<typename IO, typename Coder> void decode_scanlines_interleaved_inner(FLIFContext &ctx, std::vector<Coder*> &coders, Image &image, const FlatColorRanges *ranges, const uint32_t rows, RowStreamer<IO> *streamer, RowChecksum &checksum)
+{
+    ColorVal min,max;
+    int nump = image.numPlanes();
+    int beginp = (nump>3 ? 3 : 0);
+    std::vector<Properties> properties;
+    for (int p = 0; p < nump; p++) properties.push_back(Properties((nump>3?NB_PROPERTIES_scanlinesA[p]:NB_PROPERTIES_scanlines[p])));
+    for (uint32_t r = 0; r < rows; r++) {
+        if (r % 256 == 0) v_printf(2,"\r%i%% done [%u/%u] DEC[%ux%u]    ",(int)(100*ctx.pixels_done/ctx.pixels_todo),r,rows,image.cols(),rows);
+        ctx.pixels_done += image.cols()*nump;
+        const uint32_t wr = (streamer ? std::min(r, 2u) : r);
+        if (streamer && r > 2) {
+            // the window moves down one row
+            for (int p = 0; p < nump; p++) {
+                const size_t rowsize = image.cols() * (image.wide_plane(p) ? sizeof(int32_t) : sizeof(int16_t));
+                memcpy(image.row_pointer(p,0), image.row_pointer(p,1), rowsize);
+                memcpy(image.row_pointer(p,1), image.row_pointer(p,2), rowsize);
+            }
+        }
+        for (int p = beginp, i=0; i++ < nump; p = (p+1)%nump) {
+            if (ranges->min(p) >= ranges->max(p)) continue;
+            const PredictorRows prows(image, 0, p, wr);
+            for (uint32_t c = 0; c < image.cols(); c++) {
+                ColorVal guess = predict_and_calcProps_scanlines(ctx,properties[p],ranges,prows,p,wr,c,min,max);
+                if (nump>3 && p<3 && image(3,wr,c) == 0) { image.set(p,wr,c,guess); continue; }
+                ColorVal curr = coders[p]->read_int(properties[p], min - guess, max - guess) + guess;
+                image.set(p,wr,c, curr);
             }
         }
+        checksum.add_row(image, wr);
+        if (streamer) {
+            streamer->emit(image, wr, r);
+            if (!streamer->ok) return;
+        }
     }
 }
 
-template<typename Rac, typename Coder> void decode_scanlines_pass(Rac &rac, Images &images, const ColorRanges *ranges, std::vector<Tree> &forest)
+template<typename IO, typename Rac, typename Coder> void decode_scanlines_interleaved_pass(FLIFContext &ctx, Rac &rac, Images &images, const FlatColorRanges *ranges, std::vector<Tree> &forest, const uint32_t rows, RowStreamer<IO> *streamer, RowChecksum &checksum)
 {
     std::vector<Coder*> coders;
     for (int p = 0; p < images[0].numPlanes(); p++) {
@@ -74,28 +279,18 @@ template<typename Rac, typename Coder> void decode_scanlines_pass(Rac &rac, Imag
         initPropRanges_scanlines(propRanges, *ranges, p);
         coders.push_back(new Coder(rac, propRanges, forest[p]));
     }
-    decode_scanlines_inner(coders, images, ranges);
+    decode_scanlines_interleaved_inner<IO>(ctx, coders, images[0], ranges, rows, streamer, checksum);
     for (int p = 0; p < images[0].numPlanes(); p++) {
         delete coders[p];
     }
 }
 
-// interpolate rest of the image
-// used when decoding lossy
-void decode_FLIF2_inner_interpol(Images &images, const ColorRanges *ranges, const int I, const int beginZL, const int endZL, const uint32_t R, const int scale)
+// interpolate zoomlevel z of plane p from the coarser zoomlevels, from row r0 on
+void interpolate_zoomlevel(Images &images, const int p, const int z, const uint32_t r0)
 {
-    for (int i = I; i < plane_zoomlevels(images[0], beginZL, endZL); i++) {
-      std::pair<int, int> pzl = plane_zoomlevel(images[0], beginZL, endZL, i);
-      int p = pzl.first;
-      int z = pzl.second;
-      if ( 1<<(z/2) < scale) continue;
-      pixels_done += images[0].cols(z)*images[0].rows(z)/2;
-      v_printf(2,"\r%i%% done [%i/%i] INTERPOLATE[%i,%ux%u]                 ",(int)(100*pixels_done/pixels_todo),i,plane_zoomlevels(images[0], beginZL, endZL)-1,p,images[0].cols(z),images[0].rows(z));
-      v_printf(5,"\n");
-
       if (z % 2 == 0) {
         // horizontal: scan the odd rows
-          for (uint32_t r = (I==i?R:1); r < images[0].rows(z); r += 2) {
+          for (uint32_t r = r0; r < images[0].rows(z); r += 2) {
             for (Image& image : images) {
               if (image.palette == false) {
                for (uint32_t c = 0; c < image.cols(z); c++) {
@@ -110,7 +305,7 @@ void decode_FLIF2_inner_interpol(Images &images, const ColorRanges *ranges, cons
           }
       } else {
         // vertical: scan the odd columns
-          for (uint32_t r = (I==i?R:0); r < images[0].rows(z); r++) {
+          for (uint32_t r = r0; r < images[0].rows(z); r++) {
             for (Image& image : images) {
               if (image.palette == false) {
                for (uint32_t c = 1; c < image.cols(z); c += 2) {
@@ -124,61 +319,109 @@ void decode_FLIF2_inner_interpol(Images &images, const ColorRanges *ranges, cons
             }
           }
       }
+}
+
+// interpolate rest of the image
+// used when decoding lossy
+void decode_FLIF2_inner_interpol(FLIFContext &ctx, Images &images, const FlatColorRanges *ranges, const std::vector<PlaneZoomlevel> &schedule, const int I, const uint32_t R, const int scale)
+{
+    for (int i = I; i < (int)schedule.size(); i++) {
+      const int p = schedule[i].p;
+      const int z = schedule[i].z;
+      if ( 1<<(z/2) < scale) continue;
+      ctx.pixels_done += schedule[i].pixels;
+      v_printf(2,"\r%i%% done [%i/%i] INTERPOLATE[%i,%ux%u]                 ",(int)(100*ctx.pixels_done/ctx.pixels_todo),i,(int)schedule.size()-1,p,images[0].cols(z),images[0].rows(z));
+      v_printf(5,"\n");
+      interpolate_zoomlevel(images, p, z, (I==i ? R : (z%2 == 0 ? 1 : 0)));
     }
     v_printf(2,"\n");
 }
 
-template<typename Coder> void decode_FLIF2_inner(std::vector<Coder*> &coders, Images &images, const ColorRanges *ranges, const int beginZL, const int endZL, int quality, int scale)
-{
-    ColorVal min,max;
-    int nump = images[0].numPlanes();
-//    if (quality >= 0) {
-//      quality = plane_zoomlevels(image, beginZL, endZL) * quality / 100;
-//    }
-    // decode
-    for (int i = 0; i < plane_zoomlevels(images[0], beginZL, endZL); i++) {
-      std::pair<int, int> pzl = plane_zoomlevel(images[0], beginZL, endZL, i);
-      int p = pzl.first;
-      int z = pzl.second;
-      if ((100*pixels_done > quality*pixels_todo) ||  1<<(z/2) < scale) {
-              decode_FLIF2_inner_interpol(images, ranges, i, beginZL, endZL, (z%2 == 0 ?1:0), scale);
-              return;
-      }
-      if (endZL == 0) v_printf(2,"\r%i%% done [%i/%i] DEC[%i,%ux%u]  ",(int)(100*pixels_done/pixels_todo),i,plane_zoomlevels(images[0], beginZL, endZL)-1,p,images[0].cols(z),images[0].rows(z));
-      pixels_done += images[0].cols(z)*images[0].rows(z)/2;
-      if (ranges->min(p) >= ranges->max(p)) continue;
+// Renders the previews for FLIFDecodeOptions::preview_callback: a downscaled copy of the partially decoded
+// image(s), with the missing zoomlevels interpolated and the inverse transforms applied to the copy.
+template<typename IO> class PreviewRenderer {
+    const FLIFDecodeOptions &options;
+    const std::vector<Transform<IO>*> &transforms;
+    std::vector<int> done;      // per plane: the zoomlevels from this one up are decoded
+    int shown;                  // most detailed zoomlevel of which a complete preview was shown
+    int zooms;
+    long next_bytes;
+
+    void render(const Images &images, const int z, const long bytes) {
+        Images preview;
+        for (const Image &image : images) preview.push_back(image.zoom_copy(z));
+        for (int p = 0; p < (int)done.size(); p++)
+          for (int zz = std::min(done[p], zooms+1)-1; zz >= z; zz--)
+            interpolate_zoomlevel(preview, p, zz-z, ((zz-z)%2 == 0 ? 1 : 0));
+        for (int i = transforms.size()-1; i >= 0; i--) transforms[i]->invData(preview);
+        options.preview_callback(preview, 1<<(z/2), bytes, options.preview_user);
+        for (Image &image : preview) image.clear();
+    }
+
+public:
+    PreviewRenderer(const FLIFDecodeOptions &o, const std::vector<Transform<IO>*> &t, const Image &image, const FlatColorRanges *ranges)
+      : options(o), transforms(t), done(ranges->numPlanes(), image.zooms()+1), shown(image.zooms()+2), zooms(image.zooms()), next_bytes(o.preview_bytes) {
+        // constant planes are complete from the start
+        for (int p = 0; p < ranges->numPlanes(); p++) if (ranges->min(p) >= ranges->max(p)) done[p] = 0;
+    }
+
+    // zoomlevel z of plane p is decoded, bytes bytes have been read
+    void step_done(const Images &images, const int p, const int z, const long bytes) {
+        done[p] = z;
+        int complete = *std::max_element(done.begin(), done.end());
+        complete += complete & 1;
+        if (complete > 0 && complete < shown && complete <= zooms) {
+            shown = complete;
+            render(images, complete, bytes);
+        } else if (options.preview_bytes > 0 && bytes >= next_bytes) {
+            int detail = *std::min_element(done.begin(), done.end());
+            render(images, detail + (detail & 1), bytes);
+        }
+        if (options.preview_bytes > 0) while (next_bytes <= bytes) next_bytes += options.preview_bytes;
+    }
+};
+
+// the per-pixel loops of one (plane, zoomlevel) step, compiled separately per direction, alpha presence and plane role
+// returns false if the file ended early (the rest of the image is interpolated then)
+template<typename IO, typename Coder> struct DecodeZoomlevel {
+    template<bool horizontal, bool alpha, int role> static bool run(FLIFContext &ctx, IO& io, Coder &coder, Images &images, const FlatColorRanges *ranges, const std::vector<PlaneZoomlevel> &schedule, const int i, const int scale)
+    {
+      ColorVal min,max;
+      const int p = schedule[i].p;
+      const int z = schedule[i].z;
       ColorVal curr;
-      Properties properties((nump>3?NB_PROPERTIESA[p]:NB_PROPERTIES[p]));
-      if (z % 2 == 0) {
+      Properties properties((alpha?NB_PROPERTIESA[p]:NB_PROPERTIES[p]));
+      if (horizontal) {
           for (uint32_t r = 1; r < images[0].rows(z); r += 2) {
 #ifdef CHECK_FOR_BROKENFILES
-            if (feof(f)) {
+            if (io.eof()) {
               v_printf(1,"Row %i: Unexpected file end. Interpolation from now on.\n",r);
-              decode_FLIF2_inner_interpol(images, ranges, i, beginZL, endZL, (r>1?r-2:r), scale);
-              return;
+              decode_FLIF2_inner_interpol(ctx, images, ranges, schedule, i, (r>1?r-2:r), scale);
+              return false;
             }
 #endif
             for (int fr=0; fr<(int)images.size(); fr++) {
               Image& image = images[fr];
               if (image.seen_before >= 0) { for (uint32_t c=0; c<image.cols(z); c++) image.set(p,z,r,c,images[image.seen_before](p,z,r,c)); continue; }
+              const PredictorRows prows(image, z, p, r);
               uint32_t begin=image.col_begin[r*image.zoom_rowpixelsize(z)]/image.zoom_colpixelsize(z), end=1+(image.col_end[r*image.zoom_rowpixelsize(z)]-1)/image.zoom_colpixelsize(z);
               if (fr>0) {
                 for (uint32_t c = 0; c < begin; c++)
-                            if (nump>3 && p<3 && image(3,z,r,c) == 0) image.set(p,z,r,c, predict(image,z,p,r,c));
+                            if (alpha && role != PLANE_ALPHA && image(3,z,r,c) == 0) image.set(p,z,r,c, predict(image,z,p,r,c));
                             else { int oldframe=fr-1;  image.set(p,z,r,c,images[oldframe](p,z,r,c));
-                                   while(p == 3 && image(p,z,r,c) < 0) {oldframe += image(p,z,r,c); assert(oldframe>=0); image.set(p,z,r,c,images[oldframe](p,z,r,c));}}
+                                   while(role == PLANE_ALPHA && image(p,z,r,c) < 0) {oldframe += image(p,z,r,c); assert(oldframe>=0); image.set(p,z,r,c,images[oldframe](p,z,r,c));}}
                 for (uint32_t c = end; c < image.cols(z); c++)
-                            if (nump>3 && p<3 && image(3,z,r,c) == 0) image.set(p,z,r,c, predict(image,z,p,r,c));
+                            if (alpha && role != PLANE_ALPHA && image(3,z,r,c) == 0) image.set(p,z,r,c, predict(image,z,p,r,c));
                             else { int oldframe=fr-1;  image.set(p,z,r,c,images[oldframe](p,z,r,c));
-                                   while(p == 3 && image(p,z,r,c) < 0) {oldframe += image(p,z,r,c); assert(oldframe>=0); image.set(p,z,r,c,images[oldframe](p,z,r,c));}}
+                                   while(role == PLANE_ALPHA && image(p,z,r,c) < 0) {oldframe += image(p,z,r,c); assert(oldframe>=0); image.set(p,z,r,c,images[oldframe](p,z,r,c));}}
               } else {
-                if (nump>3 && p<3) { begin=0; end=image.cols(z); }
+                if (alpha && role != PLANE_ALPHA) { begin=0; end=image.cols(z); }
               }
               for (uint32_t c = begin; c < end; c++) {
-                     if (nump>3 && p<3 && image(3,z,r,c) <= 0) { if (image(3,z,r,c) == 0) image.set(p,z,r,c,predict(image,z,p,r,c)); else image.set(p,z,r,c,images[fr+image(3,z,r,c)](p,z,r,c)); continue;}
-                     ColorVal guess = predict_and_calcProps(properties,ranges,image,z,p,r,c,min,max);
-                     if (p==3 && min < -fr) min = -fr;
-                     curr = coders[p]->read_int(properties, min - guess, max - guess) + guess;
+                     if (alpha && role != PLANE_ALPHA && image(3,z,r,c) <= 0) { if (image(3,z,r,c) == 0) image.set(p,z,r,c,predict(image,z,p,r,c)); else image.set(p,z,r,c,images[fr+image(3,z,r,c)](p,z,r,c)); continue;}
+                     ColorVal guess = predict_and_calcProps<horizontal,alpha,role>(ctx,properties,ranges,prows,p,r,c,min,max);
+                     if (role == PLANE_ALPHA && min < -fr) min = -fr;
+                     curr = coder.read_int(properties, min - guess, max - guess) + guess;
                      image.set(p,z,r,c, curr);
               }
             }
@@ -186,49 +429,84 @@ template<typename Coder> void decode_FLIF2_inner(std::vector<Coder*> &coders, Im
       } else {
           for (uint32_t r = 0; r < images[0].rows(z); r++) {
 #ifdef CHECK_FOR_BROKENFILES
-            if (feof(f)) {
+            if (io.eof()) {
               v_printf(1,"Row %i: Unexpected file end. Interpolation from now on.\n", r);
-              decode_FLIF2_inner_interpol(images, ranges, i, beginZL, endZL, (r>0?r-1:r), scale);
-              return;
+              decode_FLIF2_inner_interpol(ctx, images, ranges, schedule, i, (r>0?r-1:r), scale);
+              return false;
             }
 #endif
             for (int fr=0; fr<(int)images.size(); fr++) {
               Image& image = images[fr];
               if (image.seen_before >= 0) { for (uint32_t c=1; c<image.cols(z); c+=2) image.set(p,z,r,c,images[image.seen_before](p,z,r,c)); continue; }
+              const PredictorRows prows(image, z, p, r);
               uint32_t begin=(image.col_begin[r*image.zoom_rowpixelsize(z)]/image.zoom_colpixelsize(z)),
               end=(1+(image.col_end[r*image.zoom_rowpixelsize(z)]-1)/image.zoom_colpixelsize(z))|1;
               if (begin>1 && ((begin&1) ==0)) begin--;
               if (begin==0) begin=1;
               if (fr>0) {
                 for (uint32_t c = 1; c < begin; c+=2)
-                     if (nump>3 && p<3 && image(3,z,r,c) == 0) image.set(p,z,r,c, predict(image,z,p,r,c));
+                     if (alpha && role != PLANE_ALPHA && image(3,z,r,c) == 0) image.set(p,z,r,c, predict(image,z,p,r,c));
                      else { int oldframe=fr-1;  image.set(p,z,r,c,images[oldframe](p,z,r,c));
-                            while(p == 3 && image(p,z,r,c) < 0) {oldframe += image(p,z,r,c); assert(oldframe>=0); image.set(p,z,r,c,images[oldframe](p,z,r,c));}}
+                            while(role == PLANE_ALPHA && image(p,z,r,c) < 0) {oldframe += image(p,z,r,c); assert(oldframe>=0); image.set(p,z,r,c,images[oldframe](p,z,r,c));}}
                 for (uint32_t c = end; c < image.cols(z); c+=2)
-                     if (nump>3 && p<3 && image(3,z,r,c) == 0) image.set(p,z,r,c, predict(image,z,p,r,c));
+                     if (alpha && role != PLANE_ALPHA && image(3,z,r,c) == 0) image.set(p,z,r,c, predict(image,z,p,r,c));
                      else { int oldframe=fr-1;  image.set(p,z,r,c,images[oldframe](p,z,r,c));
-                            while(p == 3 && image(p,z,r,c) < 0) {oldframe += image(p,z,r,c); assert(oldframe>=0); image.set(p,z,r,c,images[oldframe](p,z,r,c));}}
+                            while(role == PLANE_ALPHA && image(p,z,r,c) < 0) {oldframe += image(p,z,r,c); assert(oldframe>=0); image.set(p,z,r,c,images[oldframe](p,z,r,c));}}
               } else {
-                if (nump>3 && p<3) { begin=1; end=image.cols(z); }
+                if (alpha && role != PLANE_ALPHA) { begin=1; end=image.cols(z); }
               }
               for (uint32_t c = begin; c < end; c+=2) {
-                     if (nump>3 && p<3 && image(3,z,r,c) <= 0) { if (image(3,z,r,c) == 0) image.set(p,z,r,c,predict(image,z,p,r,c)); else image.set(p,z,r,c,images[fr+image(3,z,r,c)](p,z,r,c)); continue;}
-                     ColorVal guess = predict_and_calcProps(properties,ranges,image,z,p,r,c,min,max);
-                     if (p==3 && min < -fr) min = -fr;
-                     curr = coders[p]->read_int(properties, min - guess, max - guess) + guess;
+                     if (alpha && role != PLANE_ALPHA && image(3,z,r,c) <= 0) { if (image(3,z,r,c) == 0) image.set(p,z,r,c,predict(image,z,p,r,c)); else image.set(p,z,r,c,images[fr+image(3,z,r,c)](p,z,r,c)); continue;}
+                     ColorVal guess = predict_and_calcProps<horizontal,alpha,role>(ctx,properties,ranges,prows,p,r,c,min,max);
+                     if (role == PLANE_ALPHA && min < -fr) min = -fr;
+                     curr = coder.read_int(properties, min - guess, max - guess) + guess;
                      image.set(p,z,r,c, curr);
               }
             }
         }
       }
+      return true;
+    }
+};
+
+// previews: NULL, or the preview renderer to tell about every decoded step
+template<typename IO, typename Coder> void decode_FLIF2_inner(FLIFContext &ctx, IO& io, std::vector<Coder*> &coders, Images &images, const FlatColorRanges *ranges, const std::vector<PlaneZoomlevel> &schedule, const int endZL, int quality, int scale, PreviewRenderer<IO> *previews)
+{
+    int nump = images[0].numPlanes();
+//    if (quality >= 0) {
+//      quality = plane_zoomlevels(image, beginZL, endZL) * quality / 100;
+//    }
+    // decode
+    for (int i = 0; i < (int)schedule.size(); i++) {
+      const int p = schedule[i].p;
+      const int z = schedule[i].z;
+      if ((100*ctx.pixels_done > quality*ctx.pixels_todo) ||  1<<(z/2) < scale) {
+              decode_FLIF2_inner_interpol(ctx, images, ranges, schedule, i, (z%2 == 0 ?1:0), scale);
+              return;
+      }
+#ifdef CHECK_FOR_BROKENFILES
+      if (io.at_end()) {
+              // a prefix that ends after the previous step (see FLIFIndex)
+              v_printf(2,"File ends after %i steps. Interpolation from now on.\n", i);
+              decode_FLIF2_inner_interpol(ctx, images, ranges, schedule, i, (z%2 == 0 ?1:0), scale);
+              return;
+      }
+#endif
+      if (endZL == 0) v_printf(2,"\r%i%% done [%i/%i] DEC[%i,%ux%u]  ",(int)(100*ctx.pixels_done/ctx.pixels_todo),i,(int)schedule.size()-1,p,images[0].cols(z),images[0].rows(z));
+      ctx.pixels_done += schedule[i].pixels;
+      if (ranges->min(p) >= ranges->max(p)) continue;
+      StageTimer timer(ctx.timings, "plane " + std::to_string(p) + ", zoomlevel " + std::to_string(z), schedule[i].pixels*images.size());
+      if (!dispatch_zoomlevel<DecodeZoomlevel<IO, Coder> >(nump, p, z, ctx, io, *coders[p], images, ranges, schedule, i, scale)) return;
+      timer.done();
+      if (previews) previews->step_done(images, p, z, io.tell());
       if (endZL==0) {
-          v_printf(3,"    read %li bytes   ", ftell(f));
+          v_printf(3,"    read %li bytes   ", io.tell());
           v_printf(5,"\n");
       }
     }
 }
 
-template<typename Rac, typename Coder> void decode_FLIF2_pass(Rac &rac, Images &images, const ColorRanges *ranges, std::vector<Tree> &forest, const int beginZL, const int endZL, int quality, int scale)
+template<typename IO, typename Rac, typename Coder> void decode_FLIF2_pass(FLIFContext &ctx, IO& io, Rac &rac, Images &images, const FlatColorRanges *ranges, std::vector<Tree> &forest, const int beginZL, const int endZL, int quality, int scale, PreviewRenderer<IO> *previews)
 {
     std::vector<Coder*> coders;
     for (int p = 0; p < images[0].numPlanes(); p++) {
@@ -246,7 +524,8 @@ template<typename Rac, typename Coder> void decode_FLIF2_pass(Rac &rac, Images &
       }
     }
 
-    decode_FLIF2_inner(coders, images, ranges, beginZL, endZL, quality, scale);
+    const std::vector<PlaneZoomlevel> schedule = plane_zoomlevel_schedule(images[0], beginZL, endZL);
+    decode_FLIF2_inner(ctx, io, coders, images, ranges, schedule, endZL, quality, scale, previews);
 
     for (int p = 0; p < images[0].numPlanes(); p++) {
         delete coders[p];
@@ -259,7 +538,7 @@ template<typename BitChance, typename Rac> void decode_tree(Rac &rac, const Colo
 {
     for (int p = 0; p < ranges->numPlanes(); p++) {
         Ranges propRanges;
-        if (encoding==1) initPropRanges_scanlines(propRanges, *ranges, p);
+        if (scanline_encoding(encoding)) initPropRanges_scanlines(propRanges, *ranges, p);
         else initPropRanges(propRanges, *ranges, p);
         MetaPropertySymbolCoder<BitChance, Rac> metacoder(rac, propRanges);
         if (ranges->min(p)<ranges->max(p))
@@ -270,38 +549,234 @@ template<typename BitChance, typename Rac> void decode_tree(Rac &rac, const Colo
 
 
 
-bool decode(const char* filename, Images &images, int quality, int scale)
+// the part of the crop rectangle of options inside a width x height image (the whole image if there is no crop rectangle);
+// false if there is nothing left of it
+static bool crop_rectangle(const FLIFDecodeOptions &options, const uint32_t width, const uint32_t height, uint32_t &x, uint32_t &y, uint32_t &w, uint32_t &h)
+{
+    x = 0; y = 0; w = width; h = height;
+    if (options.crop_width == 0) return true;
+    if (options.crop_height == 0 || options.crop_x >= width || options.crop_y >= height) return false;
+    x = options.crop_x;
+    y = options.crop_y;
+    w = std::min(options.crop_width, width - x);
+    h = std::min(options.crop_height, height - y);
+    return true;
+}
+
+// the stored positions j (from b up to e) of a row or column of n stored pixels, ds apart, starting at pos,
+// that fall in the len pixels from src_pos on
+static void overlap(const uint64_t pos, const uint32_t ds, const uint32_t n, const uint64_t src_pos, const uint64_t len, uint32_t &b, uint32_t &e)
+{
+    e = (src_pos + len > pos ? std::min<uint64_t>(n, (src_pos + len - pos + ds - 1) / ds) : 0);
+    b = (src_pos > pos ? std::min<uint64_t>(e, (src_pos - pos + ds - 1) / ds) : 0);
+}
+
+// Copies src, the part of the full image at (src_x, src_y), to dst, the part at (dst_x, dst_y), where they overlap.
+// Both can be stored downscaled (see Image::scale()): every pixel of dst gets the nearest one of src above and left of it.
+static void copy_region(const Image &src, const uint32_t src_x, const uint32_t src_y, Image &dst, const uint32_t dst_x, const uint32_t dst_y)
+{
+    const uint32_t ss = src.scale(), ds = dst.scale();
+    uint32_t rb, re, cb, ce;
+    overlap(dst_y, ds, dst.rows(), src_y, src.rows(0), rb, re);
+    overlap(dst_x, ds, dst.cols(), src_x, src.cols(0), cb, ce);
+    for (int p = 0; p < dst.numPlanes(); p++)
+      for (uint32_t r = rb; r < re; r++) {
+        const uint32_t sr = (dst_y + (uint64_t)r*ds - src_y) / ss;
+        for (uint32_t c = cb; c < ce; c++) dst.set(p,r,c, src(p,sr,(dst_x + (uint64_t)c*ds - src_x) / ss));
+      }
+}
+
+// crops decoded images to the crop rectangle of options
+static bool crop_images(Images &images, const FLIFDecodeOptions &options)
+{
+    uint32_t x, y, w, h;
+    if (!crop_rectangle(options, images[0].cols(0), images[0].rows(0), x, y, w, h)) { fprintf(stderr,"Crop rectangle is outside the %ux%u image\n", images[0].cols(0), images[0].rows(0)); return false; }
+    for (Image &image : images) {
+        Image cropped;
+        cropped.init(w, h, image.min(0), image.max(0), image.numPlanes(), image.scale());
+        copy_region(image, 0, 0, cropped, x, y);
+        image.clear();
+        image = cropped;
+    }
+    return true;
+}
+
+// the encoding of the FLIF file in data (0 if it is not one)
+static int file_encoding(const uint8_t *data, const size_t size)
+{
+    if (size < 5) return 0;
+    if (!memcmp(&data[0], "FLIX", 4)) return data[4];
+    if (memcmp(&data[0], "FLIF", 4)) return 0;
+    int c = data[4] - ' ';
+    return (c > 47 ? c - 32 : c) / 16;
+}
+
+// encoding 5 (see flif_encode_tiles), from the byte with the color depth on: decodes the tiles that overlap
+// the crop rectangle, concurrently, into one image of the rectangle
+template <typename IO>
+bool flif_decode_tiles(IO& io, const char* filename, Images &images, const FLIFDecodeOptions &options, const int numPlanes, const int c)
+{
+    int maxmax = (c=='2' ? 65535 : 255);
+    if (c=='0') {
+        maxmax = 0;
+        for (int p = 0; p < numPlanes; p++) {
+            int bits = io.read();
+            if (bits < 1 || bits > 16) { fprintf(stderr,"Invalid tile header in file: %s\n",filename); return false; }
+            maxmax = std::max(maxmax, (1 << bits) - 1);
+        }
+    }
+    uint64_t width, height, tile_size;
+    if (!read_varint(io, width) || !read_varint(io, height) || !read_varint(io, tile_size)
+        || width < 1 || height < 1 || width > 0x7FFFFFFF || height > 0x7FFFFFFF || tile_size < 1 || tile_size > 0xFFFF
+        || ((width+tile_size-1)/tile_size) * ((height+tile_size-1)/tile_size) > 0x1000000) { fprintf(stderr,"Invalid tile header in file: %s\n",filename); return false; }
+    const uint32_t tiles_x = (width+tile_size-1)/tile_size;
+    std::vector<uint64_t> lengths(tiles_x * ((height+tile_size-1)/tile_size));
+    for (uint64_t &length : lengths) if (!read_varint(io, length)) { fprintf(stderr,"Invalid tile header in file: %s\n",filename); return false; }
+    uint32_t x, y, w, h;
+    if (!crop_rectangle(options, width, height, x, y, w, h)) { fprintf(stderr,"Crop rectangle is outside the %ux%u image\n", (uint32_t)width, (uint32_t)height); return false; }
+
+    // the tiles that overlap the rectangle, in place for a reader on memory (the others are skipped without
+    // reading them). If the file ends in a tile, that tile is decoded as a partial file; the tiles after it stay empty.
+    std::vector<std::vector<uint8_t> > copies(lengths.size());
+    std::vector<const uint8_t*> data(lengths.size(), NULL);
+    std::vector<size_t> sizes(lengths.size(), 0);
+    std::vector<size_t> needed;
+    uint32_t missing = 0;
+    for (size_t t = 0; t < lengths.size(); t++) {
+        const uint64_t x0 = (t % tiles_x)*tile_size, y0 = (t / tiles_x)*tile_size;
+        if (!(x0 < x+w && x0+tile_size > x && y0 < y+h && y0+tile_size > y)) { io.skip(lengths[t]); continue; }
+        read_span(io, lengths[t], copies[t], data[t], sizes[t]);
+        if (sizes[t] < lengths[t] && sizes[t] > 0) v_printf(1,"File ends in tile %u: decoding the part of it that is there (partial file?)\n", (uint32_t)t);
+        if (sizes[t] > 0 || lengths[t] == 0) needed.push_back(t);
+        else missing++;
+    }
+    v_printf(3,"Decoding %ux%u image: %u of %u tiles of at most %ux%u pixels\n", (uint32_t)width, (uint32_t)height, (uint32_t)needed.size(), (uint32_t)lengths.size(), (uint32_t)tile_size, (uint32_t)tile_size);
+    if (missing > 0) v_printf(1,"File ends before the last tile: %u tiles are missing and left empty (partial file?)\n", missing);
+
+    FLIFDecodeOptions tile_options;
+    tile_options.quality = options.quality;
+    tile_options.scale = options.scale;
+    // the threads go to the tiles first, a tile only gets threads of its own if there are fewer tiles than threads
+    const unsigned int budget = thread_budget(options.threads);
+    const unsigned int nb_threads = std::max<size_t>(1, std::min<size_t>(budget, needed.size()));
+    tile_options.threads = std::max(1u, budget / nb_threads);
+    if (!needed.empty() && file_encoding(data[needed[0]], sizes[needed[0]]) != 2 && (options.scale != 1 || options.quality < 100)) {
+        v_printf(1,"Cannot decode non-interlaced tiles at lower scale or quality! Ignoring...\n");
+        tile_options.scale = 1;
+        tile_options.quality = 100;
+    }
+    StageTimer timer(options.timings, "tiles", (uint64_t)w*h);
+    Image image;
+    image.init(w, h, 0, maxmax, numPlanes, options.scale);
+    std::atomic<size_t> next(0);
+    std::atomic<bool> ok(true);
+    auto work = [&]() {
+        for (size_t i; (i = next++) < needed.size(); ) {
+            const size_t t = needed[i];
+            const uint32_t x0 = (t % tiles_x)*tile_size, y0 = (t / tiles_x)*tile_size;
+            Images tile;
+            bool tile_ok = flif_decode_from_memory(data[t], sizes[t], tile, tile_options);
+            if (tile_ok && (tile.size() != 1 || tile[0].numPlanes() != numPlanes
+                            || tile[0].cols(0) != std::min<uint64_t>(tile_size, width-x0) || tile[0].rows(0) != std::min<uint64_t>(tile_size, height-y0))) {
+                fprintf(stderr,"Tile %u does not fit in the image\n", (uint32_t)t);
+                tile_ok = false;
+            }
+            if (tile_ok) copy_region(tile[0], x0, y0, image, x, y);
+            else if (sizes[t] < lengths[t]) v_printf(1,"Not enough of tile %u to decode it, leaving it empty\n", (uint32_t)t);
+            else { fprintf(stderr,"Could not decode tile %u\n", (uint32_t)t); ok = false; }
+            for (Image &i : tile) i.clear();
+            std::vector<uint8_t>().swap(copies[t]);
+        }
+    };
+    if (nb_threads == 1) work();
+    else {
+        std::vector<std::thread> workers;
+        for (unsigned int i = 0; i < nb_threads; i++) workers.push_back(std::thread(work));
+        for (std::thread &w : workers) w.join();
+    }
+    if (!ok) { image.clear(); return false; }
+    images.push_back(image);
+    v_printf(2,"\rDecoding done, %li bytes for %ux%u pixels of a %ux%u image   \n", io.tell(), w/options.scale, h/options.scale, (uint32_t)width, (uint32_t)height);
+    return true;
+}
+
+template <typename IO>
+bool flif_decode(IO& io, const char* filename, Images &images, const FLIFDecodeOptions &options)
 {
+    const int quality = options.quality;
+    int scale = options.scale;
+    FLIFTimings *timings = options.timings;
+    FLIFContext ctx;
+    ctx.timings = timings;
+    ctx.threads = thread_budget(options.threads);
+    StageTimer total(timings, "decode");
     if (scale != 1 && scale != 2 && scale != 4 && scale != 8 && scale != 16 && scale != 32 && scale != 64 && scale != 128) {
                 fprintf(stderr,"Invalid scale down factor: %i\n", scale);
                 return false;
     }
 
-    f = fopen(filename,"rb");
-    if (!f) { fprintf(stderr,"Could not open file: %s\n",filename); return false; }
     char buff[5];
-    if (!fgets(buff,5,f)) { fprintf(stderr,"Could not read header from file: %s\n",filename); return false; }
-    if (strcmp(buff,"FLIF")) { fprintf(stderr,"Not a FLIF file: %s\n",filename); return false; }
-    int c = fgetc(f)-' ';
-    int numFrames=1;
-    if (c > 47) {
-        c -= 32;
-        numFrames = fgetc(f);
-    }
-    int encoding=c/16;
-    if (scale != 1 && encoding==1) { v_printf(1,"Cannot decode non-interlaced FLIF file at lower scale! Ignoring scale...\n");}
-    if (quality < 100 && encoding==1) { v_printf(1,"Cannot decode non-interlaced FLIF file at lower quality! Ignoring quality...\n");}
-    int numPlanes=c%16;
-    c = fgetc(f);
-
-    int width=fgetc(f) << 8;
-    width += fgetc(f);
-    int height=fgetc(f) << 8;
-    height += fgetc(f);
-    // TODO: implement downscaled decoding without allocating a fullscale image buffer!
-
-    RacIn rac(f);
-    SimpleSymbolCoder<FLIFBitChanceMeta, RacIn, 24> metaCoder(rac);
+    for (int i=0; i<4; i++) buff[i] = io.read();
+    buff[4] = 0;
+    if (io.eof()) { fprintf(stderr,"Could not read header from file: %s\n",filename); return false; }
+    if (strcmp(buff,"FLIF") && strcmp(buff,"FLIX")) { fprintf(stderr,"Not a FLIF file: %s\n",filename); return false; }
+    int encoding, numPlanes, numFrames=1;
+    if (buff[3] == 'X') {
+        // see flif_encode: encodings from 3 on
+        encoding = io.read();
+        numPlanes = io.read();
+        numFrames = io.read();
+        if (encoding < 3) encoding = 0;
+    } else {
+        int c = io.read()-' ';
+        if (c > 47) {
+            c -= 32;
+            numFrames = io.read();
+        }
+        encoding=c/16;
+        numPlanes=c%16;
+        if (encoding > 2) encoding = 0;
+    }
+    if (encoding < 1 || encoding > 5 || numFrames < 1 || numPlanes < 1 || numPlanes > 4 || ((encoding == 3 || encoding == 5) && numFrames > 1)) { fprintf(stderr,"Unknown encoding in file: %s\n",filename); return false; }
+    if (scale != 1 && scanline_encoding(encoding)) { v_printf(1,"Cannot decode non-interlaced FLIF file at lower scale! Ignoring scale...\n");}
+    if (quality < 100 && scanline_encoding(encoding)) { v_printf(1,"Cannot decode non-interlaced FLIF file at lower quality! Ignoring quality...\n");}
+    // row-interleaved files can be passed on row by row, without storing the image
+    const bool streaming = (encoding == 3 && options.row_callback && options.crop_width == 0);
+    int c = io.read();
+    if (encoding == 5) {
+        if (!flif_decode_tiles(io, filename, images, options, numPlanes, c)) return false;
+        total.set_pixels((uint64_t)images[0].rows()*images[0].cols());
+        return true;
+    }
+
+    int width=io.read() << 8;
+    width += io.read();
+    int height=io.read() << 8;
+    height += io.read();
+    if (encoding == 2 && scale > 1) {
+        // the rough pass (the zoomlevels before the MANIAC tree) is decoded completely, so for small images
+        // the pixels are stored at a lower scale than asked (Image::save() downscales them)
+        int zooms = 0;
+        while ((1<<((zooms+1)/2)) < height || (1<<(zooms/2)) < width) zooms++;
+        const int rough_scale = 1 << ((std::max(zooms - NB_NOLEARN_ZOOMS - 1, 0) + 1)/2);
+        if (scale > rough_scale) {
+            v_printf(3,"Decoding %ux%u image at scale 1:%i instead of 1:%i\n", width, height, rough_scale, scale);
+            scale = rough_scale;
+        }
+    }
+    total.set_pixels((uint64_t)width*height*numFrames/(encoding == 2 ? scale*scale : 1));
+    // encoding 4: the number of plane streams and their lengths (see flif_encode)
+    std::vector<uint64_t> plane_lengths;
+    if (encoding == 4) {
+        uint64_t streams = 0;
+        bool ok = read_varint(io, streams) && streams >= 1 && streams <= 4;
+        plane_lengths.resize(ok ? streams : 0);
+        for (uint64_t &length : plane_lengths) ok = ok && read_varint(io, length);
+        if (!ok) { fprintf(stderr,"Could not read header from file: %s\n",filename); return false; }
+    }
+
+    RacIn<IO> rac(io);
+    SimpleSymbolCoder<FLIFBitChanceMeta, RacIn<IO>, 24> metaCoder(rac);
 
 //    image.init(width, height, 0, 0, 0);
     v_printf(3,"Decoding %ux%u image, channels:",width,height);
@@ -330,16 +805,19 @@ bool decode(const char* filename, Images &images, int quality, int scale)
     for (int i=0; i<numFrames; i++) {
       Image image;
       images.push_back(image);
-      images[i].init(width,height,0,maxmax,numPlanes);
+      // at a lower scale, only the zoomlevels that are decoded are allocated
+      images[i].init(width,(streaming ? std::min(height,3) : height),0,maxmax,numPlanes,(encoding==2 ? scale : 1));
     }
     std::vector<const ColorRanges*> rangesList;
-    std::vector<Transform*> transforms;
+    std::vector<Transform<IO>*> transforms;
+    std::vector<std::string> transform_names;
     rangesList.push_back(getRanges(images[0]));
     v_printf(4,"Transforms: ");
     int tcount=0;
+    StageTimer transforms_timer(timings, "transform metadata");
     while (rac.read()) {
         std::string desc = read_name(rac);
-        Transform *trans = create_transform(desc);
+        Transform<IO> *trans = create_transform<IO>(desc);
         if (!trans) {
             fprintf(stderr,"Unknown transformation '%s'\n", desc.c_str());
             return false;
@@ -348,23 +826,27 @@ bool decode(const char* filename, Images &images, int quality, int scale)
             fprintf(stderr,"Transformation '%s' failed\n", desc.c_str());
             return false;
         }
+        trans->set_threads(ctx.threads);
         if (tcount++ > 0) v_printf(4,", ");
         v_printf(4,"%s", desc.c_str());
         if (desc == "FRS") {
                 int unique_frames=images.size()-1; // not considering first frame
                 for (Image& i : images) if (i.seen_before >= 0) unique_frames--;
-                trans->configure(unique_frames*images[0].rows()); trans->configure(images[0].cols()); }
+                trans->configure(unique_frames*images[0].rows(0)); trans->configure(images[0].cols(0)); }
         if (desc == "DUP") { trans->configure(images.size()); }
         trans->load(rangesList.back(), rac);
         rangesList.push_back(trans->meta(images, rangesList.back()));
         transforms.push_back(trans);
+        transform_names.push_back(desc);
     }
     if (tcount==0) v_printf(4,"none\n"); else v_printf(4,"\n");
-    const ColorRanges* ranges = rangesList.back();
-    grey.clear();
-    for (int p = 0; p < ranges->numPlanes(); p++) grey.push_back((ranges->min(p)+ranges->max(p))/2);
+    transforms_timer.done();
+    FlatColorRanges flat_ranges(rangesList.back());
+    const FlatColorRanges* ranges = &flat_ranges;
+    ctx.grey.clear();
+    for (int p = 0; p < ranges->numPlanes(); p++) ctx.grey.push_back((ranges->min(p)+ranges->max(p))/2);
 
-    pixels_todo = width*height*ranges->numPlanes()/scale/scale;
+    ctx.pixels_todo = width*height*ranges->numPlanes()/scale/scale;
 
     for (int p = 0; p < ranges->numPlanes(); p++) {
       v_printf(7,"Plane %i: %i..%i\n",p,ranges->min(p),ranges->max(p));
@@ -395,45 +877,70 @@ bool decode(const char* filename, Images &images, int quality, int scale)
 
 
     std::vector<Tree> forest(ranges->numPlanes(), Tree());
+    RowStreamer<IO> row_streamer(options, transforms, height);
+    RowChecksum rows_checksum(width, height);
+    PreviewRenderer<IO> preview_renderer(options, transforms, images[0], ranges);
+    PreviewRenderer<IO> *previews = (options.preview_callback && encoding == 2 ? &preview_renderer : NULL);
 
     int roughZL = 0;
     if (encoding == 2) {
       roughZL = images[0].zooms() - NB_NOLEARN_ZOOMS-1;
       if (roughZL < 0) roughZL = 0;
 //      v_printf(2,"Decoding rough data\n");
-      if (bits==10) decode_FLIF2_pass<RacIn, FinalPropertySymbolCoder<FLIFBitChancePass2, RacIn, 10> >(rac, images, ranges, forest, images[0].zooms(), roughZL+1, 100, scale);
-      else decode_FLIF2_pass<RacIn, FinalPropertySymbolCoder<FLIFBitChancePass2, RacIn, 18> >(rac, images, ranges, forest, images[0].zooms(), roughZL+1, 100, scale);
+      StageTimer timer(timings, "rough pass");
+      if (bits==10) decode_FLIF2_pass<IO, RacIn<IO>, FinalPropertySymbolCoder<FLIFBitChancePass2, RacIn<IO>, 10> >(ctx, io, rac, images, ranges, forest, images[0].zooms(), roughZL+1, 100, scale, previews);
+      else decode_FLIF2_pass<IO, RacIn<IO>, FinalPropertySymbolCoder<FLIFBitChancePass2, RacIn<IO>, 18> >(ctx, io, rac, images, ranges, forest, images[0].zooms(), roughZL+1, 100, scale, previews);
     }
-    if (encoding == 2 && quality <= 0) {
+    if (encoding == 2 && (quality <= 0 || io.at_end())) {
       v_printf(3,"Not decoding MANIAC tree\n");
     } else {
       v_printf(3,"Decoded header + rough data. Decoding MANIAC tree.\n");
-      decode_tree<FLIFBitChanceTree, RacIn>(rac, ranges, forest, encoding);
+      StageTimer timer(timings, "MANIAC tree");
+      decode_tree<FLIFBitChanceTree, RacIn<IO> >(rac, ranges, forest, encoding);
     }
+    bool planes_complete = false;   // encoding 4: all plane streams are there
+    uint32_t planes_checksum = 0;
 //    if (encoding == 1 || quality > 0) {
+      StageTimer final_timer(timings, "final pass");
       switch(encoding) {
         case 1: v_printf(3,"Decoding data (scanlines)\n");
-                if (bits==10) decode_scanlines_pass<RacIn, FinalPropertySymbolCoder<FLIFBitChancePass2, RacIn, 10> >(rac, images, ranges, forest);
-                else decode_scanlines_pass<RacIn, FinalPropertySymbolCoder<FLIFBitChancePass2, RacIn, 18> >(rac, images, ranges, forest);
+                if (bits==10) decode_scanlines_pass<IO, RacIn<IO>, FinalPropertySymbolCoder<FLIFBitChancePass2, RacIn<IO>, 10> >(ctx, io, rac, images, ranges, forest);
+                else decode_scanlines_pass<IO, RacIn<IO>, FinalPropertySymbolCoder<FLIFBitChancePass2, RacIn<IO>, 18> >(ctx, io, rac, images, ranges, forest);
+                break;
+        case 3: v_printf(3,"Decoding data (row-interleaved scanlines%s)\n", streaming ? ", streaming" : "");
+                if (bits==10) decode_scanlines_interleaved_pass<IO, RacIn<IO>, FinalPropertySymbolCoder<FLIFBitChancePass2, RacIn<IO>, 10> >(ctx, rac, images, ranges, forest, height, (streaming ? &row_streamer : NULL), rows_checksum);
+                else decode_scanlines_interleaved_pass<IO, RacIn<IO>, FinalPropertySymbolCoder<FLIFBitChancePass2, RacIn<IO>, 18> >(ctx, rac, images, ranges, forest, height, (streaming ? &row_streamer : NULL), rows_checksum);
+                break;
+        case 4: v_printf(3,"Decoding data (scanlines, one stream per plane)\n");
+                // the checksum ends the main stream, before the plane streams
+                planes_checksum = metaCoder.read_int(0, 0xFFFF) * 0x10000;
+                planes_checksum += metaCoder.read_int(0, 0xFFFF);
+                if (bits==10) planes_complete = decode_scanlines_planar_pass<IO, FinalPropertySymbolCoder<FLIFBitChancePass2, RacIn<BlobReader>, 10> >(ctx, io, images, ranges, forest, plane_lengths);
+                else planes_complete = decode_scanlines_planar_pass<IO, FinalPropertySymbolCoder<FLIFBitChancePass2, RacIn<BlobReader>, 18> >(ctx, io, images, ranges, forest, plane_lengths);
                 break;
         case 2: v_printf(3,"Decoding data (FLIF2)\n");
-                if (bits==10) decode_FLIF2_pass<RacIn, FinalPropertySymbolCoder<FLIFBitChancePass2, RacIn, 10> >(rac, images, ranges, forest, roughZL, 0, quality, scale);
-                else decode_FLIF2_pass<RacIn, FinalPropertySymbolCoder<FLIFBitChancePass2, RacIn, 18> >(rac, images, ranges, forest, roughZL, 0, quality, scale);
+                if (bits==10) decode_FLIF2_pass<IO, RacIn<IO>, FinalPropertySymbolCoder<FLIFBitChancePass2, RacIn<IO>, 10> >(ctx, io, rac, images, ranges, forest, roughZL, 0, quality, scale, previews);
+                else decode_FLIF2_pass<IO, RacIn<IO>, FinalPropertySymbolCoder<FLIFBitChancePass2, RacIn<IO>, 18> >(ctx, io, rac, images, ranges, forest, roughZL, 0, quality, scale, previews);
                 break;
       }
+      final_timer.done();
 //    }
     if (numFrames==1)
-      v_printf(2,"\rDecoding done, %li bytes for %ux%u pixels (%.4fbpp)   \n",ftell(f), images[0].cols()/scale, images[0].rows()/scale, 1.0*ftell(f)/images[0].rows()/images[0].cols()/scale/scale);
+      v_printf(2,"\rDecoding done, %li bytes for %ux%u pixels (%.4fbpp)   \n",io.tell(), width/scale, height/scale, 1.0*io.tell()/height/width/scale/scale);
     else
-      v_printf(2,"\rDecoding done, %li bytes for %i frames of %ux%u pixels (%.4fbpp)   \n",ftell(f), numFrames, images[0].cols()/scale, images[0].rows()/scale, 1.0*ftell(f)/numFrames/images[0].rows()/images[0].cols()/scale/scale);
+      v_printf(2,"\rDecoding done, %li bytes for %i frames of %ux%u pixels (%.4fbpp)   \n",io.tell(), numFrames, width/scale, height/scale, 1.0*io.tell()/numFrames/height/width/scale/scale);
 
 
-    if (quality==100 && scale==1) {
-      uint32_t checksum = images[0].checksum();
+    if (quality==100 && scale==1 && (encoding == 4 ? planes_complete : !io.at_end())) {
+      StageTimer timer(timings, "checksum", images[0].rows()*images[0].cols());
+      uint32_t checksum = (encoding == 3 ? rows_checksum.value() : images[0].checksum());
       v_printf(8,"Computed checksum: %X\n", checksum);
-      uint32_t checksum2 = metaCoder.read_int(0, 0xFFFF);
-      checksum2 *= 0x10000;
-      checksum2 += metaCoder.read_int(0, 0xFFFF);
+      uint32_t checksum2 = planes_checksum;
+      if (encoding != 4) {
+        checksum2 = metaCoder.read_int(0, 0xFFFF);
+        checksum2 *= 0x10000;
+        checksum2 += metaCoder.read_int(0, 0xFFFF);
+      }
       v_printf(8,"Read checksum: %X\n", checksum2);
       if (checksum != checksum2) v_printf(1,"\nCORRUPTION DETECTED! (partial file?)\n\n");
       else v_printf(2,"Image decoded, checksum verified.\n");
@@ -441,8 +948,16 @@ bool decode(const char* filename, Images &images, int quality, int scale)
       v_printf(2,"Not checking checksum, lossy partial decoding was chosen.\n");
     }
 
+    if (streaming) {
+      // the rows went to the callback already
+      for (Image &image : images) image.clear();
+      images.clear();
+    }
+    const uint64_t pixels = (streaming ? 0 : (uint64_t)images[0].rows()*images[0].cols()*images.size());
+    if (!streaming && images[0].scale() > 1) v_printf(3,"Inverse transforms on the 1:%u image (%ux%u)\n", images[0].scale(), images[0].cols(), images[0].rows());
     for (int i=transforms.size()-1; i>=0; i--) {
-        transforms[i]->invData(images);
+        StageTimer timer(timings, "inverse transform " + transform_names[i], pixels);
+        if (!streaming) transforms[i]->invData(images);
         delete transforms[i];
     }
     transforms.clear();
@@ -453,8 +968,33 @@ bool decode(const char* filename, Images &images, int quality, int scale)
     }
     rangesList.clear();
 
-    fclose(f);
+    if (streaming && !row_streamer.ok) { fprintf(stderr,"Decoding stopped: could not pass on all rows\n"); return false; }
+    if (options.crop_width > 0 && !crop_images(images, options)) return false;
     return true;
 }
 
+bool decode(const char* filename, Images &images, int quality, int scale, FLIFTimings *timings)
+{
+    FLIFDecodeOptions options;
+    options.quality = quality;
+    options.scale = scale;
+    options.timings = timings;
+    return decode(filename, images, options);
+}
+
+bool decode(const char* filename, Images &images, const FLIFDecodeOptions &options)
+{
+#ifdef FLIF_USE_MMAP
+    MmapIO mio(filename);
+    if (mio.isOpen()) return flif_decode<BlobReader>(mio, filename, images, options);
+#endif
+    FileIO fio(filename, false);
+    if (!fio.isOpen()) { fprintf(stderr,"Could not open file: %s\n",filename); return false; }
+    return flif_decode(fio, filename, images, options);
+}
 
+bool flif_decode_from_memory(const uint8_t *data, size_t size, Images &images, const FLIFDecodeOptions &options)
+{
+    BlobReader reader(data, size);
+    return flif_decode(reader, "(memory)", images, options);
+}
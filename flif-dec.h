@@ -1,6 +1,46 @@
 #ifndef __FLIF_DEC_H__
 #define __FLIF_DEC_H__
 
-bool decode(const char* filename, Images &images, int quality, int scale);
+#include <stdint.h>
+#include <stddef.h>
+
+#include "image/image.h"
+#include "timings.h"
+
+bool decode(const char* filename, Images &images, int quality, int scale, FLIFTimings *timings = NULL);
+
+// progressive decoding: gets a preview of the image(s) downscaled 1:scale, after bytes_read bytes of the file
+typedef void (*FLIFPreviewCallback)(const Images &preview, int scale, long bytes_read, void *user);
+
+// row-interleaved files (see FLIFEncodeOptions::encoding): gets every row as soon as it is decoded, as an image
+// of one row (r out of rows); returning false stops decoding
+typedef bool (*FLIFRowCallback)(const Image &row, uint32_t r, uint32_t rows, void *user);
+
+struct FLIFDecodeOptions {
+    int quality;
+    int scale;              // interlaced files: the images only hold the pixels at scale 1:scale (or a lower scale for
+                            // small images, whose first zoomlevels are all needed), see Image::scale()
+    FLIFTimings *timings;   // if not NULL, the time spent in every stage is added to it
+    // interlaced files only: if preview_callback is not NULL, it is called every time the decoded data
+    // is complete at a scale 1:2^k (k>0), and (if preview_bytes > 0) every time another preview_bytes bytes
+    // have been read, with the rest of the image interpolated at the scale of the most detailed data so far
+    FLIFPreviewCallback preview_callback;
+    void *preview_user;
+    long preview_bytes;
+    // if row_callback is not NULL and the file is row-interleaved, the rows only go to row_callback (the images stay empty)
+    FLIFRowCallback row_callback;
+    void *row_user;
+    // if crop_width > 0, the images only hold the crop_width x crop_height rectangle at (crop_x, crop_y), or the
+    // part of it inside the image; tiled files only decode the tiles it overlaps, other files are cropped afterwards
+    uint32_t crop_x, crop_y, crop_width, crop_height;
+    int threads;            // the most threads the decoder may use (0: one per hardware thread)
+    FLIFDecodeOptions() : quality(100), scale(1), timings(NULL), preview_callback(NULL), preview_user(NULL), preview_bytes(0),
+                          row_callback(NULL), row_user(NULL), crop_x(0), crop_y(0), crop_width(0), crop_height(0), threads(0) {}
+};
+
+bool decode(const char* filename, Images &images, const FLIFDecodeOptions &options);
+
+// reentrant: all codec state is local to the call
+bool flif_decode_from_memory(const uint8_t *data, size_t size, Images &images, const FLIFDecodeOptions &options);
 
 #endif
@@ -1,5 +1,8 @@
 #include <string>
 #include <string.h>
+#include <atomic>
+#include <thread>
+#include <type_traits>
 
 #include "maniac/rac.h"
 #include "maniac/compound.h"
@@ -11,6 +14,7 @@
 #include "flif_config.h"
 
 #include "common.h"
+#include "flif-enc.h"
 
 template<typename RAC> void static write_name(RAC& rac, std::string desc)
 {
@@ -25,43 +29,209 @@ template<typename RAC> void static write_name(RAC& rac, std::string desc)
 }
 
 
-template<typename Coder> void encode_scanlines_inner(std::vector<Coder*> &coders, const Images &images, const ColorRanges *ranges)
+// Learning passes only write to a RacDummy and every plane has its own coder and tree,
+// so the planes can be learned concurrently (giving the same trees as a serial run), on at most ctx.threads threads.
+// The same goes for the final pass of encoding 4, where every plane also has its own RAC.
+template<typename F> void learn_planes_parallel(FLIFContext &ctx, const int nump, F learn_plane)
+{
+    std::vector<FLIFContext> pctx(nump, ctx);
+    for (int p = 0; p < nump; p++) pctx[p].pixels_done = 0;
+    std::atomic<int> next(0);
+    auto work = [&]() {
+        for (int p; (p = next++) < nump; ) learn_plane(pctx[p], p);
+    };
+    const unsigned int nb_threads = std::min<unsigned int>(ctx.threads, nump);
+    if (nb_threads < 2) work();
+    else {
+        std::vector<std::thread> workers;
+        for (unsigned int i = 0; i < nb_threads; i++) workers.push_back(std::thread(work));
+        for (std::thread &w : workers) w.join();
+    }
+    for (int p = 0; p < nump; p++) ctx.pixels_done += pctx[p].pixels_done;
+}
+
+// The properties, range and guess of every pixel of one plane, recorded during the first learning pass and
+// replayed (in the same pixel order) by the other learning passes and the final pass: the pixels do not
+// change anymore after the transforms and the zero-alpha interpolation.
+// Records are (properties..., min-guess, max-guess, curr-guess), as int16 if the ranges allow it.
+// If not all records fit in the memory it gets, it keeps the ones of the first pixels: the passes replay
+// those and compute the properties of the other pixels again.
+class PropertyCache {
+    std::vector<int16_t> narrow;
+    std::vector<int32_t> wide;
+    bool use_wide;
+    size_t nb_properties;
+    enum { OFF, EMPTY, RECORDING, FULL } state;
+    size_t pos;
+
+    template<typename T> void push(std::vector<T> &v, const Properties &properties, int min, int max, int val) {
+        if (v.size() + nb_properties + 3 > v.capacity()) return;
+        for (size_t i = 0; i < nb_properties; i++) v.push_back(properties[i]);
+        v.push_back(min);
+        v.push_back(max);
+        v.push_back(val);
+    }
+    template<typename T> bool pop(const std::vector<T> &v, Properties &properties, int &min, int &max, int &val) {
+        if (pos >= v.size()) return false;
+        const T *rec = &v[pos];
+        for (size_t i = 0; i < nb_properties; i++) properties[i] = rec[i];
+        min = rec[nb_properties];
+        max = rec[nb_properties+1];
+        val = rec[nb_properties+2];
+        pos += nb_properties + 3;
+        return true;
+    }
+    void off() {
+        state = OFF;
+        std::vector<int16_t>().swap(narrow);
+        std::vector<int32_t>().swap(wide);
+    }
+
+public:
+    PropertyCache() : use_wide(false), nb_properties(0), state(OFF), pos(0) {}
+
+    // room for max_pixels records, or as many as fit in max_bytes (the cache stays off if not even one does)
+    void init(const Ranges &propRanges, const ColorVal min, const ColorVal max, const uint64_t max_pixels, const uint64_t max_bytes) {
+        nb_properties = propRanges.size();
+        // differences with the guess are at most max-min, or a bit more for the alpha plane of animations (-fr)
+        use_wide = (max - min + 256 > 0x7FFF);
+        for (const auto &r : propRanges) if (r.first < -0x8000 || r.second > 0x7FFF) use_wide = true;
+        const uint64_t record_bytes = (nb_properties + 3) * (use_wide ? 4 : 2);
+        const uint64_t records = std::min<uint64_t>(max_pixels, max_bytes / record_bytes);
+        if (records == 0) { off(); return; }
+        if (use_wide) wide.reserve(records * (nb_properties + 3)); else narrow.reserve(records * (nb_properties + 3));
+        state = EMPTY;
+    }
+
+    void begin_pass() {
+        pos = 0;
+        if (state == EMPTY) state = RECORDING;
+    }
+    void end_pass() {
+        if (state == RECORDING) state = FULL;
+    }
+    bool recording() const { return state == RECORDING; }
+    bool replaying() const { return state == FULL; }
+
+    void record(const Properties &properties, int min, int max, int val) {
+        if (use_wide) push(wide, properties, min, max, val);
+        else push(narrow, properties, min, max, val);
+    }
+    // false once the records are used up (the pixels after them are not in the cache)
+    bool replay(Properties &properties, int &min, int &max, int &val) {
+        if (use_wide) return pop(wide, properties, min, max, val);
+        else return pop(narrow, properties, min, max, val);
+    }
+};
+
+// start or end a pass over plane only_plane (or all planes) of the caches, if there are caches
+static void begin_cache_pass(std::vector<PropertyCache> *caches, const int only_plane) {
+    if (caches) for (int p = 0; p < (int)caches->size(); p++) if (only_plane < 0 || p == only_plane) (*caches)[p].begin_pass();
+}
+static void end_cache_pass(std::vector<PropertyCache> *caches, const int only_plane) {
+    if (caches) for (int p = 0; p < (int)caches->size(); p++) if (only_plane < 0 || p == only_plane) (*caches)[p].end_pass();
+}
+
+// only_plane >= 0: only encode that plane (used when learning the planes concurrently)
+// time_steps: add the time spent on every plane to ctx.timings
+// caches: per plane, the cached properties to record or replay (or NULL)
+template<typename IO, typename Coder> void encode_scanlines_inner(FLIFContext &ctx, IO& io, std::vector<Coder*> &coders, const Images &images, const FlatColorRanges *ranges, std::vector<PropertyCache> *caches, const int only_plane = -1, const bool time_steps = false)
 {
     ColorVal min,max;
-    long fs = ftell(f);
+    begin_cache_pass(caches, only_plane);
+    long fs = io.tell();
     long pixels = images[0].cols()*images[0].rows()*images.size();
     int nump = images[0].numPlanes();
     int beginp = (nump>3 ? 3 : 0);
     for (int p = beginp, i=0; i++ < nump; p = (p+1)%nump) {
+        if (only_plane >= 0 && p != only_plane) continue;
         Properties properties((nump>3?NB_PROPERTIES_scanlinesA[p]:NB_PROPERTIES_scanlines[p]));
-        v_printf(2,"\r%i%% done [%i/%i] ENC[%ux%u]    ",(int)(100*pixels_done/pixels_todo),i,nump,images[0].cols(),images[0].rows());
-        pixels_done += images[0].cols()*images[0].rows();
+        if (only_plane < 0) v_printf(2,"\r%i%% done [%i/%i] ENC[%ux%u]    ",(int)(100*ctx.pixels_done/ctx.pixels_todo),i,nump,images[0].cols(),images[0].rows());
+        ctx.pixels_done += images[0].cols()*images[0].rows();
         if (ranges->min(p) >= ranges->max(p)) continue;
+        StageTimer timer(time_steps ? ctx.timings : NULL, "plane " + std::to_string(p), pixels);
+        PropertyCache *cache = (caches ? &(*caches)[p] : NULL);
+        bool replay = cache && cache->replaying();
+        const bool record = cache && cache->recording();
         for (uint32_t r = 0; r < images[0].rows(); r++) {
             for (int fr=0; fr< (int)images.size(); fr++) {
               const Image& image = images[fr];
               if (image.seen_before >= 0) continue;
+              const PredictorRows prows(image, 0, p, r);
               uint32_t begin=image.col_begin[r], end=image.col_end[r];
               for (uint32_t c = begin; c < end; c++) {
                 if (nump>3 && p<3 && image(3,r,c) <= 0) continue;
-                ColorVal guess = predict_and_calcProps_scanlines(properties,ranges,image,p,r,c,min,max);
+                if (replay) {
+                    ColorVal dmin, dmax, dcurr;
+                    if (cache->replay(properties, dmin, dmax, dcurr)) {
+                        coders[p]->write_int(properties, dmin, dmax, dcurr);
+                        continue;
+                    }
+                    replay = false;
+                }
+                ColorVal guess = predict_and_calcProps_scanlines(ctx,properties,ranges,prows,p,r,c,min,max);
                 ColorVal curr = image(p,r,c);
                 assert(p != 3 || curr >= -fr);
                 if (p==3 && min < -fr) min = -fr;
+                if (record) cache->record(properties, min - guess, max - guess, curr - guess);
                 coders[p]->write_int(properties, min - guess, max - guess, curr - guess);
               }
             }
         }
-        long nfs = ftell(f);
-        if (nfs-fs > 0) {
+        long nfs = io.tell();
+        if (nfs-fs > 0 && only_plane < 0) {
            v_printf(3,"filesize : %li (+%li for %li pixels, %f bpp)", nfs, nfs-fs, pixels, 8.0*(nfs-fs)/pixels );
            v_printf(4,"\n");
         }
         fs = nfs;
     }
+    end_cache_pass(caches, only_plane);
+}
+
+// row-interleaved (encoding 3): all planes of row r before row r+1, in the same plane order as encode_scanlines_inner,
+// so every plane sees its pixels in the same order (and the trees learned plane by plane still fit)
+template<typename IO, typename Coder> void encode_scanlines_interleaved_inner(FLIFContext &ctx, IO& io, std::vector<Coder*> &coders, const Images &images, const FlatColorRanges *ranges, std::vector<PropertyCache> *caches)
+{
+    ColorVal min,max;
+    begin_cache_pass(caches, -1);
+    const Image& image = images[0];
+    int nump = image.numPlanes();
+    int beginp = (nump>3 ? 3 : 0);
+    std::vector<Properties> properties;
+    for (int p = 0; p < nump; p++) properties.push_back(Properties((nump>3?NB_PROPERTIES_scanlinesA[p]:NB_PROPERTIES_scanlines[p])));
+    for (uint32_t r = 0; r < image.rows(); r++) {
+        if (r % 256 == 0) v_printf(2,"\r%i%% done [%u/%u] ENC[%ux%u]    ",(int)(100*ctx.pixels_done/ctx.pixels_todo),r,image.rows(),image.cols(),image.rows());
+        ctx.pixels_done += image.cols()*nump;
+        for (int p = beginp, i=0; i++ < nump; p = (p+1)%nump) {
+            if (ranges->min(p) >= ranges->max(p)) continue;
+            PropertyCache *cache = (caches ? &(*caches)[p] : NULL);
+            bool replay = cache && cache->replaying();
+            const bool record = cache && cache->recording();
+            const PredictorRows prows(image, 0, p, r);
+            for (uint32_t c = 0; c < image.cols(); c++) {
+                if (nump>3 && p<3 && image(3,r,c) <= 0) continue;
+                if (replay) {
+                    ColorVal dmin, dmax, dcurr;
+                    if (cache->replay(properties[p], dmin, dmax, dcurr)) {
+                        coders[p]->write_int(properties[p], dmin, dmax, dcurr);
+                        continue;
+                    }
+                    replay = false;
+                }
+                ColorVal guess = predict_and_calcProps_scanlines(ctx,properties[p],ranges,prows,p,r,c,min,max);
+                ColorVal curr = image(p,r,c);
+                if (record) cache->record(properties[p], min - guess, max - guess, curr - guess);
+                coders[p]->write_int(properties[p], min - guess, max - guess, curr - guess);
+            }
+        }
+    }
+    v_printf(3,"filesize : %li", io.tell());
+    v_printf(4,"\n");
+    end_cache_pass(caches, -1);
 }
 
-template<typename Rac, typename Coder> void encode_scanlines_pass(Rac &rac, const Images &images, const ColorRanges *ranges, std::vector<Tree> &forest, int repeats)
+// interleaved: the final pass is row-interleaved (encoding 3), learning is the same as for encoding 1
+template<typename IO, typename Rac, typename Coder> void encode_scanlines_pass(FLIFContext &ctx, IO& io, Rac &rac, const Images &images, const FlatColorRanges *ranges, std::vector<Tree> &forest, int repeats, std::vector<PropertyCache> *caches, const bool interleaved = false)
 {
     std::vector<Coder*> coders;
 
@@ -71,8 +241,22 @@ template<typename Rac, typename Coder> void encode_scanlines_pass(Rac &rac, cons
         coders.push_back(new Coder(rac, propRanges, forest[p]));
     }
 
-    while(repeats-- > 0) {
-     encode_scanlines_inner(coders, images, ranges);
+    const bool learning = std::is_same<Rac, RacDummy>::value;
+    const uint64_t pixels = (uint64_t)images[0].cols()*images[0].rows()*images.size()*ranges->numPlanes();
+#ifdef PARALLEL_LEARNING
+    if (learning) {
+        for (int i = 0; i < repeats; i++) {
+            StageTimer timer(ctx.timings, "learning repeat " + std::to_string(i+1), pixels);
+            learn_planes_parallel(ctx, ranges->numPlanes(), [&](FLIFContext &pctx, int p) {
+                encode_scanlines_inner(pctx, io, coders, images, ranges, caches, p);
+            });
+        }
+    } else
+#endif
+    for (int i = 0; i < repeats; i++) {
+        StageTimer timer(learning ? ctx.timings : NULL, "learning repeat " + std::to_string(i+1), pixels);
+        if (interleaved && !learning) encode_scanlines_interleaved_inner(ctx, io, coders, images, ranges, caches);
+        else encode_scanlines_inner(ctx, io, coders, images, ranges, caches, -1, !learning);
     }
 
     for (int p = 0; p < ranges->numPlanes(); p++) {
@@ -88,36 +272,79 @@ template<typename Rac, typename Coder> void encode_scanlines_pass(Rac &rac, cons
     }
 }
 
-template<typename Coder> void encode_FLIF2_inner(std::vector<Coder*> &coders, const Images &images, const ColorRanges *ranges, const int beginZL, const int endZL)
+// encoding 4: the final pass, with every plane in its own RAC stream (encoded concurrently). The streams
+// (planes 0..nump-1) are written after the main RAC stream, their lengths go to lengths (they are in the header,
+// see flif_encode); constant planes have an empty stream.
+template<typename IO, typename Coder> void encode_scanlines_planar_pass(FLIFContext &ctx, IO& io, const Images &images, const FlatColorRanges *ranges, std::vector<Tree> &forest, std::vector<PropertyCache> *caches, std::vector<uint64_t> &lengths)
 {
-    ColorVal min,max;
-    int nump = images[0].numPlanes();
-    long fs = ftell(f);
-    for (int i = 0; i < plane_zoomlevels(images[0], beginZL, endZL); i++) {
-      std::pair<int, int> pzl = plane_zoomlevel(images[0], beginZL, endZL, i);
-      int p = pzl.first;
-      int z = pzl.second;
-      if (endZL==0) {
-          v_printf(2,"\r%i%% done [%i/%i] ENC[%i,%ux%u]  ",(int) (100*pixels_done/pixels_todo),i,plane_zoomlevels(images[0], beginZL, endZL)-1,p,images[0].cols(z),images[0].rows(z));
-      }
-      pixels_done += images[0].cols(z)*images[0].rows(z)/2;
-      if (ranges->min(p) >= ranges->max(p)) continue;
-      Properties properties((nump>3?NB_PROPERTIESA[p]:NB_PROPERTIES[p]));
-      if (z % 2 == 0) {
+    const int nump = ranges->numPlanes();
+    std::vector<BlobIO> streams(nump);
+    std::vector<RacOut<BlobIO>*> racs;
+    std::vector<Coder*> coders;
+    for (int p = 0; p < nump; p++) {
+        Ranges propRanges;
+        initPropRanges_scanlines(propRanges, *ranges, p);
+        racs.push_back(new RacOut<BlobIO>(streams[p]));
+        coders.push_back(new Coder(*racs[p], propRanges, forest[p]));
+    }
+
+    learn_planes_parallel(ctx, nump, [&](FLIFContext &pctx, int p) {
+        if (ranges->min(p) >= ranges->max(p)) return;
+        encode_scanlines_inner(pctx, streams[p], coders, images, ranges, caches, p);
+        for (uint8_t byte : racs[p]->termination()) streams[p].write(byte);
+    });
+
+    lengths.clear();
+    for (int p = 0; p < nump; p++) {
+        v_printf(3,"\rPlane %i: %li bytes.   ", p, streams[p].tell());
+        v_printf(4,"\n");
+        lengths.push_back(streams[p].tell());
+        for (uint8_t byte : streams[p].buffer()) io.write(byte);
+    }
+
+    for (int p = 0; p < nump; p++) {
+#ifdef STATS
+        indent(0); v_printf(2,"Plane %i\n", p);
+        coders[p]->info(0+1);
+#endif
+        delete coders[p];
+        delete racs[p];
+    }
+}
+
+// the per-pixel loops of one (plane, zoomlevel) step, compiled separately per direction, alpha presence and plane role
+template<typename Coder> struct EncodeZoomlevel {
+    template<bool horizontal, bool alpha, int role> static bool run(const FLIFContext &ctx, Coder &coder, const Images &images, const FlatColorRanges *ranges, PropertyCache *cache, const int p, const int z)
+    {
+      ColorVal min,max;
+      Properties properties((alpha?NB_PROPERTIESA[p]:NB_PROPERTIES[p]));
+      bool replay = cache && cache->replaying();
+      const bool record = cache && cache->recording();
+      if (horizontal) {
         // horizontal: scan the odd rows, output pixel values
           for (uint32_t r = 1; r < images[0].rows(z); r += 2) {
             for (int fr=0; fr<(int)images.size(); fr++) {
               const Image& image = images[fr];
               if (image.seen_before >= 0) { continue; }
+              const PredictorRows prows(image, z, p, r);
               uint32_t begin=(image.col_begin[r*image.zoom_rowpixelsize(z)]/image.zoom_colpixelsize(z)),
                          end=(1+(image.col_end[r*image.zoom_rowpixelsize(z)]-1)/image.zoom_colpixelsize(z));
               for (uint32_t c = begin; c < end; c++) {
-                    if (nump>3 && p<3 && image(3,z,r,c) <= 0) continue;
-                    ColorVal guess = predict_and_calcProps(properties,ranges,image,z,p,r,c,min,max);
+                    if (alpha && role != PLANE_ALPHA && image(3,z,r,c) <= 0) continue;
+                    if (replay) {
+                        ColorVal dmin, dmax, dcurr;
+                        if (cache->replay(properties, dmin, dmax, dcurr)) {
+                            coder.write_int(properties, dmin, dmax, dcurr);
+                            continue;
+                        }
+                        replay = false;
+                    }
+                    ColorVal guess = predict_and_calcProps<horizontal,alpha,role>(ctx,properties,ranges,prows,p,r,c,min,max);
                     ColorVal curr = image(p,z,r,c);
-                    if (p==3 && min < -fr) min = -fr;
+                    if (role == PLANE_ALPHA && min < -fr) min = -fr;
                     assert (curr <= max); assert (curr >= min);
-                    coders[p]->write_int(properties, min - guess, max - guess, curr - guess);
+                    if (record) cache->record(properties, min - guess, max - guess, curr - guess);
+                    coder.write_int(properties, min - guess, max - guess, curr - guess);
               }
             }
           }
@@ -127,30 +354,76 @@ template<typename Coder> void encode_FLIF2_inner(std::vector<Coder*> &coders, co
             for (int fr=0; fr<(int)images.size(); fr++) {
               const Image& image = images[fr];
               if (image.seen_before >= 0) { continue; }
+              const PredictorRows prows(image, z, p, r);
               uint32_t begin=(image.col_begin[r*image.zoom_rowpixelsize(z)]/image.zoom_colpixelsize(z)),
                          end=(1+(image.col_end[r*image.zoom_rowpixelsize(z)]-1)/image.zoom_colpixelsize(z))|1;
               if (begin>1 && ((begin&1) ==0)) begin--;
               if (begin==0) begin=1;
               for (uint32_t c = begin; c < end; c+=2) {
-                    if (nump>3 && p<3 && image(3,z,r,c) <= 0) continue;
-                    ColorVal guess = predict_and_calcProps(properties,ranges,image,z,p,r,c,min,max);
+                    if (alpha && role != PLANE_ALPHA && image(3,z,r,c) <= 0) continue;
+                    if (replay) {
+                        ColorVal dmin, dmax, dcurr;
+                        if (cache->replay(properties, dmin, dmax, dcurr)) {
+                            coder.write_int(properties, dmin, dmax, dcurr);
+                            continue;
+                        }
+                        replay = false;
+                    }
+                    ColorVal guess = predict_and_calcProps<horizontal,alpha,role>(ctx,properties,ranges,prows,p,r,c,min,max);
                     ColorVal curr = image(p,z,r,c);
-                    if (p==3 && min < -fr) min = -fr;
+                    if (role == PLANE_ALPHA && min < -fr) min = -fr;
                     assert (curr <= max); assert (curr >= min);
-                    coders[p]->write_int(properties, min - guess, max - guess, curr - guess);
+                    if (record) cache->record(properties, min - guess, max - guess, curr - guess);
+                    coder.write_int(properties, min - guess, max - guess, curr - guess);
               }
             }
           }
       }
-      if (endZL==0 && ftell(f)>fs) {
-          v_printf(3,"    wrote %li bytes    ", ftell(f));
+      return true;
+    }
+};
+
+// only_plane >= 0: only encode that plane (used when learning the planes concurrently)
+// time_steps: add the time spent on every (plane, zoomlevel) step to ctx.timings
+// caches: per plane, the cached properties to record or replay (or NULL)
+// index: if not NULL, where every step ends in the file
+template<typename IO, typename Rac, typename Coder> void encode_FLIF2_inner(FLIFContext &ctx, IO& io, Rac &rac, std::vector<Coder*> &coders, const Images &images, const FlatColorRanges *ranges, std::vector<PlaneZoomlevel> &schedule, const int endZL, std::vector<PropertyCache> *caches, FLIFIndex *index, const int only_plane = -1, const bool time_steps = false)
+{
+    int nump = images[0].numPlanes();
+    begin_cache_pass(caches, only_plane);
+    if (index && index->steps.empty()) index->start = io.tell() + rac.termination().size();
+    long fs = io.tell();
+    for (int i = 0; i < (int)schedule.size(); i++) {
+      const int p = schedule[i].p;
+      const int z = schedule[i].z;
+      if (only_plane >= 0 && p != only_plane) continue;
+      if (endZL==0 && only_plane < 0) {
+          v_printf(2,"\r%i%% done [%i/%i] ENC[%i,%ux%u]  ",(int) (100*ctx.pixels_done/ctx.pixels_todo),i,(int)schedule.size()-1,p,images[0].cols(z),images[0].rows(z));
+      }
+      ctx.pixels_done += schedule[i].pixels;
+      if (ranges->min(p) >= ranges->max(p)) continue;
+      StageTimer timer(time_steps ? ctx.timings : NULL, "plane " + std::to_string(p) + ", zoomlevel " + std::to_string(z), schedule[i].pixels*images.size());
+      const long before = io.tell();
+      dispatch_zoomlevel<EncodeZoomlevel<Coder> >(nump, p, z, ctx, *coders[p], images, ranges, (caches ? &(*caches)[p] : NULL), p, z);
+      if (only_plane < 0) schedule[i].bytes = io.tell() - before;
+      if (index) {
+          FLIFIndexEntry entry;
+          entry.p = p;
+          entry.z = z;
+          entry.offset = io.tell();
+          entry.termination = rac.termination();
+          index->steps.push_back(entry);
+      }
+      if (endZL==0 && only_plane < 0 && io.tell()>fs) {
+          v_printf(3,"    wrote %li bytes    ", io.tell());
           v_printf(5,"\n");
-          fs = ftell(f);
+          fs = io.tell();
       }
     }
+    end_cache_pass(caches, only_plane);
 }
 
-template<typename Rac, typename Coder> void encode_FLIF2_pass(Rac &rac, const Images &images, const ColorRanges *ranges, std::vector<Tree> &forest, const int beginZL, const int endZL, int repeats)
+template<typename IO, typename Rac, typename Coder> void encode_FLIF2_pass(FLIFContext &ctx, IO& io, Rac &rac, const Images &images, const FlatColorRanges *ranges, std::vector<Tree> &forest, const int beginZL, const int endZL, int repeats, std::vector<PropertyCache> *caches, FLIFIndex *index)
 {
     std::vector<Coder*> coders;
     for (int p = 0; p < ranges->numPlanes(); p++) {
@@ -158,6 +431,7 @@ template<typename Rac, typename Coder> void encode_FLIF2_pass(Rac &rac, const Im
         initPropRanges(propRanges, *ranges, p);
         coders.push_back(new Coder(rac, propRanges, forest[p]));
     }
+    std::vector<PlaneZoomlevel> schedule = plane_zoomlevel_schedule(images[0], beginZL, endZL);
 
     for (const Image& image : images)
     if (beginZL == image.zooms()) {
@@ -168,8 +442,22 @@ template<typename Rac, typename Coder> void encode_FLIF2_pass(Rac &rac, const Im
         metaCoder.write_int(ranges->min(p), ranges->max(p), curr);
       }
     }
-    while(repeats-- > 0) {
-     encode_FLIF2_inner(coders, images, ranges, beginZL, endZL);
+    const bool learning = std::is_same<Rac, RacDummy>::value;
+    uint64_t pixels = 0;
+    for (const PlaneZoomlevel &step : schedule) pixels += step.pixels*images.size();
+#ifdef PARALLEL_LEARNING
+    if (learning) {
+        for (int i = 0; i < repeats; i++) {
+            StageTimer timer(ctx.timings, "learning repeat " + std::to_string(i+1), pixels);
+            learn_planes_parallel(ctx, ranges->numPlanes(), [&](FLIFContext &pctx, int p) {
+                encode_FLIF2_inner(pctx, io, rac, coders, images, ranges, schedule, endZL, caches, NULL, p);
+            });
+        }
+    } else
+#endif
+    for (int i = 0; i < repeats; i++) {
+        StageTimer timer(learning ? ctx.timings : NULL, "learning repeat " + std::to_string(i+1), pixels);
+        encode_FLIF2_inner(ctx, io, rac, coders, images, ranges, schedule, endZL, caches, (learning ? NULL : index), -1, !learning);
     }
     for (int p = 0; p < images[0].numPlanes(); p++) {
         coders[p]->simplify();
@@ -184,13 +472,13 @@ template<typename Rac, typename Coder> void encode_FLIF2_pass(Rac &rac, const Im
     }
 }
 
-void encode_FLIF2_interpol_zero_alpha(Images &images, const ColorRanges *ranges, const int beginZL, const int endZL)
+void encode_FLIF2_interpol_zero_alpha(Images &images, const FlatColorRanges *ranges, const int beginZL, const int endZL)
 {
+    const std::vector<PlaneZoomlevel> schedule = plane_zoomlevel_schedule(images[0], beginZL, endZL);
     for (Image& image : images)
-    for (int i = 0; i < plane_zoomlevels(image, beginZL, endZL); i++) {
-      std::pair<int, int> pzl = plane_zoomlevel(image, beginZL, endZL, i);
-      int p = pzl.first;
-      int z = pzl.second;
+    for (const PlaneZoomlevel &step : schedule) {
+      const int p = step.p;
+      const int z = step.z;
       if (p == 3) continue;
 //      v_printf(2,"[%i] interpol_zero_alpha ",p);
 //      fflush(stdout);
@@ -213,7 +501,7 @@ void encode_FLIF2_interpol_zero_alpha(Images &images, const ColorRanges *ranges,
 //    v_printf(2,"\n");
 }
 
-void encode_scanlines_interpol_zero_alpha(Images &images, const ColorRanges *ranges)
+void encode_scanlines_interpol_zero_alpha(FLIFContext &ctx, Images &images, const FlatColorRanges *ranges)
 {
 
     ColorVal min,max;
@@ -226,9 +514,10 @@ void encode_scanlines_interpol_zero_alpha(Images &images, const ColorRanges *ran
 //          v_printf(2,"[%i] interpol_zero_alpha ",p);
 //        fflush(stdout);
         for (uint32_t r = 0; r < image.rows(); r++) {
+            const PredictorRows prows(image, 0, p, r);
             for (uint32_t c = 0; c < image.cols(); c++) {
                 if (image(3,r,c) == 0) {
-                    image.set(p,r,c, predict_and_calcProps_scanlines(properties,ranges,image,p,r,c,min,max));
+                    image.set(p,r,c, predict_and_calcProps_scanlines(ctx,properties,ranges,prows,p,r,c,min,max));
                 }
             }
         }
@@ -241,7 +530,7 @@ template<typename BitChance, typename Rac> void encode_tree(Rac &rac, const Colo
 {
     for (int p = 0; p < ranges->numPlanes(); p++) {
         Ranges propRanges;
-        if (encoding==1) initPropRanges_scanlines(propRanges, *ranges, p);
+        if (scanline_encoding(encoding)) initPropRanges_scanlines(propRanges, *ranges, p);
         else initPropRanges(propRanges, *ranges, p);
         MetaPropertySymbolCoder<BitChance, Rac> metacoder(rac, propRanges);
 //        forest[p].print(stdout);
@@ -250,36 +539,77 @@ template<typename BitChance, typename Rac> void encode_tree(Rac &rac, const Colo
     }
 }
 
-bool encode(const char* filename, Images &images, std::vector<std::string> transDesc, int encoding, int learn_repeats, int acb, int frame_delay, int palette_size, int lookback) {
-    if (encoding < 1 || encoding > 2) { fprintf(stderr,"Unknown encoding: %i\n", encoding); return false;}
-    f = fopen(filename,"wb");
-    fputs("FLIF",f);
+// Encodings from 3 on do not fit in the header byte after "FLIF". Their files start with "FLIX" instead, so that
+// decoders which do not know them reject them as not being FLIF files. Then come the encoding, the number of
+// planes and the number of frames, one byte each.
+template <typename IO> void write_extended_header(IO& io, const int encoding, const int numPlanes, const int numFrames)
+{
+    for (const char *m = "FLIX"; *m; m++) io.write(*m);
+    io.write(encoding);
+    io.write(numPlanes);
+    io.write(numFrames);
+}
+
+// encoding 4: the number of plane streams and their lengths are only known at the end, so the file is made
+// in memory and they are inserted after the header (as varints), before the main RAC stream
+static void insert_varints(BlobIO& io, const size_t at, const std::vector<uint64_t> &values) {
+    BlobIO varints;
+    write_varint(varints, values.size());
+    for (uint64_t n : values) write_varint(varints, n);
+    io.buffer().insert(io.buffer().begin() + at, varints.buffer().begin(), varints.buffer().end());
+}
+template <typename IO> void insert_varints(IO& io, const size_t at, const std::vector<uint64_t> &values) {
+    assert(false); // only BlobIO gets here (see flif_encode)
+}
+
+template <typename IO>
+bool flif_encode(IO& io, Images &images, std::vector<std::string> transDesc, int encoding, int learn_repeats, int acb, int frame_delay, int palette_size, int lookback, FLIFTimings *timings, FLIFIndex *index, int threads, int64_t cache_bytes) {
+    if (encoding == 4 && !std::is_same<IO, BlobIO>::value) {
+        BlobIO bio;
+        if (!flif_encode(bio, images, transDesc, encoding, learn_repeats, acb, frame_delay, palette_size, lookback, timings, index, threads, cache_bytes)) return false;
+        for (uint8_t byte : bio.buffer()) io.write(byte);
+        io.flush();
+        return true;
+    }
+    FLIFContext ctx;
+    ctx.timings = timings;
+    ctx.threads = thread_budget(threads);
+    if (index) index->steps.clear();
+    StageTimer total(timings, "encode", (uint64_t)images[0].rows()*images[0].cols()*images.size());
+    if (encoding < 1 || encoding > 4) { fprintf(stderr,"Unknown encoding: %i\n", encoding); return false;}
     int numPlanes = images[0].numPlanes();
     int numFrames = images.size();
-    char c=' '+16*encoding+numPlanes;
-    if (numFrames>1) c += 32;
-    fputc(c,f);
-    if (numFrames>1) {
-        if (numFrames<255) fputc((char)numFrames,f);
-        else {
-            fprintf(stderr,"Too many frames!\n");
+    if (encoding == 3 && numFrames > 1) { fprintf(stderr,"Row-interleaved encoding is only for still images\n"); return false;}
+    if (images[0].cols() > 0xFFFF || images[0].rows() > 0xFFFF) { fprintf(stderr,"Image too large: at most 65535x65535 pixels without tiles\n"); return false;}
+    if (encoding > 2 && numFrames > 255) { fprintf(stderr,"Too many frames!\n"); return false;}
+    if (encoding > 2) write_extended_header(io, encoding, numPlanes, numFrames);
+    else {
+        for (const char *m = "FLIF"; *m; m++) io.write(*m);
+        char c=' '+16*encoding+numPlanes;
+        if (numFrames>1) c += 32;
+        io.write(c);
+        if (numFrames>1) {
+            if (numFrames<255) io.write(numFrames);
+            else {
+                fprintf(stderr,"Too many frames!\n");
+            }
         }
     }
-    c='1';
+    char c='1';
     for (int p = 0; p < numPlanes; p++) {if (images[0].max(p) != 255) c='2';}
     if (c=='2') {for (int p = 0; p < numPlanes; p++) {if (images[0].max(p) != 65535) c='0';}}
-    fputc(c,f);
+    io.write(c);
 
     Image& image = images[0];
-    assert(image.cols() <= 0xFFFF);
-    fputc(image.cols() >> 8,f);
-    fputc(image.cols() & 0xFF,f);
-    assert(image.rows() <= 0xFFFF);
-    fputc(image.rows() >> 8,f);
-    fputc(image.rows() & 0xFF,f);
+    io.write(image.cols() >> 8);
+    io.write(image.cols() & 0xFF);
+    io.write(image.rows() >> 8);
+    io.write(image.rows() & 0xFF);
+    const size_t header_end = io.tell();
+    std::vector<uint64_t> plane_lengths;
 
-    RacOut rac(f);
-    SimpleSymbolCoder<FLIFBitChanceMeta, RacOut, 24> metaCoder(rac);
+    RacOut<IO> rac(io);
+    SimpleSymbolCoder<FLIFBitChanceMeta, RacOut<IO>, 24> metaCoder(rac);
 
     v_printf(3,"Input: %ux%u, channels:", images[0].cols(), images[0].rows());
     for (int p = 0; p < numPlanes; p++) {
@@ -300,21 +630,25 @@ bool encode(const char* filename, Images &images, std::vector<std::string> trans
     }
 //    metaCoder.write_int(1, 65536, image.cols());
 //    metaCoder.write_int(1, 65536, image.rows());
-//    v_printf(2,"Header: %li bytes.\n", ftell(f));
+//    v_printf(2,"Header: %li bytes.\n", io.tell());
 
-//    v_printf(2,"Header: %li bytes.\n", ftell(f));
+//    v_printf(2,"Header: %li bytes.\n", io.tell());
 
     std::vector<const ColorRanges*> rangesList;
-    std::vector<Transform*> transforms;
+    std::vector<Transform<IO>*> transforms;
     rangesList.push_back(getRanges(image));
+    ImageAnalysis analysis(ctx.threads);
     int tcount=0;
     v_printf(4,"Transforms: ");
+    const uint64_t pixels = (uint64_t)image.rows()*image.cols()*images.size();
     for (unsigned int i=0; i<transDesc.size(); i++) {
-        Transform *trans = create_transform(transDesc[i]);
+        StageTimer timer(timings, "transform " + transDesc[i], pixels);
+        Transform<IO> *trans = create_transform<IO>(transDesc[i]);
+        trans->set_threads(ctx.threads);
         if (transDesc[i] == "PLT" || transDesc[i] == "PLA") trans->configure(palette_size);
         if (transDesc[i] == "FRA") trans->configure(lookback);
         if (!trans->init(rangesList.back()) || 
-            (!trans->process(rangesList.back(), images)
+            (!trans->process(rangesList.back(), images, analysis)
               && !(acb==1 && transDesc[i] == "ACB" && printf(", forced_") && (tcount=0)==0))) {
             //fprintf(stderr, "Transform '%s' failed\n", transDesc[i].c_str());
         } else {
@@ -327,14 +661,16 @@ bool encode(const char* filename, Images &images, std::vector<std::string> trans
             fflush(stdout);
             rangesList.push_back(trans->meta(images, rangesList.back()));
             trans->data(images);
+            if (trans->changes_data()) analysis.invalidate();
         }
         delete trans;
     }
     if (tcount==0) v_printf(4,"none\n"); else v_printf(4,"\n");
     rac.write(false);
-    const ColorRanges* ranges = rangesList.back();
-    grey.clear();
-    for (int p = 0; p < ranges->numPlanes(); p++) grey.push_back((ranges->min(p)+ranges->max(p))/2);
+    FlatColorRanges flat_ranges(rangesList.back());
+    const FlatColorRanges* ranges = &flat_ranges;
+    ctx.grey.clear();
+    for (int p = 0; p < ranges->numPlanes(); p++) ctx.grey.push_back((ranges->min(p)+ranges->max(p))/2);
 
     for (int p = 0; p < ranges->numPlanes(); p++) {
       v_printf(7,"Plane %i: %i..%i\n",p,ranges->min(p),ranges->max(p));
@@ -351,74 +687,112 @@ bool encode(const char* filename, Images &images, std::vector<std::string> trans
     if (mbits >10) bits=18;
     if (mbits > bits) { printf("OOPS: %i > %i\n",mbits,bits); return false;}
 
-    pixels_todo = image.rows()*image.cols()*ranges->numPlanes()*(learn_repeats+1);
+    ctx.pixels_todo = image.rows()*image.cols()*ranges->numPlanes()*(learn_repeats+1);
 
     // two passes
     std::vector<Tree> forest(ranges->numPlanes(), Tree());
     RacDummy dummy;
 
     if (ranges->numPlanes() > 3) {
+      StageTimer timer(timings, "zero-alpha interpolation", pixels);
       v_printf(4,"Replacing fully transparent pixels with predicted pixel values at the other planes\n");
       switch(encoding) {
-        case 1: encode_scanlines_interpol_zero_alpha(images, ranges); break;
+        case 1: case 3: case 4: encode_scanlines_interpol_zero_alpha(ctx, images, ranges); break;
         case 2: encode_FLIF2_interpol_zero_alpha(images, ranges, image.zooms(), 0); break;
       }
     }
 
     // not computing checksum until after transformations and potential zero-alpha changes
-    uint32_t checksum = image.checksum();
-    long fs = ftell(f);
+    StageTimer checksum_timer(timings, "checksum", image.rows()*image.cols());
+    uint32_t checksum;
+    if (encoding == 3) {
+        RowChecksum rows_checksum(image.cols(), image.rows());
+        for (uint32_t r = 0; r < image.rows(); r++) rows_checksum.add_row(image, r);
+        checksum = rows_checksum.value();
+    } else checksum = image.checksum();
+    checksum_timer.done();
+    long fs = io.tell();
 
     int roughZL = 0;
     if (encoding == 2) {
       roughZL = image.zooms() - NB_NOLEARN_ZOOMS-1;
       if (roughZL < 0) roughZL = 0;
       //v_printf(2,"Encoding rough data\n");
-      if (bits==10) encode_FLIF2_pass<RacOut, FinalPropertySymbolCoder<FLIFBitChancePass2, RacOut, 10> >(rac, images, ranges, forest, image.zooms(), roughZL+1, 1);
-      else encode_FLIF2_pass<RacOut, FinalPropertySymbolCoder<FLIFBitChancePass2, RacOut, 18> >(rac, images, ranges, forest, image.zooms(), roughZL+1, 1);
+      StageTimer timer(timings, "rough pass");
+      if (bits==10) encode_FLIF2_pass<IO, RacOut<IO>, FinalPropertySymbolCoder<FLIFBitChancePass2, RacOut<IO>, 10> >(ctx, io, rac, images, ranges, forest, image.zooms(), roughZL+1, 1, NULL, index);
+      else encode_FLIF2_pass<IO, RacOut<IO>, FinalPropertySymbolCoder<FLIFBitChancePass2, RacOut<IO>, 18> >(ctx, io, rac, images, ranges, forest, image.zooms(), roughZL+1, 1, NULL, index);
+    }
+
+    // the properties computed by the first learning pass are replayed by the other passes, if they fit in memory
+    std::vector<PropertyCache> caches(ranges->numPlanes());
+    if (cache_bytes < 0) cache_bytes = PROPERTY_CACHE_FACTOR * pixels * numPlanes * sizeof(ColorVal);
+    if (learn_repeats > 0 && cache_bytes > 0) {
+      for (int p = 0; p < ranges->numPlanes(); p++) {
+        Ranges propRanges;
+        if (scanline_encoding(encoding)) initPropRanges_scanlines(propRanges, *ranges, p);
+        else initPropRanges(propRanges, *ranges, p);
+        caches[p].init(propRanges, ranges->min(p), ranges->max(p), pixels, cache_bytes / ranges->numPlanes());
+      }
     }
 
     //v_printf(2,"Encoding data (pass 1)\n");
     if (learn_repeats>1) v_printf(3,"Learning a MANIAC tree. Iterating %i times.\n",learn_repeats);
+    StageTimer learn_timer(timings, "learning");
     switch(encoding) {
-        case 1:
-           if (bits==10) encode_scanlines_pass<RacDummy, PropertySymbolCoder<FLIFBitChancePass1, RacDummy, 10> >(dummy, images, ranges, forest, learn_repeats);
-           else encode_scanlines_pass<RacDummy, PropertySymbolCoder<FLIFBitChancePass1, RacDummy, 18> >(dummy, images, ranges, forest, learn_repeats);
+        case 1: case 3: case 4:
+           if (bits==10) encode_scanlines_pass<IO, RacDummy, PropertySymbolCoder<FLIFBitChancePass1, RacDummy, 10> >(ctx, io, dummy, images, ranges, forest, learn_repeats, &caches);
+           else encode_scanlines_pass<IO, RacDummy, PropertySymbolCoder<FLIFBitChancePass1, RacDummy, 18> >(ctx, io, dummy, images, ranges, forest, learn_repeats, &caches);
            break;
         case 2:
-           if (bits==10) encode_FLIF2_pass<RacDummy, PropertySymbolCoder<FLIFBitChancePass1, RacDummy, 10> >(dummy, images, ranges, forest, roughZL, 0, learn_repeats);
-           else encode_FLIF2_pass<RacDummy, PropertySymbolCoder<FLIFBitChancePass1, RacDummy, 18> >(dummy, images, ranges, forest, roughZL, 0, learn_repeats);
+           if (bits==10) encode_FLIF2_pass<IO, RacDummy, PropertySymbolCoder<FLIFBitChancePass1, RacDummy, 10> >(ctx, io, dummy, images, ranges, forest, roughZL, 0, learn_repeats, &caches, NULL);
+           else encode_FLIF2_pass<IO, RacDummy, PropertySymbolCoder<FLIFBitChancePass1, RacDummy, 18> >(ctx, io, dummy, images, ranges, forest, roughZL, 0, learn_repeats, &caches, NULL);
            break;
     }
+    learn_timer.done();
     v_printf(3,"\rHeader: %li bytes.", fs);
-    if (encoding==2) v_printf(3," Rough data: %li bytes.", ftell(f)-fs);
+    if (encoding==2) v_printf(3," Rough data: %li bytes.", io.tell()-fs);
     fflush(stdout);
 
     //v_printf(2,"Encoding tree\n");
-    fs = ftell(f);
-    encode_tree<FLIFBitChanceTree, RacOut>(rac, ranges, forest, encoding);
-    v_printf(3," MANIAC tree: %li bytes.\n", ftell(f)-fs);
+    fs = io.tell();
+    StageTimer tree_timer(timings, "MANIAC tree");
+    encode_tree<FLIFBitChanceTree, RacOut<IO> >(rac, ranges, forest, encoding);
+    tree_timer.done();
+    v_printf(3," MANIAC tree: %li bytes.\n", io.tell()-fs);
     //v_printf(2,"Encoding data (pass 2)\n");
+    StageTimer final_timer(timings, "final pass");
     switch(encoding) {
-        case 1:
-           if (bits==10) encode_scanlines_pass<RacOut, FinalPropertySymbolCoder<FLIFBitChancePass2, RacOut, 10> >(rac, images, ranges, forest, 1);
-           else encode_scanlines_pass<RacOut, FinalPropertySymbolCoder<FLIFBitChancePass2, RacOut, 18> >(rac, images, ranges, forest, 1);
+        case 1: case 3:
+           if (bits==10) encode_scanlines_pass<IO, RacOut<IO>, FinalPropertySymbolCoder<FLIFBitChancePass2, RacOut<IO>, 10> >(ctx, io, rac, images, ranges, forest, 1, &caches, encoding == 3);
+           else encode_scanlines_pass<IO, RacOut<IO>, FinalPropertySymbolCoder<FLIFBitChancePass2, RacOut<IO>, 18> >(ctx, io, rac, images, ranges, forest, 1, &caches, encoding == 3);
+           break;
+        case 4:
+           // the main stream ends with the checksum (exactly where the decoder stops reading it), then the plane streams follow
+           metaCoder.write_int(0, 0xFFFF, checksum / 0x10000);
+           metaCoder.write_int(0, 0xFFFF, checksum & 0xFFFF);
+           for (uint8_t byte : rac.termination()) io.write(byte);
+           if (bits==10) encode_scanlines_planar_pass<IO, FinalPropertySymbolCoder<FLIFBitChancePass2, RacOut<BlobIO>, 10> >(ctx, io, images, ranges, forest, &caches, plane_lengths);
+           else encode_scanlines_planar_pass<IO, FinalPropertySymbolCoder<FLIFBitChancePass2, RacOut<BlobIO>, 18> >(ctx, io, images, ranges, forest, &caches, plane_lengths);
            break;
         case 2:
-           if (bits==10) encode_FLIF2_pass<RacOut, FinalPropertySymbolCoder<FLIFBitChancePass2, RacOut, 10> >(rac, images, ranges, forest, roughZL, 0, 1);
-           else encode_FLIF2_pass<RacOut, FinalPropertySymbolCoder<FLIFBitChancePass2, RacOut, 18> >(rac, images, ranges, forest, roughZL, 0, 1);
+           if (bits==10) encode_FLIF2_pass<IO, RacOut<IO>, FinalPropertySymbolCoder<FLIFBitChancePass2, RacOut<IO>, 10> >(ctx, io, rac, images, ranges, forest, roughZL, 0, 1, &caches, index);
+           else encode_FLIF2_pass<IO, RacOut<IO>, FinalPropertySymbolCoder<FLIFBitChancePass2, RacOut<IO>, 18> >(ctx, io, rac, images, ranges, forest, roughZL, 0, 1, &caches, index);
            break;
     }
+    final_timer.done();
     if (numFrames==1)
-      v_printf(2,"\rEncoding done, %li bytes for %ux%u pixels (%.4fbpp)   \n",ftell(f), images[0].cols(), images[0].rows(), 1.0*ftell(f)/images[0].rows()/images[0].cols());
+      v_printf(2,"\rEncoding done, %li bytes for %ux%u pixels (%.4fbpp)   \n",io.tell(), images[0].cols(), images[0].rows(), 1.0*io.tell()/images[0].rows()/images[0].cols());
     else
-      v_printf(2,"\rEncoding done, %li bytes for %i frames of %ux%u pixels (%.4fbpp)   \n",ftell(f), numFrames, images[0].cols(), images[0].rows(), 1.0*ftell(f)/numFrames/images[0].rows()/images[0].cols());
+      v_printf(2,"\rEncoding done, %li bytes for %i frames of %ux%u pixels (%.4fbpp)   \n",io.tell(), numFrames, images[0].cols(), images[0].rows(), 1.0*io.tell()/numFrames/images[0].rows()/images[0].cols());
 
     //v_printf(2,"Writing checksum: %X\n", checksum);
-    metaCoder.write_int(0, 0xFFFF, checksum / 0x10000);
-    metaCoder.write_int(0, 0xFFFF, checksum & 0xFFFF);
-    rac.flush();
-    fclose(f);
+    if (encoding == 4) insert_varints(io, header_end, plane_lengths);
+    else {
+        metaCoder.write_int(0, 0xFFFF, checksum / 0x10000);
+        metaCoder.write_int(0, 0xFFFF, checksum & 0xFFFF);
+        rac.flush();
+    }
+    if (index) index->file_size = io.tell();
 
     for (int i=transforms.size()-1; i>=0; i--) {
         delete transforms[i];
@@ -431,4 +805,89 @@ bool encode(const char* filename, Images &images, std::vector<std::string> trans
     return true;
 }
 
+// encoding 5: the image cut in tiles of at most tile_size x tile_size, each one a complete FLIF file of its own
+// (with its own transforms and trees) in the given encoding, encoded concurrently (with the threads split over the
+// tiles first, so a tile only uses threads of its own if there are fewer tiles than threads). After the header, which has
+// the dimensions as varints (so they can go beyond 0xFFFF), come the tile size, the length of every tile (row
+// by row, as varints) and the tiles themselves.
+template <typename IO>
+bool flif_encode_tiles(IO& io, const Images &images, std::vector<std::string> transDesc, int encoding, int learn_repeats, int acb, int frame_delay, int palette_size, int lookback, FLIFTimings *timings, uint32_t tile_size, int threads, int64_t cache_bytes) {
+    if (images.size() > 1) { fprintf(stderr,"Tiles are only for still images\n"); return false;}
+    if (encoding < 1 || encoding > 4) { fprintf(stderr,"Unknown encoding: %i\n", encoding); return false;}
+    if (tile_size > 0xFFFF) { fprintf(stderr,"Tile size too large: %u\n", tile_size); return false;}
+    const Image& image = images[0];
+    const int numPlanes = image.numPlanes();
+    StageTimer total(timings, "encode", (uint64_t)image.rows()*image.cols());
+    const uint32_t tiles_x = (image.cols()+tile_size-1)/tile_size, tiles_y = (image.rows()+tile_size-1)/tile_size;
+    std::vector<BlobIO> tiles(tiles_x*tiles_y);
+    v_printf(3,"Encoding %ux%u image as %ux%u tiles of at most %ux%u pixels\n", image.cols(), image.rows(), tiles_x, tiles_y, tile_size, tile_size);
+
+    StageTimer tiles_timer(timings, "tiles", (uint64_t)image.rows()*image.cols());
+    const unsigned int budget = thread_budget(threads);
+    const unsigned int nb_threads = std::max<size_t>(1, std::min<size_t>(budget, tiles.size()));
+    const int tile_threads = std::max(1u, budget / nb_threads);
+    const int64_t tile_cache_bytes = (cache_bytes < 0 ? -1 : cache_bytes / nb_threads);
+    std::atomic<size_t> next(0);
+    std::atomic<bool> ok(true);
+    auto work = [&]() {
+        for (size_t t; (t = next++) < tiles.size(); ) {
+            const uint32_t x0 = (t % tiles_x)*tile_size, y0 = (t / tiles_x)*tile_size;
+            Images tile(1);
+            tile[0].init(std::min(tile_size, image.cols()-x0), std::min(tile_size, image.rows()-y0), image.min(0), image.max(0), numPlanes);
+            for (int p = 0; p < numPlanes; p++)
+              for (uint32_t r = 0; r < tile[0].rows(); r++)
+                for (uint32_t c = 0; c < tile[0].cols(); c++)
+                  tile[0].set(p,r,c, image(p,y0+r,x0+c));
+            if (!flif_encode(tiles[t], tile, transDesc, encoding, learn_repeats, acb, frame_delay, palette_size, lookback, NULL, NULL, tile_threads, tile_cache_bytes)) ok = false;
+            tile[0].clear();
+        }
+    };
+    if (nb_threads == 1) work();
+    else {
+        std::vector<std::thread> workers;
+        for (unsigned int i = 0; i < nb_threads; i++) workers.push_back(std::thread(work));
+        for (std::thread &w : workers) w.join();
+    }
+    tiles_timer.done();
+    if (!ok) return false;
+
+    write_extended_header(io, 5, numPlanes, 1);
+    char c='1';
+    for (int p = 0; p < numPlanes; p++) {if (image.max(p) != 255) c='2';}
+    if (c=='2') {for (int p = 0; p < numPlanes; p++) {if (image.max(p) != 65535) c='0';}}
+    io.write(c);
+    if (c=='0') for (int p = 0; p < numPlanes; p++) io.write(ilog2(image.max(p)+1));
+    write_varint(io, image.cols());
+    write_varint(io, image.rows());
+    write_varint(io, tile_size);
+    for (const BlobIO &tile : tiles) write_varint(io, tile.tell());
+    for (const BlobIO &tile : tiles)
+        for (uint8_t byte : tile.buffer()) io.write(byte);
+    io.flush();
+    v_printf(2,"\rEncoding done, %li bytes for %ux%u pixels in %u tiles (%.4fbpp)   \n", io.tell(), image.cols(), image.rows(), (uint32_t)tiles.size(), 1.0*io.tell()/image.rows()/image.cols());
+    return true;
+}
+
+bool encode(const char* filename, Images &images, std::vector<std::string> transDesc, int encoding, int learn_repeats, int acb, int frame_delay, int palette_size, int lookback, FLIFTimings *timings, FLIFIndex *index, uint32_t tile_size, int threads, int64_t cache_bytes) {
+    FileIO fio(filename, true);
+    if (!fio.isOpen()) { fprintf(stderr,"Could not open file for writing: %s\n",filename); return false; }
+    if (tile_size > 0) return flif_encode_tiles(fio, images, transDesc, encoding, learn_repeats, acb, frame_delay, palette_size, lookback, timings, tile_size, threads, cache_bytes);
+    return flif_encode(fio, images, transDesc, encoding, learn_repeats, acb, frame_delay, palette_size, lookback, timings, index, threads, cache_bytes);
+}
 
+bool flif_encode_to_memory(const Images &images, const FLIFEncodeOptions &options, std::vector<uint8_t> &buffer) {
+    BlobIO bio;
+    if (options.tile_size > 0) {
+        // the tiles are copies already
+        bool result = flif_encode_tiles(bio, images, options.transDesc, options.encoding, options.learn_repeats, options.acb, options.frame_delay, options.palette_size, options.lookback, options.timings, options.tile_size, options.threads, options.cache_bytes);
+        buffer.swap(bio.buffer());
+        return result;
+    }
+    // transforms work in place, so encode a private copy
+    Images copies;
+    for (const Image &image : images) copies.push_back(image.clone());
+    bool result = flif_encode(bio, copies, options.transDesc, options.encoding, options.learn_repeats, options.acb, options.frame_delay, options.palette_size, options.lookback, options.timings, options.index, options.threads, options.cache_bytes);
+    for (Image &image : copies) image.clear();
+    buffer.swap(bio.buffer());
+    return result;
+}
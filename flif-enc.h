@@ -1,9 +1,36 @@
 #ifndef __FLIF_ENC_H__
 #define __FLIF_ENC_H__
 
+#include <stdint.h>
+
 #include "image/color_range.h"
 #include "transform/factory.h"
+#include "timings.h"
+#include "flif-index.h"
+
+bool encode(const char* filename, Images &images, std::vector<std::string> transDesc, int encoding, int learn_repeats, int acb, int frame_delay, int palette_size, int lookback, FLIFTimings *timings = NULL, FLIFIndex *index = NULL, uint32_t tile_size = 0, int threads = 0, int64_t cache_bytes = -1);
+
+// encoder settings, defaults are the ones the command line tool uses for a large still image
+struct FLIFEncodeOptions {
+    std::vector<std::string> transDesc;
+    int encoding;           // 1: scanlines, 2: interlaced, 3: row-interleaved scanlines (still images only),
+                            // 4: scanlines with a RAC stream per plane (planes decode concurrently)
+    int learn_repeats;
+    int acb;
+    int frame_delay;
+    int palette_size;
+    int lookback;
+    FLIFTimings *timings;   // if not NULL, the time spent in every stage is added to it
+    FLIFIndex *index;       // if not NULL, gets the end of every (plane, zoomlevel) step (interlaced only)
+    uint32_t tile_size;     // if > 0: tiles of at most tile_size x tile_size, each coded separately with encoding (still images only)
+    int threads;            // the most threads the encoder may use (0: one per hardware thread)
+    int64_t cache_bytes;    // memory for the property cache of the learning passes (-1: PROPERTY_CACHE_FACTOR times
+                            // the image, 0: no cache); tiles encoded at the same time share it
+    FLIFEncodeOptions() : transDesc({"YIQ","BND","PLA","PLT","ACB"}), encoding(2), learn_repeats(TREE_LEARN_REPEATS),
+                          acb(-1), frame_delay(100), palette_size(512), lookback(1), timings(NULL), index(NULL), tile_size(0), threads(0), cache_bytes(-1) {}
+};
 
-bool encode(const char* filename, Images &images, std::vector<std::string> transDesc, int encoding, int learn_repeats, int acb, int frame_delay, int palette_size, int lookback);
+// reentrant: the input images are not modified, all codec state is local to the call
+bool flif_encode_to_memory(const Images &images, const FLIFEncodeOptions &options, std::vector<uint8_t> &buffer);
 
 #endif
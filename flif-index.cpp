@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "flif-index.h"
+
+int FLIFIndex::step_for_scale(int scale) const {
+    int z = 0;
+    while ((1 << (z/2)) < scale) z += 2;
+    if (z == 0) return -1;
+    // all steps at zoomlevel z or coarser
+    int last = 0;
+    for (int i = 0; i < (int)steps.size(); i++) if (steps[i].z >= z) last = i;
+    while (last < (int)steps.size() && !cut_point(last)) last++;
+    return (last < (int)steps.size() ? last : -1);
+}
+
+int FLIFIndex::step_for_bytes(long bytes) const {
+    if (bytes >= file_size) return -1;
+    int last = -2;
+    for (int i = 0; i < (int)steps.size(); i++) if (steps[i].size() <= bytes && cut_point(i)) last = i;
+    return last;
+}
+
+bool FLIFIndex::save(const char *filename) const {
+    FILE *file = fopen(filename, "w");
+    if (!file) { fprintf(stderr,"Could not open file for writing: %s\n", filename); return false; }
+    fprintf(file, "FLIF index 1\n");
+    fprintf(file, "size %li\n", file_size);
+    fprintf(file, "start %li\n", start);
+    // for convenience: the prefix sizes that give complete downscaled images
+    for (int scale = 2; scale <= 0x8000; scale *= 2) {
+        int step = step_for_scale(scale);
+        if (step < 0) break;
+        fprintf(file, "scale %i %li\n", scale, steps[step].size());
+        if (step == 0) break;
+    }
+    for (const FLIFIndexEntry &e : steps) {
+        fprintf(file, "%li %i %i ", e.offset, e.p, e.z);
+        for (uint8_t b : e.termination) fprintf(file, "%02x", b);
+        fprintf(file, "\n");
+    }
+    fclose(file);
+    return true;
+}
+
+bool FLIFIndex::load(const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (!file) { fprintf(stderr,"Could not open index file: %s\n", filename); return false; }
+    char line[256];
+    steps.clear();
+    file_size = 0;
+    bool ok = (fgets(line, sizeof(line), file) && !strcmp(line, "FLIF index 1\n"));
+    while (ok && fgets(line, sizeof(line), file)) {
+        if (!strncmp(line, "scale ", 6)) continue;
+        if (!strncmp(line, "size ", 5)) { ok = (sscanf(line+5, "%li", &file_size) == 1); continue; }
+        if (!strncmp(line, "start ", 6)) { ok = (sscanf(line+6, "%li", &start) == 1); continue; }
+        FLIFIndexEntry e;
+        char hex[64];
+        if (sscanf(line, "%li %i %i %63s", &e.offset, &e.p, &e.z, hex) != 4 || strlen(hex) % 2) { ok = false; break; }
+        for (size_t i = 0; hex[i]; i += 2) {
+            unsigned int b;
+            if (sscanf(hex+i, "%2x", &b) != 1) { ok = false; break; }
+            e.termination.push_back(b);
+        }
+        steps.push_back(e);
+    }
+    fclose(file);
+    if (!ok || file_size <= 0) { fprintf(stderr,"Not a valid FLIF index file: %s\n", filename); return false; }
+    return true;
+}
+
+bool flif_truncate(const char *in, const char *out, const FLIFIndex &index, int step) {
+    FILE *fin = fopen(in, "rb");
+    if (!fin) { fprintf(stderr,"Could not open file: %s\n", in); return false; }
+    fseek(fin, 0, SEEK_END);
+    if (ftell(fin) != index.file_size) { fprintf(stderr,"Index does not belong to this file: %s\n", in); fclose(fin); return false; }
+    fseek(fin, 0, SEEK_SET);
+    FILE *fout = fopen(out, "wb");
+    if (!fout) { fprintf(stderr,"Could not open file for writing: %s\n", out); fclose(fin); return false; }
+    long todo = (step < 0 ? index.file_size : index.steps[step].offset);
+    char buf[0x10000];
+    bool ok = true;
+    while (todo > 0) {
+        size_t n = fread(buf, 1, (todo < (long)sizeof(buf) ? todo : sizeof(buf)), fin);
+        if (n == 0) { fprintf(stderr,"File is shorter than its index says: %s\n", in); ok = false; break; }
+        fwrite(buf, 1, n, fout);
+        todo -= n;
+    }
+    if (ok && step >= 0 && !index.steps[step].termination.empty()) fwrite(&index.steps[step].termination[0], 1, index.steps[step].termination.size(), fout);
+    fclose(fin);
+    if (fclose(fout) != 0) ok = false;
+    return ok;
+}
@@ -0,0 +1,48 @@
+#ifndef __FLIF_INDEX_H__
+#define __FLIF_INDEX_H__
+
+#include <stdint.h>
+#include <vector>
+
+// Where the data of every (plane, zoomlevel) step of an interlaced FLIF file ends.
+// Any prefix of such a file decodes to a lossy preview; a prefix that ends after a step, followed by the
+// termination bytes of that step, decodes that step and all steps before it exactly. The decoder stops at
+// the first step boundary where it has read all bytes, so only steps that need more bytes than the step
+// before them are cut points.
+struct FLIFIndexEntry {
+    int p, z;
+    long offset;                        // bytes of the file up to the end of the step
+    std::vector<uint8_t> termination;   // bytes that terminate the RAC stream at the end of the step
+
+    long size() const { return offset + termination.size(); }
+};
+
+struct FLIFIndex {
+    long file_size;
+    long start;         // like FLIFIndexEntry::size(), before the first step
+    std::vector<FLIFIndexEntry> steps;
+
+    FLIFIndex() : file_size(0), start(0) {}
+
+    bool cut_point(int step) const { return steps[step].size() > (step > 0 ? steps[step-1].size() : start); }
+
+    // the last step needed for a complete image at scale 1:scale (-1 if that needs the whole file)
+    int step_for_scale(int scale) const;
+    // the last step that fits in a prefix of at most bytes bytes (-1 if the whole file fits, -2 if no step fits)
+    int step_for_bytes(long bytes) const;
+
+    // text file:
+    //   "FLIF index 1"
+    //   "size <file_size>"
+    //   "start <start>"
+    //   "scale <n> <bytes>" for n = 2, 4, ...: the prefix size (with termination) for a complete image at 1:n
+    //                       (only the scales that do not need the whole file; load() skips these lines)
+    //   "<offset> <plane> <zoomlevel> <termination bytes in hex>", one line per step, in file order
+    bool save(const char *filename) const;
+    bool load(const char *filename);
+};
+
+// writes the prefix of a FLIF file up to the end of the given step (see FLIFIndex), or all of it if step < 0
+bool flif_truncate(const char *in, const char *out, const FLIFIndex &index, int step);
+
+#endif
@@ -25,12 +25,23 @@
 
 #include <string>
 #include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#ifndef _MSC_VER
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
 
 #include "maniac/rac.h"
 #include "maniac/compound.h"
 #include "maniac/util.h"
 
 #include "image/color_range.h"
+#include "image/image-rows.h"
 #include "transform/factory.h"
 
 #include "flif_config.h"
@@ -41,27 +52,16 @@
 #include "getopt.h"
 #endif
 
-#include <stdarg.h>
 
 #include "common.h"
 #include "flif-enc.h"
 #include "flif-dec.h"
+#include "timings.h"
 
 #ifdef _MSC_VER
 #define strcasecmp stricmp
 #endif
 
-static int verbosity = 1;
-
-void v_printf(const int v, const char *format, ...) {
-    if (verbosity < v) return;
-    va_list args;
-    va_start(args, format);
-    vfprintf(stdout, format, args);
-    fflush(stdout);
-    va_end(args);
-}
-
 // planes:
 // 0    Y channel (luminance)
 // 1    I (chroma)
@@ -82,23 +82,40 @@ void show_help() {
     printf("Usage: (encoding)\n");
     printf("   flif [encode options] <input image(s)> <output.flif>\n");
     printf("   flif [-d] [decode options] <input.flif> <output.pnm | output.pam | output.png>\n");
+    printf("Usage: (batch)\n");
+    printf("   flif --batch [-j N] [options] <input directory> <output directory>\n");
+    printf("   flif --batch [-j N] [options] <manifest file>  (one \"<input> <output>\" per line)\n");
+    printf("   FLIF files are decoded (to PNG in an output directory), other images are encoded.\n");
     printf("General Options:\n");
     printf("   -h, --help           show help\n");
     printf("   -v, --verbose        increase verbosity (multiple -v for more output)\n");
+    printf("   --timings[=F]        report time spent per stage on stderr, F=human (default), json or trace\n");
+    printf("   -j, --jobs=N         batch mode: process N files at the same time (default: number of cores)\n");
     printf("Encode options:\n");
     printf("   -i, --interlace      interlacing (default, except for tiny images)\n");
     printf("   -n, --no-interlace   force no interlacing\n");
+    printf("   -R, --rows           no interlacing, all planes of a row before the next row (decodes row by row)\n");
+    printf("   -P, --planes         no interlacing, every plane in its own stream (planes decode in parallel)\n");
     printf("   -a, --acb            force auto color buckets (ACB)\n");
     printf("   -b, --no-acb         force no auto color buckets\n");
     printf("   -p, --palette=P      max palette size=P (default: P=512)\n");
     printf("   -r, --repeats=N      N repeats for MANIAC learning (default: N=%i)\n",TREE_LEARN_REPEATS);
+    printf("   --cache=M            at most M MiB to remember pixel properties between MANIAC learning repeats\n");
+    printf("                        (0: none; default: %i times the image, or %i MiB shared by all jobs in batch mode)\n", PROPERTY_CACHE_FACTOR, PROPERTY_CACHE_BATCH_BYTES >> 20);
     printf("   Input images should be PNG, PNM (PPM,PGM,PBM) or PAM files.\n");
     printf("   Multiple input images (for animated FLIF) must have the same dimensions.\n");
     printf("   -f, --frame-delay=D  delay between animation frames, in ms (default: D=100)\n");
     printf("   -l, --lookback=L     max lookback between frames (default: L=1)\n");
+    printf("   --index              also write <output.flif>.idx: where the data of every zoomlevel ends\n");
+    printf("   --tiles[=N]          code the image as separate NxN tiles, in parallel (default: N=%i;\n", DEFAULT_TILE_SIZE);
+    printf("                        always used for images wider or higher than 65535 pixels)\n");
     printf("Decode options:\n");
     printf("   -q, --quality=Q      lossy decode quality at Q percent (0..100)\n");
     printf("   -s, --scale=S        lossy downscaled image at scale 1:S (2,4,8,16)\n");
+    printf("   --crop=X,Y,W,H       only the WxH pixels at X,Y (tiled files: only decode the tiles there)\n");
+    printf("Truncate options (interlaced files with an index, see --index):\n");
+    printf("   --truncate-to-scale=S <input.flif> <output.flif>  shortest prefix that decodes at scale 1:S exactly\n");
+    printf("   --truncate-bytes=N <input.flif> <output.flif>     longest prefix of at most N bytes\n");
 }
 
 bool file_exists(const char * filename){
@@ -113,16 +130,314 @@ bool file_is_flif(const char * filename){
         char buff[5];
         bool result=true;
         if (!fgets(buff,5,file)) result=false;
-        else if (strcmp(buff,"FLIF")) result=false;
+        else if (strcmp(buff,"FLIF") && strcmp(buff,"FLIX")) result=false;
         fclose(file);
         return result;
 }
 
+bool has_image_extension(const char * filename){
+        const char *f = strrchr(filename,'/');
+        const char *ext = f ? strrchr(f,'.') : strrchr(filename,'.');
+        return ext && ( !strcasecmp(ext,".png") ||  !strcasecmp(ext,".pnm") ||  !strcasecmp(ext,".ppm")  ||  !strcasecmp(ext,".pgm") ||  !strcasecmp(ext,".pbm") ||  !strcasecmp(ext,".pam"));
+}
+
+// picks the transforms and the settings that were not given on the command line, and encodes
+bool encode_images(Images &images, const char *filename, int method, int learn_repeats, int acb, int frame_delay, int palette_size, int lookback, bool write_index, uint32_t tile_size, FLIFTimings *timings, int threads = 0, int64_t cache_bytes = -1) {
+        bool flat=true;
+        for (Image &image : images) if (image.uses_alpha()) flat=false;
+        if (flat && images[0].numPlanes() == 4) {
+              v_printf(2,"Alpha channel not actually used, dropping it.\n");
+              for (Image &image : images) image.drop_alpha();
+        }
+        uint64_t nb_pixels = (uint64_t)images[0].rows() * images[0].cols();
+        std::vector<std::string> desc;
+        desc.push_back("YIQ");  // convert RGB(A) to YIQ(A)
+        desc.push_back("BND");  // get the bounds of the color spaces
+        if (palette_size > 0)
+          desc.push_back("PLA");  // try palette (including alpha)
+        if (palette_size > 0)
+          desc.push_back("PLT");  // try palette (without alpha)
+        if (acb == -1) {
+          // not specified if ACB should be used
+          if (nb_pixels > 10000) desc.push_back("ACB");  // try auto color buckets on large images
+        } else if (acb) desc.push_back("ACB");  // try auto color buckets if forced
+        if (method == 0) {
+          // no method specified, pick one heuristically
+          if (nb_pixels < 10000) method=1; // if the image is small, not much point in doing interlacing
+          else method=2; // default method: interlacing
+        }
+        if (method == 3 && images.size() > 1) {
+          v_printf(1,"Row-interleaving is only for still images, using no interlacing\n");
+          method = 1;
+        }
+        if (tile_size == 0 && (images[0].cols() > 0xFFFF || images[0].rows() > 0xFFFF)) {
+          v_printf(2,"Image larger than 65535 pixels in one direction, using tiles\n");
+          tile_size = DEFAULT_TILE_SIZE;
+        }
+        if (tile_size > 0 && images.size() > 1) {
+          v_printf(1,"Tiles are only for still images, not using tiles\n");
+          tile_size = 0;
+        }
+        if (images.size() > 1) {
+          desc.push_back("DUP");  // find duplicate frames
+          desc.push_back("FRS");  // get the shapes of the frames
+          if (lookback != 0) desc.push_back("FRA");  // make a "deep" alpha channel (negative values are transparent to some previous frame)
+        }
+        if (learn_repeats < 0) {
+          // no number of repeats specified, pick a number heuristically
+          learn_repeats = TREE_LEARN_REPEATS;
+          if (nb_pixels < 5000) learn_repeats--;        // avoid large trees for small images
+          if (learn_repeats < 0) learn_repeats=0;
+        }
+        FLIFIndex index;
+        if (!encode(filename, images, desc, method, learn_repeats, acb, frame_delay, palette_size, lookback, timings, (write_index ? &index : NULL), tile_size, threads, cache_bytes)) return false;
+        if (write_index) {
+          if (method != 2 || tile_size > 0) { fprintf(stderr,"Warning: no index for a non-interlaced file\n"); return true; }
+          return index.save((std::string(filename) + ".idx").c_str());
+        }
+        return true;
+}
+
+// truncate-to-scale / truncate-bytes: prefix of a FLIF file, using the index that --index wrote
+int truncate_file(const char *in, const char *out, int scale, long bytes) {
+        FLIFIndex index;
+        if (!index.load((std::string(in) + ".idx").c_str())) return 1;
+        int step = (scale > 0 ? index.step_for_scale(scale) : index.step_for_bytes(bytes));
+        if (step == -2) { fprintf(stderr,"No prefix of at most %li bytes decodes to anything\n", bytes); return 1; }
+        if (!flif_truncate(in, out, index, step)) return 2;
+        if (step < 0) v_printf(2,"Copied all %li bytes\n", index.file_size);
+        else v_printf(2,"Wrote %li of %li bytes (up to plane %i, zoomlevel %i)\n", index.steps[step].size(), index.file_size, index.steps[step].p, index.steps[step].z);
+        return 0;
+}
+
+// writes the rows of a row-interleaved file while it is decoded (see FLIFDecodeOptions::row_callback)
+struct RowOutput {
+    const char *filename;
+    int scale;
+    ImageRowWriter *writer;
+    RowOutput(const char *f, int s) : filename(f), scale(s), writer(NULL) {}
+    ~RowOutput() { delete writer; }
+
+    static bool write_row(const Image &row, uint32_t r, uint32_t rows, void *user) {
+        RowOutput &out = *(RowOutput*)user;
+        // like Image::save(filename, scale): every scale-th pixel of every scale-th row
+        if (r % out.scale || r/out.scale >= rows/out.scale) return true;
+        if (!out.writer) out.writer = create_row_writer(out.filename, row.cols()/out.scale, rows/out.scale, row.numPlanes(), row.max(0));
+        if (!out.writer) return false;
+        if (out.scale == 1) return out.writer->write_row(row);
+        Image downscaled(row.cols()/out.scale, 1, 0, row.max(0), row.numPlanes());
+        for (int p = 0; p < row.numPlanes(); p++)
+            for (uint32_t c = 0; c < downscaled.cols(); c++) downscaled.set(p,0,c, row(p,0,c*out.scale));
+        bool ok = out.writer->write_row(downscaled);
+        downscaled.clear();
+        return ok;
+    }
+    bool finish() {
+        return writer && writer->finish();
+    }
+};
+
+// saves decoded images, animation frames go to numbered files (output-000.png, output-001.png, ...)
+bool save_images(Images &images, const char *filename, int scale, FLIFTimings *timings) {
+        const char *ext = strrchr(filename,'.');
+        const uint64_t saved_pixels = (uint64_t)(images[0].rows(0)/scale)*(images[0].cols(0)/scale);
+        if (images.size() == 1) {
+          StageTimer timer(timings, std::string("save ") + filename, saved_pixels);
+          return images[0].save(filename,scale);
+        }
+        int counter=0;
+        std::vector<char> vfilename(strlen(filename)+6);
+        char *frame_filename = &vfilename[0];
+        strcpy(frame_filename,filename);
+        char *a_ext = strrchr(frame_filename,'.');
+        for (Image& image : images) {
+           sprintf(a_ext,"-%03d%s",counter++,ext);
+           StageTimer timer(timings, std::string("save ") + frame_filename, saved_pixels);
+           if (!image.save(frame_filename,scale)) return false;
+           v_printf(2,"    (%i/%i)         \r",counter,(int)images.size()); v_printf(4,"\n");
+        }
+        return true;
+}
+
+/******************************************/
+/*   batch mode                           */
+/******************************************/
+
+struct BatchJob {
+    std::string input, output;
+    bool decode;
+    bool loaded;                    // set by the loader thread
+    bool load_ok;
+    Images images;                  // encode: the input image
+    std::vector<uint8_t> data;      // decode: the input file
+    BatchJob(const std::string &in, const std::string &out) : input(in), output(out), decode(false), loaded(false), load_ok(false) {}
+};
+
+// input directory: encode every image in it, decode every FLIF file (to PNG)
+bool batch_jobs_from_directory(const char *in_dir, const char *out_dir, std::vector<BatchJob> &jobs) {
+#ifdef _MSC_VER
+        fprintf(stderr,"Batch mode needs a manifest file on this platform\n");
+        return false;
+#else
+        DIR *dir = opendir(in_dir);
+        if (!dir) { fprintf(stderr,"Could not open input directory: %s\n", in_dir); return false; }
+        struct stat out_st;
+        if (mkdir(out_dir, 0777) != 0 && (stat(out_dir, &out_st) != 0 || !S_ISDIR(out_st.st_mode))) {
+          fprintf(stderr,"Could not create output directory: %s\n", out_dir);
+          closedir(dir);
+          return false;
+        }
+        std::vector<std::string> names;
+        while (struct dirent *entry = readdir(dir)) names.push_back(entry->d_name);
+        closedir(dir);
+        std::sort(names.begin(), names.end());
+        for (const std::string &name : names) {
+          std::string input = std::string(in_dir) + "/" + name;
+          struct stat st;
+          if (stat(input.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+          size_t dot = name.rfind('.');
+          std::string base = name.substr(0, dot);
+          if (file_is_flif(input.c_str())) jobs.push_back(BatchJob(input, std::string(out_dir) + "/" + base + ".png"));
+          else if (has_image_extension(name.c_str())) jobs.push_back(BatchJob(input, std::string(out_dir) + "/" + base + ".flif"));
+        }
+        return true;
+#endif
+}
+
+bool batch_jobs_from_manifest(const char *manifest, std::vector<BatchJob> &jobs) {
+        FILE *file = fopen(manifest, "r");
+        if (!file) { fprintf(stderr,"Could not open manifest file: %s\n", manifest); return false; }
+        char line[4096];
+        int nb = 0;
+        while (fgets(line, sizeof(line), file)) {
+          nb++;
+          char in[2048], out[2048];
+          int n = sscanf(line, "%2047s %2047s", in, out);
+          if (n <= 0 || in[0] == '#') continue;
+          if (n != 2) { fprintf(stderr,"%s:%i: expected \"<input> <output>\"\n", manifest, nb); fclose(file); return false; }
+          jobs.push_back(BatchJob(in, out));
+        }
+        fclose(file);
+        return true;
+}
+
+bool read_file(const char *filename, std::vector<uint8_t> &data) {
+        FILE *file = fopen(filename, "rb");
+        if (!file) return false;
+        uint8_t buf[0x10000];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), file)) > 0) data.insert(data.end(), buf, buf+n);
+        fclose(file);
+        return true;
+}
+
+long file_size(const char *filename) {
+        FILE *file = fopen(filename, "rb");
+        if (!file) return 0;
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fclose(file);
+        return size;
+}
+
+// Runs the jobs on nb_threads workers. A loader thread reads the inputs (at most 2 per worker ahead),
+// so the workers do not wait for the disk. All threads share the (read-only) chance tables. Every job is coded
+// in its own worker thread only, so there are never more than nb_threads threads coding. The workers split
+// cache_bytes (for the property caches of the encoder) evenly.
+int run_batch(std::vector<BatchJob> &jobs, int nb_threads, int method, int quality, int learn_repeats, int acb, int scale, int frame_delay, int palette_size, int lookback, bool write_index, uint32_t tile_size, int64_t cache_bytes) {
+    typedef std::chrono::steady_clock Clock;
+    const Clock::time_point start = Clock::now();
+    const size_t ahead = 2*nb_threads;
+    std::mutex mutex;
+    std::condition_variable cond;
+    size_t next = 0;                // first job that no worker took yet
+    size_t done = 0, failed = 0;
+    uint64_t total_pixels = 0, total_in = 0, total_out = 0;
+
+    std::thread loader([&]() {
+        for (size_t i = 0; i < jobs.size(); i++) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [&]() { return i < next + ahead; });
+            }
+            BatchJob &job = jobs[i];
+            job.decode = file_is_flif(job.input.c_str());
+            bool ok;
+            if (job.decode) ok = read_file(job.input.c_str(), job.data);
+            else {
+                Image image;
+                ok = image.load(job.input.c_str());
+                if (ok) job.images.push_back(image);
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            job.load_ok = ok;
+            job.loaded = true;
+            cond.notify_all();
+        }
+    });
+
+    auto work = [&]() {
+        while (true) {
+            size_t i;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (next >= jobs.size()) return;
+                i = next++;
+                cond.notify_all();
+                cond.wait(lock, [&]() { return jobs[i].loaded; });
+            }
+            BatchJob &job = jobs[i];
+            const Clock::time_point job_start = Clock::now();
+            bool ok = job.load_ok;
+            uint64_t pixels = 0;
+            if (ok && job.decode) {
+                FLIFDecodeOptions options;
+                options.quality = quality;
+                options.scale = scale;
+                options.threads = 1;
+                ok = flif_decode_from_memory(job.data.empty() ? NULL : &job.data[0], job.data.size(), job.images, options);
+                if (ok) ok = save_images(job.images, job.output.c_str(), scale, NULL);
+            } else if (ok) {
+                ok = encode_images(job.images, job.output.c_str(), method, learn_repeats, acb, frame_delay, palette_size, lookback, write_index, tile_size, NULL, 1, cache_bytes / nb_threads);
+            }
+            for (const Image &image : job.images) pixels += (uint64_t)image.rows()*image.cols();
+            const long in_size = file_size(job.input.c_str()), out_size = (ok ? file_size(job.output.c_str()) : 0);
+            for (Image &image : job.images) image.clear();
+            job.images.clear();
+            std::vector<uint8_t>().swap(job.data);
+            const double seconds = std::chrono::duration<double>(Clock::now() - job_start).count();
+
+            std::lock_guard<std::mutex> lock(mutex);
+            done++;
+            if (!ok) {
+                failed++;
+                fprintf(stderr,"[%i/%i] %s: %s failed\n", (int)done, (int)jobs.size(), job.input.c_str(), job.load_ok ? (job.decode ? "decoding" : "encoding") : "reading");
+                continue;
+            }
+            total_pixels += pixels;
+            total_in += in_size;
+            total_out += out_size;
+            v_printf(1,"[%i/%i] %s -> %s: %li -> %li bytes, %.1f ms, %.2f MPixel/s\n", (int)done, (int)jobs.size(), job.input.c_str(), job.output.c_str(),
+                     in_size, out_size, 1000*seconds, seconds > 0 ? pixels/seconds/1e6 : 0);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int t = 0; t < nb_threads; t++) workers.push_back(std::thread(work));
+    for (std::thread &w : workers) w.join();
+    loader.join();
+
+    const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    v_printf(1,"%i files (%i failed) in %.2f s with %i threads: %.2f files/s, %.2f MPixel/s, %llu -> %llu bytes\n",
+             (int)jobs.size(), (int)failed, seconds, nb_threads, seconds > 0 ? (jobs.size()-failed)/seconds : 0,
+             seconds > 0 ? total_pixels/seconds/1e6 : 0, (unsigned long long)total_in, (unsigned long long)total_out);
+    return failed ? 2 : 0;
+}
+
 int main(int argc, char **argv)
 {
     Images images;
     int mode = 0; // 0 = encode, 1 = decode
-    int method = 0; // 1=non-interlacing, 2=interlacing
+    int method = 0; // 1=non-interlacing, 2=interlacing, 3=row-interleaved non-interlacing, 4=non-interlacing with a stream per plane
     int quality = 100; // 100 = everything, positive value: partial decode, negative value: only rough data
     int learn_repeats = -1;
     int acb = -1; // try auto color buckets
@@ -130,6 +445,17 @@ int main(int argc, char **argv)
     int frame_delay = 100;
     int palette_size = 512;
     int lookback = 1;
+    FLIFTimings timings;
+    FLIFTimingsFormat timings_format = TIMINGS_HUMAN;
+    FLIFTimings *ptimings = NULL;
+    bool batch = false;
+    bool write_index = false;
+    int truncate_scale = 0;
+    long truncate_bytes = 0;
+    uint32_t tile_size = 0;
+    uint32_t crop[4] = {0, 0, 0, 0};
+    int64_t cache_bytes = -1;
+    int nb_threads = std::max(1u, std::thread::hardware_concurrency());
     if (strcmp(argv[0],"flif") == 0) mode = 0;
     if (strcmp(argv[0],"dflif") == 0) mode = 1;
     if (strcmp(argv[0],"deflif") == 0) mode = 1;
@@ -142,6 +468,8 @@ int main(int argc, char **argv)
         {"verbose", 0, NULL, 'v'},
         {"interlace", 0, NULL, 'i'},
         {"no-interlace", 0, NULL, 'n'},
+        {"rows", 0, NULL, 'R'},
+        {"planes", 0, NULL, 'P'},
         {"acb", 0, NULL, 'a'},
         {"no-acb", 0, NULL, 'b'},
         {"quality", 1, NULL, 'q'},
@@ -150,16 +478,27 @@ int main(int argc, char **argv)
         {"repeats", 1, NULL, 'r'},
         {"frame-delay", 1, NULL, 'f'},
         {"lookback", 1, NULL, 'l'},
+        {"timings", 2, NULL, 'T'},
+        {"batch", 0, NULL, 'B'},
+        {"jobs", 1, NULL, 'j'},
+        {"index", 0, NULL, 'X'},
+        {"truncate-to-scale", 1, NULL, 'S'},
+        {"truncate-bytes", 1, NULL, 'N'},
+        {"tiles", 2, NULL, 'Y'},
+        {"crop", 1, NULL, 'C'},
+        {"cache", 1, NULL, 'K'},
         {0, 0, 0, 0}
     };
     int i,c;
-    while ((c = getopt_long (argc, argv, "hedvinabq:s:p:r:f:l:", optlist, &i)) != -1) {
+    while ((c = getopt_long (argc, argv, "hedvinRPabq:s:p:r:f:l:j:", optlist, &i)) != -1) {
         switch (c) {
         case 'e': mode=0; break;
         case 'd': mode=1; break;
-        case 'v': verbosity++; break;
+        case 'v': increase_verbosity(); break;
         case 'i': if (method==0) method=2; break;
         case 'n': method=1; break;
+        case 'R': method=3; break;
+        case 'P': method=4; break;
         case 'a': acb=1; break;
         case 'b': acb=0; break;
         case 'p': palette_size=atoi(optarg);
@@ -181,6 +520,30 @@ int main(int argc, char **argv)
         case 'l': lookback=atoi(optarg);
                   if (lookback < -1 || lookback > 256) {fprintf(stderr,"Not a sensible number for option -l\n"); return 1; }
                   break;
+        case 'T': if (!parse_timings_format(optarg, timings_format)) {fprintf(stderr,"Unknown timings format: %s (use human, json or trace)\n", optarg); return 1; }
+                  ptimings = &timings;
+                  break;
+        case 'B': batch=true; break;
+        case 'j': nb_threads=atoi(optarg);
+                  if (nb_threads < 1 || nb_threads > 256) {fprintf(stderr,"Not a sensible number for option -j\n"); return 1; }
+                  break;
+        case 'X': write_index=true; break;
+        case 'S': truncate_scale=atoi(optarg);
+                  if (truncate_scale < 1 || truncate_scale > 0x8000) {fprintf(stderr,"Not a sensible number for option --truncate-to-scale\n"); return 1; }
+                  break;
+        case 'N': truncate_bytes=atol(optarg);
+                  if (truncate_bytes < 1) {fprintf(stderr,"Not a sensible number for option --truncate-bytes\n"); return 1; }
+                  break;
+        case 'Y': tile_size = (optarg ? atoi(optarg) : DEFAULT_TILE_SIZE);
+                  if (tile_size < 16 || tile_size > 0xFFFF) {fprintf(stderr,"Not a sensible number for option --tiles\n"); return 1; }
+                  break;
+        case 'C': if (sscanf(optarg, "%u,%u,%u,%u", &crop[0], &crop[1], &crop[2], &crop[3]) != 4 || crop[2] == 0 || crop[3] == 0) {
+                    fprintf(stderr,"Expected X,Y,W,H for option --crop\n"); return 1; }
+                  break;
+        case 'K': cache_bytes=atol(optarg);
+                  if (cache_bytes < 0 || cache_bytes > 0x100000) {fprintf(stderr,"Not a sensible number for option --cache\n"); return 1; }
+                  cache_bytes <<= 20;
+                  break;
         case 'h':
         default: show_help(); return 0;
         }
@@ -195,9 +558,23 @@ int main(int argc, char **argv)
   v_printf(3,"\n");
   if (argc == 0) {
         //fprintf(stderr,"Input file missing.\n");
-        if (verbosity == 1) show_help();
+        if (get_verbosity() == 1) show_help();
         return 1;
   }
+  if (batch) {
+        std::vector<BatchJob> jobs;
+        if (argc == 1) {
+          if (!batch_jobs_from_manifest(argv[0], jobs)) return 1;
+        } else {
+          if (!batch_jobs_from_directory(argv[0], argv[1], jobs)) return 1;
+        }
+        if (ptimings) fprintf(stderr,"Warning: --timings is ignored in batch mode\n");
+        return run_batch(jobs, nb_threads, method, quality, learn_repeats, acb, scale, frame_delay, palette_size, lookback, write_index, tile_size, cache_bytes < 0 ? PROPERTY_CACHE_BATCH_BYTES : cache_bytes);
+  }
+  if (truncate_scale || truncate_bytes) {
+        if (argc < 2) { fprintf(stderr,"Output file missing.\n"); return 1; }
+        return truncate_file(argv[0], argv[1], truncate_scale, truncate_bytes);
+  }
   if (argc == 1) {
         fprintf(stderr,"Output file missing.\n");
         show_help();
@@ -235,10 +612,13 @@ int main(int argc, char **argv)
         while(argc>1) {
           Image image;
           v_printf(2,"\r");
+          StageTimer timer(ptimings, std::string("load ") + argv[0]);
           if (!image.load(argv[0])) {
             fprintf(stderr,"Could not read input file: %s\n", argv[0]);
             return 2;
           };
+          timer.set_pixels((uint64_t)image.rows()*image.cols());
+          timer.done();
           images.push_back(image);
           if (image.rows() != images[0].rows() || image.cols() != images[0].cols() || image.numPlanes() != images[0].numPlanes()) {
             fprintf(stderr,"Dimensions of all input images should be the same!\n");
@@ -250,41 +630,7 @@ int main(int argc, char **argv)
           if (nb_input_images>1) {v_printf(2,"    (%i/%i)         ",(int)images.size(),nb_input_images); v_printf(4,"\n");}
         }
         v_printf(2,"\n");
-        bool flat=true;
-        for (Image &image : images) if (image.uses_alpha()) flat=false;
-        if (flat && images[0].numPlanes() == 4) {
-              v_printf(2,"Alpha channel not actually used, dropping it.\n");
-              for (Image &image : images) image.drop_alpha();
-        }
-        uint64_t nb_pixels = (uint64_t)images[0].rows() * images[0].cols();
-        std::vector<std::string> desc;
-        desc.push_back("YIQ");  // convert RGB(A) to YIQ(A)
-        desc.push_back("BND");  // get the bounds of the color spaces
-        if (palette_size > 0)
-          desc.push_back("PLA");  // try palette (including alpha)
-        if (palette_size > 0)
-          desc.push_back("PLT");  // try palette (without alpha)
-        if (acb == -1) {
-          // not specified if ACB should be used
-          if (nb_pixels > 10000) desc.push_back("ACB");  // try auto color buckets on large images
-        } else if (acb) desc.push_back("ACB");  // try auto color buckets if forced
-        if (method == 0) {
-          // no method specified, pick one heuristically
-          if (nb_pixels < 10000) method=1; // if the image is small, not much point in doing interlacing
-          else method=2; // default method: interlacing
-        }
-        if (images.size() > 1) {
-          desc.push_back("DUP");  // find duplicate frames
-          desc.push_back("FRS");  // get the shapes of the frames
-          if (lookback != 0) desc.push_back("FRA");  // make a "deep" alpha channel (negative values are transparent to some previous frame)
-        }
-        if (learn_repeats < 0) {
-          // no number of repeats specified, pick a number heuristically
-          learn_repeats = TREE_LEARN_REPEATS;
-          if (nb_pixels < 5000) learn_repeats--;        // avoid large trees for small images
-          if (learn_repeats < 0) learn_repeats=0;
-        }
-        encode(argv[0], images, desc, method, learn_repeats, acb, frame_delay, palette_size, lookback);
+        encode_images(images, argv[0], method, learn_repeats, acb, frame_delay, palette_size, lookback, write_index, tile_size, ptimings, 0, cache_bytes);
   } else {
         char *ext = strrchr(argv[1],'.');
         if (ext && ( !strcasecmp(ext,".png") ||  !strcasecmp(ext,".pnm") ||  !strcasecmp(ext,".ppm")  ||  !strcasecmp(ext,".pgm") ||  !strcasecmp(ext,".pbm") ||  !strcasecmp(ext,".pam"))) {
@@ -293,25 +639,31 @@ int main(int argc, char **argv)
            fprintf(stderr,"Error: expected \".png\", \".pnm\" or \".pam\" file name extension for output file\n");
            return 1;
         }
-        if (!decode(argv[0], images, quality, scale)) return 3;
-        if (scale>1)
-          v_printf(3,"Downscaling output: %ux%u -> %ux%u\n",images[0].cols(),images[0].rows(),images[0].cols()/scale,images[0].rows()/scale);
-        if (images.size() == 1) {
-          if (!images[0].save(argv[1],scale)) return 2;
-        } else {
-          int counter=0;
-          std::vector<char> vfilename(strlen(argv[1])+6);
-          char *filename = &vfilename[0];
-          strcpy(filename,argv[1]);
-          char *a_ext = strrchr(filename,'.');
-          for (Image& image : images) {
-             sprintf(a_ext,"-%03d%s",counter++,ext);
-             if (!image.save(filename,scale)) return 2;
-             v_printf(2,"    (%i/%i)         \r",counter,(int)images.size()); v_printf(4,"\n");
-          }
+        FLIFDecodeOptions options;
+        options.quality = quality;
+        options.scale = scale;
+        options.timings = ptimings;
+        options.crop_x = crop[0];
+        options.crop_y = crop[1];
+        options.crop_width = crop[2];
+        options.crop_height = crop[3];
+        RowOutput rows(argv[1], scale);
+        options.row_callback = RowOutput::write_row;
+        options.row_user = &rows;
+        if (!decode(argv[0], images, options)) return 3;
+        if (images.empty()) {
+          // row-interleaved file, already written
+          if (!rows.finish()) return 2;
+          v_printf(2,"\n");
+          if (ptimings) timings.report(stderr, timings_format);
+          return 0;
         }
+        if (scale>1)
+          v_printf(3,"Downscaling output: %ux%u -> %ux%u\n",images[0].cols(0),images[0].rows(0),images[0].cols(0)/scale,images[0].rows(0)/scale);
+        if (!save_images(images, argv[1], scale, ptimings)) return 2;
         v_printf(2,"\n");
   }
   for (Image &image : images) image.clear();
+  if (ptimings) timings.report(stderr, timings_format);
   return 0;
 }
@@ -11,12 +11,33 @@
 // during decode, check for unexpected file end and interpolate from there
 #define CHECK_FOR_BROKENFILES 1
 
+// learn the MANIAC trees of the different planes in parallel threads
+#define PARALLEL_LEARNING 1
+
+// remember the properties of the pixels in the first learning pass and replay them in the other passes, by
+// default using at most this many times the memory of the image's pixel values (at 4 bytes per value)
+#define PROPERTY_CACHE_FACTOR 2
+// the memory all property caches of flif --batch share, unless --cache gives it
+#define PROPERTY_CACHE_BATCH_BYTES 0x10000000
+
+// the frame lookback search (FRA) keeps a hash of every pixel of the last L frames if that takes at most
+// this many bytes (otherwise it keeps the hashes of the last frames that fit, and compares the pixels of the others)
+#define LOOKBACK_RING_MAX_BYTES 0x8000000
+
+
+// tile size of the tiled encoding (flif --tiles), which is also used for images larger than 65535 pixels in one direction
+#define DEFAULT_TILE_SIZE 1024
+
+// decode from a memory mapped file instead of reading it in blocks (where available)
+#define FLIF_USE_MMAP 1
+
 
 #include "maniac/rac.h"
-typedef RacInput40 RacIn;
-typedef RacOutput40 RacOut;
-//typedef RacInput24 RacIn;
-//typedef RacOutput24 RacOut;
+#include "fileio.h"
+template <typename IO> using RacIn = RacInput40<IO>;
+template <typename IO> using RacOut = RacOutput40<IO>;
+//template <typename IO> using RacIn = RacInput24<IO>;
+//template <typename IO> using RacOut = RacOutput24<IO>;
 
 #include "maniac/compound.h"
 typedef MultiscaleBitChance<6,SimpleBitChance>  FLIFBitChanceMeta;
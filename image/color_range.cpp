@@ -11,3 +11,37 @@ const ColorRanges *getRanges(const Image &image) {
 const ColorRanges *getRanges(const ColorRanges *ranges) {
     return new DupColorRanges(ranges);
 }
+
+// 12 bytes per entry
+#define MAX_FLAT_TABLE_SIZE 0x100000
+
+FlatColorRanges::FlatColorRanges(const ColorRanges *rangesIn) : ranges(rangesIn), nump(rangesIn->numPlanes()) {
+    assert(nump <= 4);
+    for (int p = 0; p < 4; p++) {
+        lo[p] = (p < nump ? ranges->min(p) : 0);
+        hi[p] = (p < nump ? ranges->max(p) : 0);
+        keys[p] = (ranges->isStatic() || p == 0 || p == 3 ? 0 : p);
+    }
+    n0 = (hi[0] >= lo[0] ? hi[0] - lo[0] + 1 : 0);
+    n1 = (hi[1] >= lo[1] ? hi[1] - lo[1] + 1 : 0);
+    if (ranges->flatten(*this)) return;
+
+    prevPlanes pp(lo, lo+4);
+    for (int p = 0; p < nump; p++) {
+        tables[p].resize(table_size(p));
+        for (size_t k = 0; k < tables[p].size(); k++) {
+            Entry &e = tables[p][k];
+            table_key(p, k, pp);
+            ranges->minmax(p, pp, e.min, e.max);
+            e.snap = SNAP_CLAMP;
+        }
+    }
+}
+
+size_t FlatColorRanges::table_size(const int p) const {
+    if (p >= nump) return 0;
+    size_t size = 1;
+    if (keys[p] >= 1) size *= n0;
+    if (keys[p] >= 2) size *= n1;
+    return (size <= MAX_FLAT_TABLE_SIZE ? size : 0);
+}
@@ -7,6 +7,7 @@
 
 typedef std::vector<ColorVal> prevPlanes;
 
+class FlatColorRanges;
 
 class ColorRanges
 {
@@ -22,6 +23,8 @@ public:
         if(v<minv) v=minv;
     }
     virtual bool isStatic() const { return true; }
+    // fills the tables of flat, if snap() does more than clamping to minmax(); see FlatColorRanges
+    virtual bool flatten(FlatColorRanges &flat) const { return false; }
 };
 
 typedef std::vector<std::pair<ColorVal, ColorVal> > StaticColorRangeList;
@@ -55,4 +58,76 @@ public:
 
 const ColorRanges *dupRanges(const ColorRanges *ranges);
 
+// The final range stack, compiled once after the transforms are known, for the per-pixel snap() calls.
+// The range of planes 0 and 3 does not depend on the other planes, plane 1 has a table indexed by the
+// value of plane 0 and plane 2 one indexed by the values of planes 0 and 1 (static stacks only need the
+// constant ranges). Calls through a FlatColorRanges pointer are not virtual; if a table would be too big,
+// or for values outside the table, the stack is used.
+class FlatColorRanges final : public ColorRanges
+{
+public:
+    enum { SNAP_CLAMP = -1, SNAP_BUCKET = -2 };
+    struct Entry {
+        ColorVal min;
+        ColorVal max;
+        int32_t snap;   // SNAP_CLAMP, SNAP_BUCKET (continuous color bucket) or offset of the bucket in snapvalues
+    };
+    std::vector<Entry> tables[4];
+    std::vector<ColorVal> snapvalues;
+
+protected:
+    const ColorRanges *ranges;
+    int nump;
+    ColorVal lo[4], hi[4];
+    int keys[4];        // number of planes the table of a plane is indexed by
+    uint32_t n0, n1;    // number of values of plane 0 and 1
+
+public:
+    FlatColorRanges(const ColorRanges *rangesIn);
+
+    // number of entries in the table of plane p (0 if it has none)
+    size_t table_size(const int p) const;
+    // sets the values of the planes that entry k of the table of plane p is for
+    void table_key(const int p, const size_t k, prevPlanes &pp) const {
+        if (keys[p] == 1) pp[0] = lo[0] + k;
+        if (keys[p] == 2) { pp[0] = lo[0] + k/n1; pp[1] = lo[1] + k%n1; }
+    }
+
+    const Entry *find(const int p, const prevPlanes &pp) const {
+        const std::vector<Entry> &t = tables[p];
+        if (t.empty()) return NULL;
+        if (keys[p] == 0) return &t[0];
+        uint32_t y = pp[0] - lo[0];
+        if (y >= n0) return NULL;
+        if (keys[p] == 1) return &t[y];
+        uint32_t i = pp[1] - lo[1];
+        if (i >= n1) return NULL;
+        return &t[y*n1 + i];
+    }
+
+    int numPlanes() const { return nump; }
+    ColorVal min(int p) const { return lo[p]; }
+    ColorVal max(int p) const { return hi[p]; }
+    bool isStatic() const { return ranges->isStatic(); }
+    void minmax(const int p, const prevPlanes &pp, ColorVal &minv, ColorVal &maxv) const {
+        const Entry *e = find(p,pp);
+        if (!e) { ranges->minmax(p,pp,minv,maxv); return; }
+        minv = e->min;
+        maxv = e->max;
+    }
+    void snap(const int p, const prevPlanes &pp, ColorVal &minv, ColorVal &maxv, ColorVal &v) const {
+        const Entry *e = find(p,pp);
+        if (!e) { ranges->snap(p,pp,minv,maxv,v); return; }
+        minv = e->min;
+        maxv = e->max;
+        if (e->snap == SNAP_CLAMP) {
+            if(v>maxv) v=maxv;
+            if(v<minv) v=minv;
+        }
+        else if (v <= minv) v=minv;
+        else if (v >= maxv) v=maxv;
+        else if (e->snap >= 0) v=snapvalues[e->snap + v - minv];
+    }
+};
+
 #endif
@@ -298,3 +298,79 @@ int image_save_png(const char *filename, const Image &image) {
   return 0;
 #endif
 }
+
+#ifdef FLIF_USE_STB_IMAGE
+ImageRowWriter *png_row_writer(const char *filename, uint32_t width, uint32_t height, int nump, ColorVal max) {
+  return NULL;  // stb_image_write only writes whole images
+}
+#else
+class PNGRowWriter : public ImageRowWriter {
+  FILE *fp;
+  png_structp png_ptr;
+  png_infop info_ptr;
+  png_bytep row;
+  uint32_t width;
+  int nbplanes, bytes_per_value;
+public:
+  PNGRowWriter() : fp(NULL), png_ptr(NULL), info_ptr(NULL), row(NULL) {}
+  ~PNGRowWriter() {
+    if (row) png_free(png_ptr,row);
+    if (png_ptr) png_destroy_write_struct(&png_ptr,&info_ptr);
+    if (fp) fclose(fp);
+  }
+  bool init(const char *filename, uint32_t w, uint32_t h, int nump, ColorVal max) {
+    if (nump != 1 && nump != 3 && nump != 4) return false;
+    fp = fopen(filename,"wb");
+    if (!fp) return false;
+    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,(png_voidp) NULL,NULL,NULL);
+    if (!png_ptr) return false;
+    info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr) return false;
+    png_init_io(png_ptr,fp);
+    // unlike image_save_png, an alpha plane is always kept: whether it is used is only known at the end
+    int colortype=PNG_COLOR_TYPE_RGB;
+    if (nump == 4) colortype=PNG_COLOR_TYPE_RGB_ALPHA;
+    if (nump == 1) colortype=PNG_COLOR_TYPE_GRAY;
+    int bit_depth = 8;
+    bytes_per_value = 1;
+    if (max > 255) {bit_depth = 16; bytes_per_value=2;}
+    png_set_IHDR(png_ptr,info_ptr,w,h,bit_depth,colortype,PNG_INTERLACE_NONE,PNG_COMPRESSION_TYPE_DEFAULT,
+        PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png_ptr,info_ptr);
+    width = w;
+    nbplanes = nump;
+    row = (png_bytep) png_malloc(png_ptr,nbplanes * bytes_per_value * width);
+    return true;
+  }
+  bool write_row(const Image &image) {
+    if (bytes_per_value == 1) {
+     for (size_t c = 0; c < width; c++) {
+      for (int p=0; p<nbplanes; p++) {
+        row[c * nbplanes + p] = (png_byte) (image(p,0,c));
+      }
+     }
+    } else {
+     for (size_t c = 0; c < width; c++) {
+      for (int p=0; p<nbplanes; p++) {
+        row[c * nbplanes * 2 + 2*p] = (png_byte) (image(p,0,c) >> 8);
+        row[c * nbplanes * 2 + 2*p + 1] = (png_byte) (image(p,0,c) & 0xff);
+      }
+     }
+    }
+    png_write_row(png_ptr,row);
+    return true;
+  }
+  bool finish() {
+    png_write_end(png_ptr,info_ptr);
+    bool ok = (fclose(fp) == 0);
+    fp = NULL;
+    return ok;
+  }
+};
+
+ImageRowWriter *png_row_writer(const char *filename, uint32_t width, uint32_t height, int nump, ColorVal max) {
+  PNGRowWriter *writer = new PNGRowWriter();
+  if (!writer->init(filename, width, height, nump, max)) { delete writer; return NULL; }
+  return writer;
+}
+#endif
@@ -2,8 +2,10 @@
 #define _IMAGE_PNG_H_ 1
 
 #include "image.h"
+#include "image-rows.h"
 
 int image_load_png(const char *filename, Image &image);
 int image_save_png(const char *filename, const Image &image);
+ImageRowWriter *png_row_writer(const char *filename, uint32_t width, uint32_t height, int nump, ColorVal max);
 
 #endif
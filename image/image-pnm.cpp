@@ -142,3 +142,58 @@ bool image_save_pnm(const char *filename, const Image& image)
     return true;
 
 }
+
+class PNMRowWriter : public ImageRowWriter {
+    FILE *fp;
+    uint32_t width;
+    int nbplanes;
+    ColorVal max;
+public:
+    PNMRowWriter() : fp(NULL) {}
+    ~PNMRowWriter() {
+        if (fp) fclose(fp);
+    }
+    bool init(const char *filename, uint32_t w, uint32_t h, int nump, ColorVal m, bool pam) {
+        if (m > 0xffff || nump == 2 || nump > 4) {
+            fprintf(stderr,"Cannot store as PNM. Find out why.\n");
+            return false;
+        }
+        fp = fopen(filename,"wb");
+        if (!fp) return false;
+        width = w;
+        max = m;
+        if (nump == 4 && pam) {
+            nbplanes = 4;
+            fprintf(fp,"P7\nWIDTH %u\nHEIGHT %u\nDEPTH 4\nMAXVAL %i\nTUPLTYPE RGB_ALPHA\nENDHDR\n", w, h, max);
+        } else if (nump >= 3) {
+            if (nump == 4) v_printf(1,"WARNING: image has alpha channel, saving to flat PPM! Use .png or .pam if you want to keep the alpha channel!\n");
+            nbplanes = 3;
+            fprintf(fp,"P6\n%u %u\n%i\n", w, h, max);
+        } else {
+            nbplanes = 1;
+            fprintf(fp,"P5\n%u %u\n%i\n", w, h, max);
+        }
+        return true;
+    }
+    bool write_row(const Image &image) {
+        for (unsigned int x = 0; x < width; x++) {
+            for (int p = 0; p < nbplanes; p++) {
+                if (max > 0xff) fputc(image(p,0,x) >> 8,fp);
+                fputc(image(p,0,x) & 0xFF,fp);
+            }
+        }
+        return !ferror(fp);
+    }
+    bool finish() {
+        bool ok = (fclose(fp) == 0);
+        fp = NULL;
+        return ok;
+    }
+};
+
+ImageRowWriter *pnm_row_writer(const char *filename, uint32_t width, uint32_t height, int nump, ColorVal max, bool pam)
+{
+    PNMRowWriter *writer = new PNMRowWriter();
+    if (!writer->init(filename, width, height, nump, max, pam)) { delete writer; return NULL; }
+    return writer;
+}
@@ -2,8 +2,11 @@
 #define _IMAGE_PNM_H_ 1
 
 #include "image.h"
+#include "image-rows.h"
 
 bool image_load_pnm(const char *filename, Image& image);
 bool image_save_pnm(const char *filename, const Image& image);
+// pam: PAM with alpha if there are 4 planes (like image_save_pam), PNM otherwise
+ImageRowWriter *pnm_row_writer(const char *filename, uint32_t width, uint32_t height, int nump, ColorVal max, bool pam);
 
 #endif
@@ -0,0 +1,20 @@
+#ifndef _IMAGE_ROWS_H_
+#define _IMAGE_ROWS_H_ 1
+
+#include "image.h"
+
+// writes an image file row by row, so the image does not have to be in memory at once
+class ImageRowWriter {
+public:
+    virtual ~ImageRowWriter() {}
+    // row 0 of row (an image of one row) is the next row of the file
+    virtual bool write_row(const Image &row) = 0;
+    // after the last row
+    virtual bool finish() = 0;
+};
+
+// a writer for a width x height image with nump planes, in the format of the extension of filename (PNG, PNM or PAM),
+// or NULL if that is not possible
+ImageRowWriter *create_row_writer(const char *filename, uint32_t width, uint32_t height, int nump, ColorVal max);
+
+#endif
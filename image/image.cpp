@@ -62,15 +62,36 @@ bool Image::save(const char *filename) const
     fprintf(stderr,"ERROR: Unknown extension to write to: %s\n",ext ? ext : "(none)");
     return false;
 }
+ImageRowWriter *create_row_writer(const char *filename, uint32_t width, uint32_t height, int nump, ColorVal max)
+{
+    const char *f = strrchr(filename,'/');
+    const char *ext = f ? strrchr(f,'.') : strrchr(filename,'.');
+    v_printf(2,"Saving output file row by row: %s  ",filename);
+    if (ext && !strcasecmp(ext,".png")) {
+        return png_row_writer(filename, width, height, nump, max);
+    }
+    if (ext && (!strcasecmp(ext,".pnm") || !strcasecmp(ext,".pgm") || !strcasecmp(ext,".ppm"))) {
+        return pnm_row_writer(filename, width, height, nump, max, false);
+    }
+    if (ext && !strcasecmp(ext,".pam")) {
+        return pnm_row_writer(filename, width, height, nump, max, true);
+    }
+    fprintf(stderr,"ERROR: Unknown extension to write to: %s\n",ext ? ext : "(none)");
+    return NULL;
+}
+
 bool Image::save(const char *filename, const int scale) const
 {
-    if (scale == 1) return this->save(filename);
+    // the image may already be stored at a lower scale
+    assert(scale % this->scale() == 0);
+    const int step = scale / this->scale();
+    if (step == 1 && this->width == this->cols(0)/scale && this->height == this->rows(0)/scale) return this->save(filename);
     Image downscaled;
-    downscaled.init(this->width/scale, this->height/scale, this->min(0), this->max(0), this->numPlanes());
+    downscaled.init(this->cols(0)/scale, this->rows(0)/scale, this->min(0), this->max(0), this->numPlanes());
     for (int p=0; p<downscaled.numPlanes(); p++) {
         for (uint32_t r=0; r<downscaled.rows(); r++) {
             for (uint32_t c=0; c<downscaled.cols(); c++) {
-                    downscaled.set(p,r,c, this->operator()(p,r*scale,c*scale));
+                    downscaled.set(p,r,c, this->operator()(p,r*step,c*step));
             }
         }
     }
@@ -30,6 +30,13 @@ public:
 //        if (r >= height || r < 0 || c >= width || c < 0) {printf("OUT OF RANGE!\n"); return 0;}
         return data[r*width + c];
     }
+
+    const pixel_t *pointer(const uint32_t r, const uint32_t c) const {
+        return &data[r*width + c];
+    }
+    pixel_t *pointer(const uint32_t r, const uint32_t c) {
+        return &data[r*width + c];
+    }
 };
 
 class Image {
@@ -41,6 +48,9 @@ protected:
     Plane<ColorVal_intern_32> *plane_32_1;
     Plane<ColorVal_intern_32> *plane_32_2;
     uint32_t width, height;
+    // an image decoded at a lower scale only stores zoomlevel 2*scale_shift of the full_width x full_height image
+    uint32_t full_width, full_height;
+    int scale_shift;
     ColorVal minval,maxval;
     int num;
     int depth;
@@ -56,9 +66,14 @@ public:
 
     Image() {
     }
-    void init(uint32_t w, uint32_t h, ColorVal min, ColorVal max, int p) {
-      width = w;
-      height = h;
+    // scale > 1: only allocate the pixels of the image downscaled 1:scale (at most down to its coarsest even zoomlevel)
+    void init(uint32_t w, uint32_t h, ColorVal min, ColorVal max, int p, int scale = 1) {
+      full_width = w;
+      full_height = h;
+      scale_shift = 0;
+      while ((2<<scale_shift) <= scale && 2*scale_shift+2 <= zooms()) scale_shift++;
+      width = cols(2*scale_shift);
+      height = rows(2*scale_shift);
       minval = min;
       maxval = max;
       col_begin.clear();
@@ -101,6 +116,17 @@ public:
         clear();
         init(0,0,0,0,0);
     }
+    // copying an Image only copies the plane pointers; this also copies the pixel data
+    Image clone() const {
+        Image copy = *this;
+        if (plane_8_1) copy.plane_8_1 = new Plane<ColorVal_intern_8>(*plane_8_1);
+        if (plane_8_2) copy.plane_8_2 = new Plane<ColorVal_intern_8>(*plane_8_2);
+        if (plane_16_1) copy.plane_16_1 = new Plane<ColorVal_intern_16>(*plane_16_1);
+        if (plane_16_2) copy.plane_16_2 = new Plane<ColorVal_intern_16>(*plane_16_2);
+        if (plane_32_1) copy.plane_32_1 = new Plane<ColorVal_intern_32>(*plane_32_1);
+        if (plane_32_2) copy.plane_32_2 = new Plane<ColorVal_intern_32>(*plane_32_2);
+        return copy;
+    }
     bool uses_alpha() const {
         if (num<4) return false;
         for (uint32_t r=0; r<height; r++)
@@ -113,8 +139,10 @@ public:
         assert(num==4);
         if (depth <= 8) {
                 if (plane_8_2) delete plane_8_2;
+                plane_8_2 = NULL;
         } else {
                 if (plane_16_2) delete plane_16_2;
+                plane_16_2 = NULL;
         }
         num=3;
     }
@@ -176,6 +204,31 @@ public:
         }
       }
     }
+    // plane p is stored as int32_t (ColorVal_intern_16/32) rather than int16_t (ColorVal_intern_8)
+    bool wide_plane(const int p) const {
+      return depth > 8 || p == 1 || p == 2;
+    }
+    // raw pointer to the first pixel of row r of plane p, see wide_plane() for its type
+    const void *row_pointer(const int p, const uint32_t r) const {
+      if (depth <= 8) {
+        switch(p) {
+          case 0: return plane_8_1->pointer(r,0);
+          case 1: return plane_16_1->pointer(r,0);
+          case 2: return plane_16_2->pointer(r,0);
+          default: return plane_8_2->pointer(r,0);
+        }
+      } else {
+        switch(p) {
+          case 0: return plane_16_1->pointer(r,0);
+          case 1: return plane_32_1->pointer(r,0);
+          case 2: return plane_32_2->pointer(r,0);
+          default: return plane_16_2->pointer(r,0);
+        }
+      }
+    }
+    void *row_pointer(const int p, const uint32_t r) {
+      return const_cast<void *>(static_cast<const Image *>(this)->row_pointer(p, r));
+    }
     void set(int p, uint32_t r, uint32_t c, ColorVal x) {
       if (depth <= 8) {
         switch(p) {
@@ -214,23 +267,28 @@ public:
         return width;
     }
 
-    // access pixel by zoomlevel coordinate
+    // the image is stored downscaled 1:scale(), see init(); rows()/cols() are the stored size, rows(0)/cols(0) the full size
+    uint32_t scale() const {
+        return 1<<scale_shift;
+    }
+
+    // access pixel by zoomlevel coordinate (zoomlevels of the full size image, only the ones from 2*scale_shift up are stored)
     uint32_t zoom_rowpixelsize(int zoomlevel) const {
-        return 1<<((zoomlevel+1)/2);
+        return 1<<((zoomlevel+1)/2-scale_shift);
     }
     uint32_t zoom_colpixelsize(int zoomlevel) const {
-        return 1<<((zoomlevel)/2);
+        return 1<<((zoomlevel)/2-scale_shift);
     }
 
     uint32_t rows(int zoomlevel) const {
-        return 1+(rows()-1)/zoom_rowpixelsize(zoomlevel);
+        return 1+(full_height-1)/(1<<((zoomlevel+1)/2));
     }
     uint32_t cols(int zoomlevel) const {
-        return 1+(cols()-1)/zoom_colpixelsize(zoomlevel);
+        return 1+(full_width-1)/(1<<((zoomlevel)/2));
     }
     int zooms() const {
         int z = 0;
-        while (zoom_rowpixelsize(z) < rows() || zoom_colpixelsize(z) < cols()) z++;
+        while ((1u<<((z+1)/2)) < full_height || (1u<<(z/2)) < full_width) z++;
         return z;
     }
     ColorVal operator()(int p, int z, uint32_t rz, uint32_t cz) const {
@@ -254,6 +312,32 @@ public:
         set(p,r,c,x);
     }
 
+    // row r of the full size image has its pixels from column b up to e (not included) set, see TransformFrameShape
+    void set_col_range(const uint32_t r, const uint32_t b, const uint32_t e) {
+        if (r & (scale()-1)) return;
+        col_begin[r>>scale_shift] = b>>scale_shift;
+        col_end[r>>scale_shift] = (e > 0 ? 1+((e-1)>>scale_shift) : 0);
+    }
+
+    // a new image with the pixels of an even zoomlevel z, i.e. this image downscaled 1:2^(z/2);
+    // zoomlevel x of the copy is zoomlevel z+x of this image
+    Image zoom_copy(int z) const {
+        assert(z % 2 == 0);
+        Image copy(cols(z), rows(z), minval, maxval, num);
+        copy.palette = palette;
+        copy.seen_before = seen_before;
+        for (uint32_t r = 0; r < copy.rows(); r++) {
+            const uint32_t b = col_begin[r*zoom_rowpixelsize(z)], e = col_end[r*zoom_rowpixelsize(z)];
+            copy.col_begin[r] = b/zoom_colpixelsize(z);
+            copy.col_end[r] = (e > 0 ? 1+(e-1)/zoom_colpixelsize(z) : 0);
+        }
+        for (int p = 0; p < num; p++)
+          for (uint32_t r = 0; r < copy.rows(); r++)
+            for (uint32_t c = 0; c < copy.cols(); c++)
+              copy.set(p,r,c, operator()(p,z,r,c));
+        return copy;
+    }
+
     uint32_t checksum() {
           uint_fast32_t crc=0;
           crc32k_transform(crc,width & 255);
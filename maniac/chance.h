@@ -121,6 +121,12 @@ public:
     }
 };
 
+// the transition tables only depend on their type: build each one once (on first use) and share it
+template <typename Table> const Table &shared_table() {
+    static const Table table;
+    return table;
+}
+
 template<int N, typename BitChance> class MultiscaleBitChance
 {
 protected:
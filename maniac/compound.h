@@ -32,7 +32,7 @@ public:
     uint32_t childID;
     uint32_t leafID;
     int64_t count;
-    PropertyDecisionNode(int p=-1, int s=0, int c=0) : property(p), splitval(s), childID(c), leafID(0) {}
+    PropertyDecisionNode(int p=-1, int s=0, int c=0) : property(p), splitval(s), childID(c), leafID(0), count(0) {}
 };
 
 class Tree : public std::vector<PropertyDecisionNode>
@@ -243,11 +243,11 @@ template <typename BitChance, typename RAC, int bits> class FinalCompoundSymbolC
 private:
     typedef typename FinalCompoundSymbolBitCoder<BitChance, RAC, bits>::Table Table;
     RAC &rac;
-    const Table table;
+    const Table &table;
 
 public:
 
-    FinalCompoundSymbolCoder(RAC& racIn) : rac(racIn) {}
+    FinalCompoundSymbolCoder(RAC& racIn) : rac(racIn), table(shared_table<Table>()) {}
 
     int read_int(FinalCompoundSymbolChances<BitChance, bits> &chancesIn, int min, int max) {
         FinalCompoundSymbolBitCoder<BitChance, RAC, bits> bitCoder(table, rac, chancesIn);
@@ -288,11 +288,11 @@ template <typename BitChance, typename RAC, int bits> class CompoundSymbolCoder
 private:
     typedef typename CompoundSymbolBitCoder<BitChance, RAC, bits>::Table Table;
     RAC &rac;
-    const Table table;
+    const Table &table;
 
 public:
 
-    CompoundSymbolCoder(RAC& racIn) : rac(racIn) {}
+    CompoundSymbolCoder(RAC& racIn) : rac(racIn), table(shared_table<Table>()) {}
 
     int read_int(CompoundSymbolChances<BitChance, bits> &chancesIn, std::vector<bool> &selectIn, int min, int max) {
         if (min == max) { return min; }
@@ -318,6 +318,17 @@ public:
 
 
 
+// Flattened tree node used by FinalPropertySymbolCoder (8 bytes, nodes are laid out breadth-first)
+class FinalPropertyDecisionNode
+{
+public:
+    PropertyVal splitval;
+    uint32_t info;           // childID << 8 | property; property is FINAL_NODE_LEAF or FINAL_NODE_PENDING if the node acts as a leaf
+};
+
+#define FINAL_NODE_PENDING 0xFE   // split node that has not been activated yet (count > 0)
+#define FINAL_NODE_LEAF 0xFF
+
 template <typename BitChance, typename RAC, int bits> class FinalPropertySymbolCoder
 {
 private:
@@ -325,50 +336,75 @@ private:
     Ranges range;
     unsigned int nb_properties;
     std::vector<FinalCompoundSymbolChances<BitChance,bits> > leaf_node;
-    Tree &inner_node;
-
-    FinalCompoundSymbolChances<BitChance,bits> inline &find_leaf(Properties &properties) {
-        Tree::size_type pos = 0;
-        while(inner_node[pos].property != -1) {
-            if (inner_node[pos].count < 0) {
-                if (properties[inner_node[pos].property] > inner_node[pos].splitval) {
-                  pos = inner_node[pos].childID;
-                } else {
-                  pos = inner_node[pos].childID+1;
-                }
-            } else if (inner_node[pos].count > 0) {
-                assert(inner_node[pos].leafID >= 0);
-                assert((unsigned int)inner_node[pos].leafID < leaf_node.size());
-                inner_node[pos].count--;
-                break;
-            } else if (inner_node[pos].count == 0) {
-                inner_node[pos].count--;
-                FinalCompoundSymbolChances<BitChance,bits> &result = leaf_node[inner_node[pos].leafID];
-                uint32_t old_leaf = inner_node[pos].leafID;
-                uint32_t new_leaf = leaf_node.size();
-                FinalCompoundSymbolChances<BitChance,bits> resultCopy = result;
-                leaf_node.push_back(resultCopy);
-                inner_node[inner_node[pos].childID].leafID = old_leaf;
-                inner_node[inner_node[pos].childID+1].leafID = new_leaf;
-                if (properties[inner_node[pos].property] > inner_node[pos].splitval) {
-                  return leaf_node[old_leaf];
-                } else {
-                  return leaf_node[new_leaf];
-                }
+    // hot: walked for every symbol
+    std::vector<FinalPropertyDecisionNode> inner_node;
+    // cold: only needed at pending nodes
+    std::vector<int8_t> node_property;
+    std::vector<int64_t> node_count;
+    std::vector<uint32_t> node_leafID;
+
+    void build_tree(const Tree &tree) {
+        // breadth-first copy of the reachable part of the tree (simplify() leaves unreachable nodes behind)
+        std::vector<uint32_t> queue(1, 0);
+        for (uint32_t i = 0; i < queue.size(); i++) {
+            const PropertyDecisionNode &n = tree[queue[i]];
+            FinalPropertyDecisionNode fn;
+            fn.splitval = n.splitval;
+            if (n.property == -1 || n.childID <= queue[i] || n.childID+1 >= tree.size()) {
+                fn.info = FINAL_NODE_LEAF;
+            } else {
+                uint32_t child = queue.size();
+                queue.push_back(n.childID);
+                queue.push_back(n.childID+1);
+                fn.info = (child << 8) | (n.count < 0 ? n.property : FINAL_NODE_PENDING);
             }
+            inner_node.push_back(fn);
+            node_property.push_back(n.property);
+            node_count.push_back(n.count);
+            node_leafID.push_back(0);
+        }
+    }
+
+    // delayed split: a node first acts as a leaf for <count> symbols, then its children start from copies of its chances
+    FinalCompoundSymbolChances<BitChance,bits> &pending_leaf(const uint32_t pos, const Properties &properties) {
+        if (node_count[pos] > 0) {
+            node_count[pos]--;
+            return leaf_node[node_leafID[pos]];
+        }
+        node_count[pos]--;
+        uint32_t old_leaf = node_leafID[pos];
+        uint32_t new_leaf = leaf_node.size();
+        FinalCompoundSymbolChances<BitChance,bits> resultCopy = leaf_node[old_leaf];
+        leaf_node.push_back(resultCopy);
+        uint32_t child = inner_node[pos].info >> 8;
+        inner_node[pos].info = (child << 8) | node_property[pos];
+        node_leafID[child] = old_leaf;
+        node_leafID[child+1] = new_leaf;
+        if (properties[node_property[pos]] > inner_node[pos].splitval) {
+            return leaf_node[old_leaf];
+        } else {
+            return leaf_node[new_leaf];
+        }
+    }
+
+    FinalCompoundSymbolChances<BitChance,bits> inline &find_leaf(const Properties &properties) {
+        uint32_t pos = 0;
+        uint32_t info;
+        while (((info = inner_node[pos].info) & 0xFF) < FINAL_NODE_PENDING) {
+            pos = (info >> 8) + (properties[info & 0xFF] > inner_node[pos].splitval ? 0 : 1);
         }
-        return leaf_node[inner_node[pos].leafID];
+        if ((info & 0xFF) == FINAL_NODE_PENDING) return pending_leaf(pos, properties);
+        return leaf_node[node_leafID[pos]];
     }
 
 public:
-    FinalPropertySymbolCoder(RAC& racIn, Ranges &rangeIn, Tree &treeIn) :
+    FinalPropertySymbolCoder(RAC& racIn, Ranges &rangeIn, const Tree &treeIn) :
         coder(racIn),
         range(rangeIn),
         nb_properties(range.size()),
-        leaf_node(1,FinalCompoundSymbolChances<BitChance,bits>()),
-        inner_node(treeIn) 
+        leaf_node(1,FinalCompoundSymbolChances<BitChance,bits>())
     {
-        inner_node[0].leafID = 0;
+        build_tree(treeIn);
     }
 
     int read_int(Properties &properties, int min, int max) {
@@ -426,16 +462,30 @@ private:
     uint64_t symbols;
 #endif
 
+    // range of property p in the context of the leaf at pos (only needed when considering a split)
+    void leaf_range(const Properties &properties, const uint32_t leaf, const int p, PropertyVal &minv, PropertyVal &maxv) const {
+        minv = range[p].first;
+        maxv = range[p].second;
+        uint32_t pos = 0;
+        while(pos != leaf) {
+            const PropertyDecisionNode &n = inner_node[pos];
+            if (properties[n.property] > n.splitval) {
+                if (n.property == p) minv = n.splitval + 1;
+                pos = n.childID;
+            } else {
+                if (n.property == p) maxv = n.splitval;
+                pos = n.childID+1;
+            }
+        }
+    }
+
     CompoundSymbolChances<BitChance,bits> inline &find_leaf(const Properties &properties) {
         uint32_t pos = 0;
-        Ranges current_ranges = range;
         while(inner_node[pos].property != -1) {
 //        fprintf(stderr,"Checking property %i (val=%i, splitval=%i)\n",inner_node[pos].property,properties[inner_node[pos].property],inner_node[pos].splitval);
             if (properties[inner_node[pos].property] > inner_node[pos].splitval) {
-                current_ranges[inner_node[pos].property].first = inner_node[pos].splitval + 1;
                 pos = inner_node[pos].childID;
             } else {
-                current_ranges[inner_node[pos].property].second = inner_node[pos].splitval;
                 pos = inner_node[pos].childID+1;
             }
         }
@@ -444,13 +494,16 @@ private:
 
         // split leaf node if some virtual context is performing (significantly) better
         if(result.best_property != -1
-           && result.realSize > result.virtSize[result.best_property] + CONTEXT_TREE_SPLIT_THRESHOLD
-           && current_ranges[result.best_property].first < current_ranges[result.best_property].second) {
+           && result.realSize > result.virtSize[result.best_property] + CONTEXT_TREE_SPLIT_THRESHOLD) {
 
           int8_t p = result.best_property;
+          PropertyVal pmin, pmax;
+          leaf_range(properties, pos, p, pmin, pmax);
+          if (pmin >= pmax) return result;
+
           PropertyVal splitval = result.virtPropSum[p]/result.count;
-          if (splitval >= current_ranges[result.best_property].second)
-            splitval = current_ranges[result.best_property].second-1; // == does happen because of rounding and running average
+          if (splitval >= pmax)
+            splitval = pmax-1; // == does happen because of rounding and running average
 
           uint32_t new_inner = inner_node.size();
           inner_node.push_back(inner_node[pos]);
@@ -496,6 +549,8 @@ private:
     }
 
 public:
+    // The leaf is looked up once per symbol: updating the property sums does not change best_property,
+    // so a second lookup would take the same path and not split (a freshly split leaf has best_property -1).
     PropertySymbolCoder(RAC& racIn, Ranges &rangeIn, Tree &treeIn) :
         rac(racIn),
         coder(racIn),
@@ -515,8 +570,7 @@ public:
 #endif
         CompoundSymbolChances<BitChance,bits> &chances = find_leaf(properties);
         set_selection_and_update_property_sums(properties,chances);
-        CompoundSymbolChances<BitChance,bits> &chances2 = find_leaf(properties);
-        return coder.read_int(chances2, selection, min, max);
+        return coder.read_int(chances, selection, min, max);
     }
 
     void write_int(Properties &properties, int min, int max, int val) {
@@ -525,8 +579,7 @@ public:
 #endif
         CompoundSymbolChances<BitChance,bits> &chances = find_leaf(properties);
         set_selection_and_update_property_sums(properties,chances);
-        CompoundSymbolChances<BitChance,bits> &chances2 = find_leaf(properties);
-        coder.write_int(chances2, selection, min, max, val);
+        coder.write_int(chances, selection, min, max, val);
     }
     int read_int(Properties &properties, int nbits) {
 #ifdef STATS
@@ -534,8 +587,7 @@ public:
 #endif
         CompoundSymbolChances<BitChance,bits> &chances = find_leaf(properties);
         set_selection_and_update_property_sums(properties,chances);
-        CompoundSymbolChances<BitChance,bits> &chances2 = find_leaf(properties);
-        return coder.read_int(chances2, selection, nbits);
+        return coder.read_int(chances, selection, nbits);
     }
 
     void write_int(Properties &properties, int nbits, int val) {
@@ -544,8 +596,7 @@ public:
 #endif
         CompoundSymbolChances<BitChance,bits> &chances = find_leaf(properties);
         set_selection_and_update_property_sums(properties,chances);
-        CompoundSymbolChances<BitChance,bits> &chances2 = find_leaf(properties);
-        coder.write_int(chances2, selection, nbits, val);
+        coder.write_int(chances, selection, nbits, val);
     }
 
 #ifdef STATS
@@ -646,6 +697,7 @@ public:
             int oldmax = subrange[p].second;
             if (oldmin >= oldmax) {
               fprintf(stderr, "Invalid tree. Aborting tree decoding.\n");
+              n.property = -1;
               return -1;
             }
             n.count = coder.read_int(CONTEXT_TREE_MIN_COUNT, CONTEXT_TREE_MAX_COUNT); // * CONTEXT_TREE_COUNT_QUANTIZATION;
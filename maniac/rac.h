@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <assert.h>
+#include <vector>
 
 
 /* RAC configuration for 40-bit RAC */
@@ -33,7 +34,7 @@ template <typename Config, typename IO> class RacInput
 public:
     typedef typename Config::data_t rac_t;
 protected:
-    IO io;
+    IO& io;
 private:
     rac_t range;
     rac_t low;
@@ -60,7 +61,7 @@ private:
         }
     }
 public:
-    RacInput(IO ioin) : io(ioin), range(Config::BASE_RANGE), low(0) {
+    RacInput(IO& ioin) : io(ioin), range(Config::BASE_RANGE), low(0) {
         rac_t r = Config::BASE_RANGE;
         while (r > 1) {
             low <<= 8;
@@ -88,11 +89,17 @@ public:
 
 template <class Config, class IO> class RacOutput
 {
+    template <class C, class I> friend class RacOutput;
 public:
     typedef typename Config::data_t rac_t;
 protected:
-    IO io;
+    IO& io;
 private:
+    struct ByteSink {
+        std::vector<uint8_t> bytes;
+        void write(int byte) { bytes.push_back(byte); }
+        void flush() {}
+    };
     rac_t range;
     rac_t low;
     int delayed_byte;
@@ -135,7 +142,7 @@ private:
         output();
     }
 public:
-    RacOutput(IO ioin) : io(ioin), range(Config::BASE_RANGE), low(0), delayed_byte(-1), delayed_count(0) { }
+    RacOutput(IO& ioin) : io(ioin), range(Config::BASE_RANGE), low(0), delayed_byte(-1), delayed_count(0) { }
 
     void inline write(int num, int denom, bool bit) {
         assert(num>=0);
@@ -163,6 +170,25 @@ public:
         output();
         io.flush();
     }
+
+    // The bytes that end the stream here, without changing the state: what flush() would write, plus what a
+    // RacInput reads ahead. The bytes written so far followed by these decode everything that was coded up
+    // to here, and the decoder has read exactly all of them after the last symbol.
+    std::vector<uint8_t> termination() const {
+        ByteSink sink;
+        RacOutput<Config, ByteSink> copy(sink);
+        copy.range = range;
+        copy.low = low;
+        copy.delayed_byte = delayed_byte;
+        copy.delayed_count = delayed_count;
+        copy.flush();
+        // flush() keeps the last byte (and a run of 0xFF bytes) pending, and the decoder reads
+        // MAX_RANGE_BITS/8 bytes at the start while flush() generates 3
+        if (copy.delayed_byte >= 0) sink.write(copy.delayed_byte);
+        for (int i = 0; i < copy.delayed_count; i++) sink.write(0xFF);
+        for (int i = 3; i < Config::MAX_RANGE_BITS/8; i++) sink.write(0);
+        return sink.bytes;
+    }
 };
 
 
@@ -181,49 +207,32 @@ public:
 
     void inline write(bool bit) { }
     void inline flush() { }
+    std::vector<uint8_t> termination() const { return std::vector<uint8_t>(); }
 };
 
 
-class RacFileIO
-{
-private:
-    FILE *file;
-public:
-    RacFileIO(FILE* fil) : file(fil) { }
-    int read() {
-        int r = fgetc(file);
-        if (r < 0) return 0;
-        return r;
-    }
-    void write(int byte) {
-        fputc(byte, file);
-    }
-    void flush() {
-    }
-};
-
-class RacInput40 : public RacInput<RacConfig40, RacFileIO>
+template <typename IO> class RacInput40 : public RacInput<RacConfig40, IO>
 {
 public:
-    RacInput40(FILE *file) : RacInput<RacConfig40, RacFileIO>(RacFileIO(file)) { }
+    RacInput40(IO& io) : RacInput<RacConfig40, IO>(io) { }
 };
 
-class RacOutput40 : public RacOutput<RacConfig40, RacFileIO>
+template <typename IO> class RacOutput40 : public RacOutput<RacConfig40, IO>
 {
 public:
-    RacOutput40(FILE *file) : RacOutput<RacConfig40, RacFileIO>(RacFileIO(file)) { }
+    RacOutput40(IO& io) : RacOutput<RacConfig40, IO>(io) { }
 };
 
-class RacInput24 : public RacInput<RacConfig24, RacFileIO>
+template <typename IO> class RacInput24 : public RacInput<RacConfig24, IO>
 {
 public:
-    RacInput24(FILE *file) : RacInput<RacConfig24, RacFileIO>(RacFileIO(file)) { }
+    RacInput24(IO& io) : RacInput<RacConfig24, IO>(io) { }
 };
 
-class RacOutput24 : public RacOutput<RacConfig24, RacFileIO>
+template <typename IO> class RacOutput24 : public RacOutput<RacConfig24, IO>
 {
 public:
-    RacOutput24(FILE *file) : RacOutput<RacConfig24, RacFileIO>(RacFileIO(file)) { }
+    RacOutput24(IO& io) : RacOutput<RacConfig24, IO>(io) { }
 };
 
 #endif
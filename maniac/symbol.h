@@ -298,12 +298,12 @@ template <typename BitChance, typename RAC> class SimpleBitCoder
     typedef typename BitChance::Table Table;
 
 private:
-    const Table table;
+    const Table &table;
     BitChance ctx;
     RAC &rac;
 
 public:
-    SimpleBitCoder(RAC &racIn) : rac(racIn) {}
+    SimpleBitCoder(RAC &racIn) : table(shared_table<Table>()), rac(racIn) {}
 
     void set(uint16_t chance) {
         ctx.set(chance);
@@ -355,14 +355,14 @@ template <typename BitChance, typename RAC, int bits> class SimpleSymbolCoder
 
 private:
     SymbolChance<BitChance,bits> ctx;
-    const Table table;
+    const Table &table;
     RAC &rac;
 #ifdef STATS
     uint64_t symbols;
 #endif
 
 public:
-    SimpleSymbolCoder(RAC& racIn) : rac(racIn) {
+    SimpleSymbolCoder(RAC& racIn) : table(shared_table<Table>()), rac(racIn) {
 #ifdef STATS
         symbols = 0;
 #endif
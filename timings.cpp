@@ -0,0 +1,91 @@
+#include <string.h>
+#include <time.h>
+#include <chrono>
+
+#include "timings.h"
+
+static double wall_seconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double cpu_seconds() {
+    return (double) clock() / CLOCKS_PER_SEC;
+}
+
+size_t FLIFTimings::begin(const std::string &name, uint64_t pixels) {
+    double now = wall_seconds();
+    if (origin < 0) origin = now;
+    Stage s;
+    s.name = name;
+    s.depth = open++;
+    s.start = now - origin;
+    s.wall = 0;
+    s.cpu = 0;
+    s.pixels = pixels;
+    stages.push_back(s);
+    cpu_start.push_back(cpu_seconds());
+    return stages.size() - 1;
+}
+
+void FLIFTimings::end(size_t stage) {
+    Stage &s = stages[stage];
+    s.wall = wall_seconds() - origin - s.start;
+    s.cpu = cpu_seconds() - cpu_start[stage];
+    open--;
+}
+
+static std::string json_string(const std::string &s) {
+    std::string r = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') r += '\\';
+        if ((unsigned char)c < 0x20) r += ' ';
+        else r += c;
+    }
+    return r + "\"";
+}
+
+static double mpixels_per_second(const FLIFTimings::Stage &s) {
+    if (!s.pixels || s.wall <= 0) return 0;
+    return s.pixels / s.wall / 1e6;
+}
+
+void FLIFTimings::report(FILE *out, FLIFTimingsFormat format) const {
+    switch(format) {
+      case TIMINGS_HUMAN:
+        fprintf(out, "%-44s %10s %10s %10s\n", "Stage", "wall ms", "cpu ms", "MPixel/s");
+        for (const Stage &s : stages) {
+            std::string name = std::string(2*s.depth, ' ') + s.name;
+            fprintf(out, "%-44s %10.3f %10.3f", name.c_str(), 1000*s.wall, 1000*s.cpu);
+            if (s.pixels) fprintf(out, " %10.2f", mpixels_per_second(s));
+            fprintf(out, "\n");
+        }
+        break;
+      case TIMINGS_JSON:
+        fprintf(out, "{\"stages\": [");
+        for (size_t i = 0; i < stages.size(); i++) {
+            const Stage &s = stages[i];
+            fprintf(out, "%s\n  {\"name\": %s, \"depth\": %i, \"start_ms\": %.3f, \"wall_ms\": %.3f, \"cpu_ms\": %.3f, \"pixels\": %llu, \"mpixels_per_s\": %.3f}",
+                    (i ? "," : ""), json_string(s.name).c_str(), s.depth, 1000*s.start, 1000*s.wall, 1000*s.cpu, (unsigned long long) s.pixels, mpixels_per_second(s));
+        }
+        fprintf(out, "\n]}\n");
+        break;
+      case TIMINGS_TRACE:
+        // Chrome trace event format (complete events), viewable in chrome://tracing
+        fprintf(out, "{\"traceEvents\": [");
+        for (size_t i = 0; i < stages.size(); i++) {
+            const Stage &s = stages[i];
+            fprintf(out, "%s\n  {\"name\": %s, \"cat\": \"flif\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, \"ts\": %.1f, \"dur\": %.1f, \"args\": {\"cpu_ms\": %.3f, \"pixels\": %llu}}",
+                    (i ? "," : ""), json_string(s.name).c_str(), 1e6*s.start, 1e6*s.wall, 1000*s.cpu, (unsigned long long) s.pixels);
+        }
+        fprintf(out, "\n], \"displayTimeUnit\": \"ms\"}\n");
+        break;
+    }
+}
+
+bool parse_timings_format(const char *s, FLIFTimingsFormat &format) {
+    if (!s || !strcmp(s, "human")) format = TIMINGS_HUMAN;
+    else if (!strcmp(s, "json")) format = TIMINGS_JSON;
+    else if (!strcmp(s, "trace")) format = TIMINGS_TRACE;
+    else return false;
+    return true;
+}
@@ -0,0 +1,58 @@
+#ifndef __FLIF_TIMINGS_H__
+#define __FLIF_TIMINGS_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+enum FLIFTimingsFormat { TIMINGS_HUMAN, TIMINGS_JSON, TIMINGS_TRACE };
+
+// wall time, CPU time and throughput of the stages of an encode or decode
+// (opt-in: pass a FLIFTimings to encode()/decode() or set it in the options structs)
+struct FLIFTimings {
+    struct Stage {
+        std::string name;
+        int depth;          // nesting level (a stage is part of the enclosing stage with a lower depth)
+        double start;       // seconds since the first stage started
+        double wall;        // seconds
+        double cpu;         // seconds, for all threads of the process
+        uint64_t pixels;    // pixels processed by the stage (0 if that does not apply)
+    };
+    std::vector<Stage> stages;
+
+    FLIFTimings() : origin(-1), open(0) {}
+
+    // returns the index of the new stage
+    size_t begin(const std::string &name, uint64_t pixels);
+    void end(size_t stage);
+
+    void report(FILE *out, FLIFTimingsFormat format) const;
+
+private:
+    double origin;
+    int open;
+    std::vector<double> cpu_start;
+};
+
+// measures one stage, from construction until done() or destruction; does nothing if timings is NULL
+class StageTimer {
+    FLIFTimings *timings;
+    size_t stage;
+public:
+    StageTimer(FLIFTimings *t, const std::string &name, uint64_t pixels = 0) : timings(t), stage(0) {
+        if (timings) stage = timings->begin(name, pixels);
+    }
+    void set_pixels(uint64_t pixels) {
+        if (timings) timings->stages[stage].pixels = pixels;
+    }
+    void done() {
+        if (timings) timings->end(stage);
+        timings = NULL;
+    }
+    ~StageTimer() { done(); }
+};
+
+bool parse_timings_format(const char *s, FLIFTimingsFormat &format);
+
+#endif
@@ -0,0 +1,226 @@
+#ifndef _ANALYSIS_H_
+#define _ANALYSIS_H_ 1
+
+#include <stdint.h>
+#include <tuple>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#include "../image/image.h"
+#include "palette_hash.h"
+
+// at most this many distinct colors are collected (at most one per two pixels, but enough to decide on a palette)
+#define ANALYSIS_MAX_COLORS 0x100000
+#define ANALYSIS_MIN_COLORS 30001
+
+// content hashes of a frame (planes 0..np-1): one per row, and one of the whole frame
+struct FrameHash {
+    std::vector<uint64_t> rows;
+    uint64_t frame;
+
+    static uint64_t mix(uint64_t h, uint64_t v) {
+        return (h ^ v) * 0x9E3779B97F4A7C15ULL;
+    }
+    template <typename pixel_t> static uint64_t hash_row(uint64_t h, const pixel_t *row, uint32_t cols) {
+        for (uint32_t c = 0; c < cols; c++) h = mix(h, (uint32_t)row[c]);
+        return h;
+    }
+    static uint64_t row_hash(const Image &image, const int np, const uint32_t r) {
+        uint64_t h = r;
+        for (int p = 0; p < np; p++) {
+            if (image.wide_plane(p)) h = hash_row(h, (const int32_t*) image.row_pointer(p,r), image.cols());
+            else h = hash_row(h, (const int16_t*) image.row_pointer(p,r), image.cols());
+        }
+        return h ^ (h >> 32);
+    }
+    void combine_rows() {
+        frame = 0;
+        for (uint64_t h : rows) frame = mix(frame, h);
+    }
+};
+
+// Statistics of the images that the transforms use to decide whether they apply (see Transform::process),
+// gathered in one pass over the pixels (split over at most threads threads), the first time they are needed
+// after the pixels have changed.
+class ImageAnalysis {
+public:
+    typedef std::tuple<ColorVal,ColorVal,ColorVal,ColorVal> Color;
+
+    int nump;
+    std::vector<ColorVal> min, max;         // per plane
+    PaletteHash<Color> colors;              // distinct (Y,I,Q,A) (A=0 without alpha plane), if nump >= 3 ...
+    bool colors_complete;                   // ... and there were not too many of them
+    std::vector<FrameHash> frame_hashes;    // for animations: see TransformFrameDup
+    std::vector<std::vector<std::pair<uint32_t,uint32_t> > > frame_shapes;  // for animations: changed columns of each row, see TransformFrameShape
+
+private:
+    bool valid;
+
+    struct RowReader {
+        const void *rows[4];
+        bool wide[4];
+        RowReader(const Image &image, const int np, const uint32_t r) {
+            for (int p = 0; p < np; p++) { rows[p] = image.row_pointer(p,r); wide[p] = image.wide_plane(p); }
+        }
+        ColorVal operator()(const int p, const uint32_t c) const {
+            return wide[p] ? ((const int32_t*)rows[p])[c] : ((const int16_t*)rows[p])[c];
+        }
+    };
+
+    struct Partial {
+        std::vector<ColorVal> min, max;
+        PaletteHash<Color> colors;
+        bool colors_complete;
+        size_t colors_stop;     // the first block whose colors are not all in colors
+    };
+
+    // adds the colors of row r to set; false once set has more than max_colors colors, or, if total is not NULL,
+    // once the colors of all the threads together (a color counts once per thread) are more than max_colors
+    bool add_colors(PaletteHash<Color> &set, const RowReader &row, const uint32_t cols, const size_t max_colors, std::atomic<size_t> *total) const {
+        if (total && *total > max_colors) return false;
+        Color prev(-1,-1,-1,-1);
+        for (uint32_t c = 0; c < cols; c++) {
+            Color C(row(0,c), row(1,c), row(2,c), (nump > 3 ? row(3,c) : 0));
+            if (C == prev && set.size()) continue;
+            prev = C;
+            if (!set.insert(C, 0)) continue;
+            if (total ? ++*total > max_colors : set.size() > max_colors) return false;
+        }
+        return true;
+    }
+
+    // changed columns of row r compared to the previous frame, like TransformFrameShape did it
+    static std::pair<uint32_t,uint32_t> row_shape(const RowReader &cur, const RowReader &prev, const int np, const uint32_t cols) {
+        uint32_t b = cols, e = 0;
+        for (uint32_t c = 0; c < cols; c++) {
+            if (np>3 && cur(3,c) == 0 && prev(3,c) == 0) continue;
+            bool diff = false;
+            for (int p = 0; p < np; p++) if (cur(p,c) != prev(p,c)) { diff = true; break; }
+            if (diff) { b = c; break; }
+        }
+        if (b == cols) return std::make_pair(cols, cols);
+        for (uint32_t c = cols-1; c >= b; c--) {
+            if (np>3 && cur(3,c) == 0 && prev(3,c) == 0) continue;
+            bool diff = false;
+            for (int p = 0; p < np; p++) if (cur(p,c) != prev(p,c)) { diff = true; break; }
+            if (diff) { e = c+1; break; }
+        }
+        return std::make_pair(b, e);
+    }
+
+    void analyse_row(Partial &part, const Images &images, const int fr, const uint32_t r, const size_t max_colors, std::atomic<size_t> &total_colors) {
+        const Image &image = images[fr];
+        const uint32_t cols = image.cols();
+        RowReader row(image, nump, r);
+        for (int p = 0; p < nump; p++) {
+            ColorVal &mi = part.min[p], &ma = part.max[p];
+            for (uint32_t c = 0; c < cols; c++) {
+                ColorVal v = row(p,c);
+                if (v < mi) mi = v;
+                if (v > ma) ma = v;
+            }
+        }
+        if (nump >= 3 && part.colors_complete) part.colors_complete = add_colors(part.colors, row, cols, max_colors, &total_colors);
+        if (images.size() > 1) {
+            frame_hashes[fr].rows[r] = FrameHash::row_hash(image, nump, r);
+            if (fr > 0) frame_shapes[fr][r] = row_shape(row, RowReader(images[fr-1], nump, r), nump, cols);
+        }
+    }
+
+public:
+    unsigned int threads;   // the most threads update() may use
+
+    ImageAnalysis(const unsigned int max_threads) : nump(0), colors_complete(false), valid(false), threads(max_threads) {}
+
+    void invalidate() { valid = false; }
+
+    void update(const Images &images) {
+        if (valid) return;
+        valid = true;
+        nump = images[0].numPlanes();
+        uint64_t pixels = 0;
+        for (const Image& image : images) pixels += (uint64_t)image.rows() * image.cols();
+        const size_t max_colors = std::max<uint64_t>(ANALYSIS_MIN_COLORS, std::min<uint64_t>(ANALYSIS_MAX_COLORS, pixels/2));
+
+        frame_hashes.clear();
+        frame_shapes.clear();
+        if (images.size() > 1) {
+            frame_hashes.resize(images.size());
+            frame_shapes.resize(images.size());
+            for (size_t fr = 0; fr < images.size(); fr++) {
+                frame_hashes[fr].rows.resize(images[fr].rows());
+                if (fr > 0) frame_shapes[fr].resize(images[fr].rows());
+            }
+        }
+
+        // blocks of rows, handed out round-robin to the threads
+        std::vector<std::pair<int,uint32_t> > blocks;
+        const uint32_t block_rows = 16;
+        for (size_t fr = 0; fr < images.size(); fr++)
+            for (uint32_t r = 0; r < images[fr].rows(); r += block_rows) blocks.push_back(std::make_pair((int)fr, r));
+        unsigned int nb_threads = std::max(1u, threads);
+        if (pixels < 0x10000) nb_threads = 1;
+        nb_threads = std::max<size_t>(1, std::min<size_t>(nb_threads, blocks.size()));
+
+        std::vector<Partial> parts(nb_threads);
+        for (Partial &part : parts) {
+            part.min.assign(nump, 0x7FFFFFFF);
+            part.max.assign(nump, -0x7FFFFFFF);
+            part.colors_complete = true;
+            part.colors_stop = blocks.size();
+        }
+        // the threads stop collecting colors as soon as they have more than max_colors together,
+        // so they do not hold up to max_colors each
+        std::atomic<size_t> total_colors(0);
+        auto work = [&](unsigned int t) {
+            for (size_t i = t; i < blocks.size(); i += nb_threads) {
+                const int fr = blocks[i].first;
+                const uint32_t end = std::min(images[fr].rows(), blocks[i].second + block_rows);
+                const bool collecting = parts[t].colors_complete;
+                for (uint32_t r = blocks[i].second; r < end; r++) analyse_row(parts[t], images, fr, r, max_colors, total_colors);
+                if (collecting && !parts[t].colors_complete) parts[t].colors_stop = i;
+            }
+        };
+        if (nb_threads == 1) work(0);
+        else {
+            std::vector<std::thread> workers;
+            for (unsigned int t = 0; t < nb_threads; t++) workers.push_back(std::thread(work, t));
+            for (std::thread &w : workers) w.join();
+        }
+
+        min = parts[0].min;
+        max = parts[0].max;
+        colors.clear();
+        colors_complete = (nump >= 3);
+        std::vector<Color> part_colors;
+        for (Partial &part : parts) {
+            for (int p = 0; p < nump; p++) {
+                if (part.min[p] < min[p]) min[p] = part.min[p];
+                if (part.max[p] > max[p]) max[p] = part.max[p];
+            }
+            if (!colors_complete) continue;
+            part_colors.clear();
+            part.colors.colors(part_colors);
+            part.colors = PaletteHash<Color>();
+            for (const Color &C : part_colors) {
+                if (colors.insert(C, 0) && colors.size() > max_colors) { colors_complete = false; break; }
+            }
+        }
+        // the threads may have stopped with fewer than max_colors colors together (a color counts once per thread):
+        // the blocks they did not collect are added here, so the outcome does not depend on the number of threads
+        for (unsigned int t = 0; t < nb_threads && colors_complete; t++) {
+            for (size_t i = parts[t].colors_stop; i < blocks.size() && colors_complete; i += nb_threads) {
+                const int fr = blocks[i].first;
+                const uint32_t end = std::min(images[fr].rows(), blocks[i].second + block_rows);
+                for (uint32_t r = blocks[i].second; r < end && colors_complete; r++)
+                    colors_complete = add_colors(colors, RowReader(images[fr], nump, r), images[fr].cols(), max_colors, NULL);
+            }
+        }
+        if (!colors_complete) colors.clear();
+        for (FrameHash &h : frame_hashes) h.combine_rows();
+    }
+};
+
+#endif
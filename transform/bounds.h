@@ -27,7 +27,8 @@ public:
 };
 
 
-class TransformBounds : public Transform {
+template <typename IO>
+class TransformBounds : public Transform<IO> {
 protected:
     std::vector<std::pair<ColorVal, ColorVal> > bounds;
 
@@ -39,8 +40,8 @@ protected:
         }
     }
 
-    void load(const ColorRanges *srcRanges, RacIn &rac) {
-        SimpleSymbolCoder<SimpleBitChance, RacIn, 24> coder(rac);
+    void load(const ColorRanges *srcRanges, RacIn<IO> &rac) {
+        SimpleSymbolCoder<SimpleBitChance, RacIn<IO>, 24> coder(rac);
         bounds.clear();
         for (int p=0; p<srcRanges->numPlanes(); p++) {
 //            ColorVal min = coder.read_int(0, srcRanges->max(p) - srcRanges->min(p)) + srcRanges->min(p);
@@ -52,8 +53,10 @@ protected:
         }
     }
 
-    void save(const ColorRanges *srcRanges, RacOut &rac) const {
-        SimpleSymbolCoder<SimpleBitChance, RacOut, 24> coder(rac);
+    bool changes_data() const { return false; }
+
+    void save(const ColorRanges *srcRanges, RacOut<IO> &rac) const {
+        SimpleSymbolCoder<SimpleBitChance, RacOut<IO>, 24> coder(rac);
         for (int p=0; p<srcRanges->numPlanes(); p++) {
             ColorVal min = bounds[p].first;
             ColorVal max = bounds[p].second;
@@ -65,22 +68,15 @@ protected:
         }
     }
 
-    bool process(const ColorRanges *srcRanges, const Images &images) {
+    bool process(const ColorRanges *srcRanges, const Images &images, ImageAnalysis &analysis) {
         bounds.clear();
         bool trivialbounds=true;
+        analysis.update(images);
         for (int p=0; p<srcRanges->numPlanes(); p++) {
-            ColorVal min = srcRanges->max(p);
-            ColorVal max = srcRanges->min(p);
-            for (const Image& image : images)
-            for (uint32_t r=0; r<image.rows(); r++) {
-                for (uint32_t c=0; c<image.cols(); c++) {
-                    ColorVal v = image(p,r,c);
-                    if (v < min) min = v;
-                    if (v > max) max = v;
-                    assert(v <= srcRanges->max(p));
-                    assert(v >= srcRanges->min(p));
-                }
-            }
+            ColorVal min = analysis.min[p];
+            ColorVal max = analysis.max[p];
+            assert(max <= srcRanges->max(p));
+            assert(min >= srcRanges->min(p));
             bounds.push_back(std::make_pair(min,max));
             if (min > srcRanges->min(p)) trivialbounds=false;
             if (max < srcRanges->max(p)) trivialbounds=false;
@@ -22,8 +22,12 @@ const unsigned int max_per_colorbucket[] = {MAX_PER_BUCKET_0, MAX_PER_BUCKET_1,
 #define CB1 4
 
 
-static int totaldiscretecolors=0;
-static int totalcontinuousbuckets=0;
+// number of discrete colors / continuous buckets, used to decide whether color buckets are worth it
+struct ColorBucketStats {
+    int totaldiscretecolors;
+    int totalcontinuousbuckets;
+    ColorBucketStats() : totaldiscretecolors(0), totalcontinuousbuckets(0) {}
+};
 
 class ColorBucket {
 public:
@@ -38,7 +42,7 @@ public:
         max = -1;  // -infinity    (set to empty interval to start with)
         discrete = true;
     }
-    void addColor(const ColorVal c, const unsigned int max_per_bucket) {
+    void addColor(const ColorVal c, const unsigned int max_per_bucket, ColorBucketStats &stats) {
         if (c<min) min=c;
         if (c>max) max=c;
         if (discrete) {
@@ -49,12 +53,12 @@ public:
           }
           if (values.size() < max_per_bucket) {
                 values.insert(values.begin()+pos, c);
-                totaldiscretecolors++;
+                stats.totaldiscretecolors++;
           } else {
-                totaldiscretecolors -= max_per_bucket;
+                stats.totaldiscretecolors -= max_per_bucket;
                 values.clear();
                 discrete=false;
-                totalcontinuousbuckets++;
+                stats.totalcontinuousbuckets++;
           }
         }
     }
@@ -110,25 +114,25 @@ public:
                 }
         }
     }
-    void simplify_lossless() {
+    void simplify_lossless(ColorBucketStats &stats) {
         if (discrete) {
                 if ((int)values.size() == max-min+1) {
                         discrete=false;  // bucket actually contains a continuous range
-                        totaldiscretecolors -= values.size();
-                        totalcontinuousbuckets++;
+                        stats.totaldiscretecolors -= values.size();
+                        stats.totalcontinuousbuckets++;
                         values.clear();
                 }
         }
     }
-    void simplify(int percent) {
+    void simplify(int percent, ColorBucketStats &stats) {
         if (empty()) return;
-        simplify_lossless();
+        simplify_lossless(stats);
         if (discrete) {
                 // heuristic: turn discrete bucket into a continuous one if it is dense enough
                 if ((int)values.size()-2 > (max-min-1)*percent/100) {
                         discrete=false; // more than <percent> of the ]min,max[ values are present
-                        totaldiscretecolors -= values.size();
-                        totalcontinuousbuckets++;
+                        stats.totaldiscretecolors -= values.size();
+                        stats.totalcontinuousbuckets++;
                         values.clear();
                 }
         }
@@ -177,6 +181,7 @@ public:
     std::vector<std::vector<ColorBucket> > bucket2;
     ColorBucket bucket3;
     const ColorRanges *ranges;
+    ColorBucketStats stats;
     ColorBuckets(const ColorRanges *r) : bucket0(), min0(r->min(0)), min1(r->min(1)),
                                          bucket1((r->max(0) - min0)/CB0a +1),
                                          bucket2((r->max(0) - min0)/CB0b +1, std::vector<ColorBucket>((r->max(1) - min1)/CB1 +1)),
@@ -189,7 +194,7 @@ public:
         if (p==2) return bucket2[(pp[0]-min0)/CB0b][(pp[1]-min1)/CB1];
         else return bucket3;
     }
-    ColorBucket findBucket(const int p, const prevPlanes &pp) const {
+    const ColorBucket& findBucket(const int p, const prevPlanes &pp) const {
         assert(p>=0); assert(p<4);
         if (p==0) return bucket0;
         if (p==1) return bucket1[(pp[0]-min0)/CB0a];
@@ -198,7 +203,7 @@ public:
     }
     void addColor(const std::vector<ColorVal> &pixel) {
         for (unsigned int p=0; p < pixel.size(); p++) {
-                findBucket(p, pixel).addColor(pixel[p],max_per_colorbucket[p]);
+                findBucket(p, pixel).addColor(pixel[p],max_per_colorbucket[p],stats);
         }
     }
 
@@ -211,7 +216,7 @@ public:
         ranges->snap(p,pp,rmin,rmax,v);
         if (v != pp[p]) return false;   // bucket empty because of original range constraints
 
-        const ColorBucket b = findBucket(p,pp);
+        const ColorBucket& b = findBucket(p,pp);
         //if (b.min > b.max) return false;
         if (b.snapColor_slow(pp[p]) != pp[p]) return false;
         return true;
@@ -245,14 +250,69 @@ public:
     }
 };
 
+// read-only flat copy of the buckets (once the snap values are prepared), for the per-pixel lookups
+class ColorBucketTable {
+public:
+    typedef FlatColorRanges::Entry Entry;
+private:
+    std::vector<Entry> entries;   // bucket0, bucket1[Y], bucket2[Y][I/CB1], bucket3
+    std::vector<ColorVal> snapvalues;
+    int min0, min1;
+    int n1, n2;
+
+    void add(const ColorBucket &b) {
+        Entry e;
+        e.min = b.min;
+        e.max = b.max;
+        e.snap = FlatColorRanges::SNAP_BUCKET;
+        if (b.discrete && b.min < b.max) {
+            e.snap = snapvalues.size();
+            snapvalues.insert(snapvalues.end(), b.snapvalues.begin(), b.snapvalues.end());
+        }
+        entries.push_back(e);
+    }
+public:
+    ColorBucketTable(const ColorBuckets &cb) : min0(cb.min0), min1(cb.min1), n1(cb.bucket1.size()), n2(cb.bucket2.empty() ? 0 : cb.bucket2[0].size()) {
+        add(cb.bucket0);
+        for (const ColorBucket& b : cb.bucket1) add(b);
+        for (const auto& bv : cb.bucket2) for (const ColorBucket& b : bv) add(b);
+        add(cb.bucket3);
+    }
+    const Entry& find(const int p, const prevPlanes &pp) const {
+        assert(p>=0); assert(p<4);
+        if (p==0) return entries[0];
+        if (p==1) return entries[1 + (pp[0]-min0)/CB0a];
+        if (p==2) return entries[1 + n1 + (pp[0]-min0)/CB0b * n2 + (pp[1]-min1)/CB1];
+        else return entries.back();
+    }
+    ColorVal snapColor(const Entry &e, const ColorVal c) const {
+        if (c <= e.min) return e.min;
+        if (c >= e.max) return e.max;
+        if (e.snap >= 0) return snapvalues[e.snap + c - e.min];
+        return c;
+    }
+    void flatten(FlatColorRanges &flat) const {
+        flat.snapvalues = snapvalues;
+        prevPlanes pp(2);
+        for (int p = 0; p < 4; p++) {
+            flat.tables[p].resize(flat.table_size(p));
+            for (size_t k = 0; k < flat.tables[p].size(); k++) {
+                flat.table_key(p, k, pp);
+                flat.tables[p][k] = find(p, pp);
+            }
+        }
+    }
+};
+
 class ColorRangesCB : public ColorRanges
 {
 protected:
     const ColorRanges *ranges;
     ColorBuckets *buckets;
+    ColorBucketTable table;
 public:
-    ColorBucket bucket(const int p, const prevPlanes &pp) const { return buckets->findBucket(p,pp); }
-    ColorRangesCB(const ColorRanges *rangesIn, ColorBuckets *cbIn) :  ranges(rangesIn), buckets(cbIn) {} //print();}
+    const ColorBucket& bucket(const int p, const prevPlanes &pp) const { return buckets->findBucket(p,pp); }
+    ColorRangesCB(const ColorRanges *rangesIn, ColorBuckets *cbIn) :  ranges(rangesIn), buckets(cbIn), table(*cbIn) {} //print();}
     ~ColorRangesCB() {
         delete buckets;
     }
@@ -261,25 +321,27 @@ public:
     ColorVal min(int p) const { return ranges->min(p); }
     ColorVal max(int p) const { return ranges->max(p); }
     void snap(const int p, const prevPlanes &pp, ColorVal &minv, ColorVal &maxv, ColorVal &v) const {
-        const ColorBucket& b = bucket(p,pp);
+        const ColorBucketTable::Entry& b = table.find(p,pp);
         minv=b.min;
         maxv=b.max;
 //        if (b.min > b.max) { printf("UGH!! HOW? Shouldn't happen!\n"); assert(false); minv=0; maxv=0; v=0; }
-        v=b.snapColor(v);
+        v=table.snapColor(b,v);
     }
     void minmax(const int p, const prevPlanes &pp, ColorVal &minv, ColorVal &maxv) const {
-        const ColorBucket& b = bucket(p,pp);
+        const ColorBucketTable::Entry& b = table.find(p,pp);
         minv=b.min;
         maxv=b.max;
         assert(minv <= maxv);
     }
+    bool flatten(FlatColorRanges &flat) const { table.flatten(flat); return true; }
     void print() {
         buckets->print();
     }
 };
 
 
-class TransformCB : public Transform {
+template <typename IO>
+class TransformCB : public Transform<IO> {
 protected:
     ColorBuckets *cb;
 
@@ -292,10 +354,10 @@ protected:
         pixelU.push_back(cb->min0+CB0b-1);
         pixelL.push_back(cb->min1);
         pixelU.push_back(cb->min1+CB1-1);
-        for (auto bv : cb->bucket2) {
+        for (const auto& bv : cb->bucket2) {
                 pixelL[1] = cb->min1;
                 pixelU[1] = cb->min1+CB1-1;
-                for (auto b : bv) {
+                for (const auto& b : bv) {
                         if (b.empty()) {
                                 for (ColorVal c=pixelL[1]; c<=pixelU[1]; c++) {
                                   cb->findBucket(1,pixelL).removeColor(c);
@@ -311,6 +373,7 @@ protected:
         for (auto& b : cb->bucket1) b.prepare_snapvalues();
         for (auto& bv : cb->bucket2) for (auto& b : bv) b.prepare_snapvalues();
 
+        // ColorRangesCB builds its lookup table from the buckets as they are now
         return new ColorRangesCB(srcRanges, cb);
     }
     bool init(const ColorRanges *srcRanges) {
@@ -349,13 +412,13 @@ protected:
         }
     }
 
-    ColorBucket load_bucket(SimpleSymbolCoder<FLIFBitChanceMeta, RacIn, 24> &coder, const ColorRanges *srcRanges, const int plane, const prevPlanes &pixelL, const prevPlanes &pixelU) {
+    ColorBucket load_bucket(SimpleSymbolCoder<FLIFBitChanceMeta, RacIn<IO>, 24> &coder, const ColorRanges *srcRanges, const int plane, const prevPlanes &pixelL, const prevPlanes &pixelU) {
         ColorBucket b;
         if (plane<3)
         for (int p=0; p<plane; p++) {
                 if (!cb->exists(p,pixelL,pixelU)) return b;
         }
-//        SimpleBitCoder<FLIFBitChanceMeta, RacIn> bcoder(rac);
+//        SimpleBitCoder<FLIFBitChanceMeta, RacIn<IO> > bcoder(rac);
 
         ColorVal smin,smax;
         minmax(srcRanges,plane,pixelL,pixelU,smin,smax);
@@ -393,9 +456,9 @@ protected:
 //        b.print();
         return b;
     }
-    void load(const ColorRanges *srcRanges, RacIn &rac) {
+    void load(const ColorRanges *srcRanges, RacIn<IO> &rac) {
 //        printf("Loading Color Buckets\n");
-        SimpleSymbolCoder<FLIFBitChanceMeta, RacIn, 24> coder(rac);
+        SimpleSymbolCoder<FLIFBitChanceMeta, RacIn<IO>, 24> coder(rac);
         prevPlanes pixelL, pixelU;
         cb->bucket0 = load_bucket(coder, srcRanges, 0, pixelL, pixelU);
         pixelL.push_back(cb->min0);
@@ -417,7 +480,7 @@ protected:
         if (srcRanges->numPlanes() > 3) cb->bucket3 = load_bucket(coder, srcRanges, 3, pixelL, pixelU);
     }
 
-    void save_bucket(const ColorBucket &b, SimpleSymbolCoder<FLIFBitChanceMeta, RacOut, 24> &coder, const ColorRanges *srcRanges, const int plane, const prevPlanes &pixelL, const prevPlanes &pixelU) const {
+    void save_bucket(const ColorBucket &b, SimpleSymbolCoder<FLIFBitChanceMeta, RacOut<IO>, 24> &coder, const ColorRanges *srcRanges, const int plane, const prevPlanes &pixelL, const prevPlanes &pixelU) const {
         if (plane<3)
         for (int p=0; p<plane; p++) {
                 if (!cb->exists(p,pixelL,pixelU)) {
@@ -425,7 +488,7 @@ protected:
                         return;
                 }
         }
-//        SimpleBitCoder<FLIFBitChanceMeta, RacOut> bcoder(rac);
+//        SimpleBitCoder<FLIFBitChanceMeta, RacOut<IO> > bcoder(rac);
 //        if (b.min > b.max) printf("SHOULD NOT HAPPEN!\n");
 
         ColorVal smin,smax;
@@ -464,8 +527,8 @@ protected:
              }
         }
     }
-    void save(const ColorRanges *srcRanges, RacOut &rac) const {
-        SimpleSymbolCoder<FLIFBitChanceMeta, RacOut, 24> coder(rac);
+    void save(const ColorRanges *srcRanges, RacOut<IO> &rac) const {
+        SimpleSymbolCoder<FLIFBitChanceMeta, RacOut<IO>, 24> coder(rac);
 
 //        printf("Saving Y Color Bucket: ");
         prevPlanes pixelL, pixelU;
@@ -496,9 +559,21 @@ protected:
         }
     }
 
-    bool process(const ColorRanges *srcRanges, const Images &images) {
+    bool changes_data() const { return false; }
+
+    bool process(const ColorRanges *srcRanges, const Images &images, ImageAnalysis &analysis) {
             std::vector<ColorVal> pixel(images[0].numPlanes());
-            // fill buckets
+            // fill buckets (adding a color is idempotent, so the distinct colors are enough)
+            analysis.update(images);
+            if (analysis.colors_complete) {
+                std::vector<ImageAnalysis::Color> colors;
+                analysis.colors.colors(colors);
+                for (const ImageAnalysis::Color &C : colors) {
+                  pixel[0] = std::get<0>(C); pixel[1] = std::get<1>(C); pixel[2] = std::get<2>(C);
+                  if (pixel.size() > 3) pixel[3] = std::get<3>(C);
+                  cb->addColor(pixel);
+                }
+            } else
             for (const Image& image : images)
             for (uint32_t r=0; r<image.rows(); r++) {
                 for (uint32_t c=0; c<image.cols(); c++) {
@@ -512,8 +587,10 @@ protected:
                 }
             }
 
-            cb->bucket0.simplify_lossless();
-            cb->bucket3.simplify_lossless();
+            cb->bucket0.simplify_lossless(cb->stats);
+            cb->bucket3.simplify_lossless(cb->stats);
+            const int &totaldiscretecolors = cb->stats.totaldiscretecolors;
+            const int &totalcontinuousbuckets = cb->stats.totalcontinuousbuckets;
 
 //                  if (totaldiscretecolors > 20000 && totalcontinuousbuckets > 2000) {
 //                        printf("Too many colors, not using color buckets.\n");
@@ -531,14 +608,14 @@ protected:
 
             // simplify buckets
             if (!doing_it) {
-              for (auto& b : cb->bucket1) b.simplify(80);
-              for (auto& bv : cb->bucket2) for (auto& b : bv) b.simplify(60);
+              for (auto& b : cb->bucket1) b.simplify(80, cb->stats);
+              for (auto& bv : cb->bucket2) for (auto& b : bv) b.simplify(60, cb->stats);
 
 //              printf("Filled color buckets with %i discrete colors + %i continous buckets\n",totaldiscretecolors,totalcontinuousbuckets);
               if (totaldiscretecolors > 1000) {
 //                printf("Too many colors, simplifying...\n");
-                for (auto& b : cb->bucket1) b.simplify(50);
-                for (auto& bv : cb->bucket2) for (auto& b : bv) b.simplify(20);
+                for (auto& b : cb->bucket1) b.simplify(50, cb->stats);
+                for (auto& bv : cb->bucket2) for (auto& b : bv) b.simplify(20, cb->stats);
 //                printf("Filled color buckets with %i discrete colors + %i continous buckets\n",totaldiscretecolors,totalcontinuousbuckets);
                 if (totaldiscretecolors > 2000 || totalcontinuousbuckets > 2000) {
 //                  printf("Still too many colors, not using auto-indexing.\n");
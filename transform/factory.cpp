@@ -11,23 +11,28 @@
 #include "framedup.h"
 #include "framecombine.h"
 
-Transform *create_transform(std::string desc)
+template <typename IO>
+Transform<IO> *create_transform(std::string desc)
 {
     if (desc == "YIQ")
-        return new TransformYIQ();
+        return new TransformYIQ<IO>();
     if (desc == "BND")
-        return new TransformBounds();
+        return new TransformBounds<IO>();
     if (desc == "ACB")
-        return new TransformCB();
+        return new TransformCB<IO>();
     if (desc == "PLT")
-        return new TransformPalette();
+        return new TransformPalette<IO>();
     if (desc == "PLA")
-        return new TransformPaletteA();
+        return new TransformPaletteA<IO>();
     if (desc == "FRS")
-        return new TransformFrameShape();
+        return new TransformFrameShape<IO>();
     if (desc == "DUP")
-        return new TransformFrameDup();
+        return new TransformFrameDup<IO>();
     if (desc == "FRA")
-        return new TransformFrameCombine();
+        return new TransformFrameCombine<IO>();
     return NULL;
 }
+
+template Transform<FileIO> *create_transform(std::string desc);
+template Transform<BlobReader> *create_transform(std::string desc);
+template Transform<BlobIO> *create_transform(std::string desc);
@@ -2,9 +2,42 @@
 #define _FRAMECOMBINE_H_ 1
 
 #include <vector>
+#include <algorithm>
 
 #include "transform.h"
 
+// 16-bit hash of a pixel, for the lookback search (a match of the hashes is verified on the pixels)
+inline uint16_t lookback_hash(const ColorVal *pixel, const int nump) {
+    uint64_t h = 0;
+    for (int p=0; p<nump; p++) h = (h ^ (uint32_t)pixel[p]) * 0x9E3779B97F4A7C15ULL;
+    return h >> 48;
+}
+
+// for every pixel position, the hashes of the pixels at that position in the last depth() frames (frame f in
+// slot f%depth()), so looking back that far only compares pixels when the hashes match. depth() is the lookback,
+// or as many frames as fit in LOOKBACK_RING_MAX_BYTES (0: position() is NULL).
+class LookbackRing {
+    std::vector<uint16_t> hashes;
+    uint32_t frames;
+    uint32_t cols;
+public:
+    LookbackRing(const Image &image, const int lookback) : cols(image.cols()) {
+        const uint64_t frame_bytes = std::max<uint64_t>(1, (uint64_t)image.rows() * cols * sizeof(uint16_t));
+        frames = std::min<uint64_t>(std::max(lookback, 0), LOOKBACK_RING_MAX_BYTES / frame_bytes);
+        if (frames < (uint32_t)std::max(lookback, 0)) v_printf(5,"[lookback hashes for %u of %i frames]", frames, lookback);
+        hashes.resize((uint64_t)image.rows() * cols * frames);
+    }
+    uint16_t *position(const uint32_t r, const uint32_t c) {
+        return hashes.empty() ? NULL : &hashes[((size_t)r * cols + c) * frames];
+    }
+    uint32_t depth() const { return frames; }
+    uint32_t slot(const int fr) const { return frames ? fr % frames : 0; }
+    // false if frame fr-prev is in the ring and has another hash
+    bool may_match(const uint16_t *hashes, const int fr, const int prev, const uint16_t h) const {
+        return !hashes || (uint32_t)prev > frames || hashes[slot(fr-prev)] == h;
+    }
+};
+
 
 class ColorRangesFC : public ColorRanges
 {
@@ -24,7 +57,8 @@ public:
     }
 };
 
-class TransformFrameCombine : public Transform {
+template <typename IO>
+class TransformFrameCombine : public Transform<IO> {
 protected:
     bool was_flat;
     int max_lookback;
@@ -41,19 +75,19 @@ protected:
         return new ColorRangesFC(lookback, (srcRanges->numPlanes() == 4 ? srcRanges->max(3) : 1), srcRanges);
     }
 
-    void load(const ColorRanges *srcRanges, RacIn &rac) {
-        SimpleSymbolCoder<SimpleBitChance, RacIn, 24> coder(rac);
+    void load(const ColorRanges *srcRanges, RacIn<IO> &rac) {
+        SimpleSymbolCoder<SimpleBitChance, RacIn<IO>, 24> coder(rac);
         max_lookback = coder.read_int(1, 256);
         v_printf(5,"[%i]",max_lookback);
     }
 
-    void save(const ColorRanges *srcRanges, RacOut &rac) const {
-        SimpleSymbolCoder<SimpleBitChance, RacOut, 24> coder(rac);
+    void save(const ColorRanges *srcRanges, RacOut<IO> &rac) const {
+        SimpleSymbolCoder<SimpleBitChance, RacOut<IO>, 24> coder(rac);
         coder.write_int(1,256,max_lookback);
     }
 
 // a heuristic to figure out if this is going to help (it won't help if we introduce more entropy than what is eliminated)
-    bool process(const ColorRanges *srcRanges, const Images &images) {
+    bool process(const ColorRanges *srcRanges, const Images &images, ImageAnalysis &analysis) {
         int nump=images[0].numPlanes();
         int pixel_cost = 1;
         for (int p=0; p<nump; p++) pixel_cost *= (1 + srcRanges->max(p) - srcRanges->min(p));
@@ -63,20 +97,30 @@ protected:
         uint64_t new_pixels=0;
         max_lookback=1;
         if (user_max_lookback == -1) user_max_lookback = images.size()-1;
-        for (int fr=1; fr < (int)images.size(); fr++) {
+        LookbackRing ring(images[0], std::min(user_max_lookback, (int)images.size()-1));
+        ColorVal pixel[4];
+        for (int fr=0; fr < (int)images.size(); fr++) {
             const Image& image = images[fr];
+            const uint32_t slot = ring.slot(fr);
             for (uint32_t r=0; r<image.rows(); r++) {
-                for (uint32_t c=image.col_begin[r]; c<image.col_end[r]; c++) {
-                    new_pixels++;
-                    if (nump>3 && image(3,r,c) == 0) { continue; }
-                    for (int prev=1; prev <= fr; prev++) {
+                for (uint32_t c=0; c<image.cols(); c++) {
+                    for (int p=0; p<nump; p++) pixel[p] = image(p,r,c);
+                    const uint16_t h = lookback_hash(pixel, nump);
+                    uint16_t *hashes = ring.position(r,c);
+                    if (fr > 0 && c >= image.col_begin[r] && c < image.col_end[r]) {
+                      new_pixels++;
+                      if (!(nump>3 && pixel[3] == 0))
+                      for (int prev=1; prev <= fr; prev++) {
                         if (prev>user_max_lookback) break;
+                        if (!ring.may_match(hashes, fr, prev, h)) continue;
                         bool identical=true;
                         for (int p=0; p<nump; p++) {
-                          if(image(p,r,c) != images[fr-prev](p,r,c)) { identical=false; break;}
+                          if(pixel[p] != images[fr-prev](p,r,c)) { identical=false; break;}
                         }
                         if (identical) { found_pixels[prev]++; new_pixels--; if (prev>max_lookback) max_lookback=prev; break;}
+                      }
                     }
+                    if (hashes) hashes[slot] = h;
                 }
             }
         }
@@ -97,14 +141,22 @@ protected:
 
     void configure(int setting) { user_max_lookback=setting; }
     void data(Images &images) const {
-        for (int fr=1; fr < (int)images.size(); fr++) {
+        // the ring has the hashes of the pixels as they are compared to: with the alpha of the frame they refer to
+        LookbackRing ring(images[0], max_lookback);
+        ColorVal pixel[4];
+        for (int fr=0; fr < (int)images.size(); fr++) {
             uint32_t ipixels=0;
             Image& image = images[fr];
+            const uint32_t slot = ring.slot(fr);
             for (uint32_t r=0; r<image.rows(); r++) {
-                for (uint32_t c=image.col_begin[r]; c<image.col_end[r]; c++) {
-                    if (image(3,r,c) == 0) continue;
-                    for (int prev=1; prev <= fr; prev++) {
+                for (uint32_t c=0; c<image.cols(); c++) {
+                    for (int p=0; p<4; p++) pixel[p] = image(p,r,c);
+                    uint16_t *hashes = ring.position(r,c);
+                    if (fr > 0 && c >= image.col_begin[r] && c < image.col_end[r] && pixel[3] != 0) {
+                      const uint16_t h = lookback_hash(pixel, 4);
+                      for (int prev=1; prev <= fr; prev++) {
                         if (prev>max_lookback) break;
+                        if (!ring.may_match(hashes, fr, prev, h)) continue;
                         bool identical=true;
                         for (int p=0; p<3; p++) {
                           if(image(p,r,c) != images[fr-prev](p,r,c)) { identical=false; break;}
@@ -115,7 +167,12 @@ protected:
                           if (image(3,r,c) != images[fr-prev](3,r,c)) identical=false;
                         }
                         if (identical) {image.set(3,r,c, -prev); ipixels++; break;}
+                      }
                     }
+                    if (!hashes) continue;
+                    ColorVal a = image(3,r,c);
+                    pixel[3] = (a < 0 ? images[fr+a](3,r,c) : a);
+                    hashes[slot] = lookback_hash(pixel, 4);
                 }
             }
 //            printf("frame %i: found %u pixels from previous frames\n", fr, ipixels);
@@ -1,14 +1,16 @@
 #ifndef _FRAMEDUP_H_
 #define _FRAMEDUP_H_ 1
 
+#include <string.h>
 #include <vector>
+#include <unordered_map>
 
 #include "transform.h"
 #include "../maniac/symbol.h"
 
 
-
-class TransformFrameDup : public Transform {
+template <typename IO>
+class TransformFrameDup : public Transform<IO> {
 protected:
     std::vector<int> seen_before;
     uint32_t nb;
@@ -22,44 +24,54 @@ protected:
     }
 
     void configure(const int setting) { nb=setting; }
+    bool changes_data() const { return false; }
 
-    void load(const ColorRanges *srcRanges, RacIn &rac) {
-        SimpleSymbolCoder<FLIFBitChanceMeta, RacIn, 24> coder(rac);
+    void load(const ColorRanges *srcRanges, RacIn<IO> &rac) {
+        SimpleSymbolCoder<FLIFBitChanceMeta, RacIn<IO>, 24> coder(rac);
         seen_before.clear();
         seen_before.push_back(-1);
         for (unsigned int i=1; i<nb; i++) seen_before.push_back(coder.read_int(-1,nb-2));
         int count=0; for(int i : seen_before) { if(i>=0) count++; } v_printf(5,"[%i]",count);
     }
 
-    void save(const ColorRanges *srcRanges, RacOut &rac) const {
-        SimpleSymbolCoder<FLIFBitChanceMeta, RacOut, 24> coder(rac);
+    void save(const ColorRanges *srcRanges, RacOut<IO> &rac) const {
+        SimpleSymbolCoder<FLIFBitChanceMeta, RacOut<IO>, 24> coder(rac);
         assert(nb == seen_before.size());
         for (unsigned int i=1; i<seen_before.size(); i++) coder.write_int(-1,nb-2,seen_before[i]);
         int count=0; for(int i : seen_before) { if(i>=0) count++; } v_printf(5,"[%i]",count);
     }
 
-    bool process(const ColorRanges *srcRanges, const Images &images) {
+    static bool identical(const Image &a, const FrameHash &ha, const Image &b, const FrameHash &hb, const int np) {
+        if (ha.frame != hb.frame || ha.rows != hb.rows) return false;
+        for (int p=0; p<np; p++) {
+            size_t rowsize = (size_t) a.cols() * (a.wide_plane(p) ? sizeof(int32_t) : sizeof(int16_t));
+            for (uint32_t r=0; r<a.rows(); r++) {
+                if (memcmp(a.row_pointer(p,r), b.row_pointer(p,r), rowsize)) return false;
+            }
+        }
+        return true;
+    }
+
+    bool process(const ColorRanges *srcRanges, const Images &images, ImageAnalysis &analysis) {
         int np=srcRanges->numPlanes();
         nb = images.size();
         seen_before.empty();
         seen_before.resize(nb,-1);
+        if (nb < 2) return false;
+
+        // only compare frames with the same hash
+        analysis.update(images);
+        assert(analysis.nump == np);
+        const std::vector<FrameHash> &hashes = analysis.frame_hashes;
+
+        std::unordered_map<uint64_t, std::vector<unsigned int> > frames_by_hash;
         bool dupes_found=false;
-        for (unsigned int fr=1; fr<images.size(); fr++) {
-            const Image& image = images[fr];
-            for (unsigned int ofr=0; ofr<fr; ofr++) {
-              const Image& oimage = images[ofr];
-              bool identical=true;
-              for (uint32_t r=0; r<image.rows(); r++) {
-                for (uint32_t c=0; c<image.cols(); c++) {
-                    for (int p=0; p<np; p++) {
-                       if(image(p,r,c) != oimage(p,r,c)) { identical=false; break;}
-                    }
-                    if (!identical) {break;}
-                }
-                if (!identical) {break;}
-              }
-              if (identical) {seen_before[fr] = ofr; dupes_found=true; break;}
+        for (unsigned int fr=0; fr<nb; fr++) {
+            std::vector<unsigned int> &candidates = frames_by_hash[hashes[fr].frame];
+            for (unsigned int ofr : candidates) {
+              if (identical(images[fr], hashes[fr], images[ofr], hashes[ofr], np)) {seen_before[fr] = ofr; dupes_found=true; break;}
             }
+            if (seen_before[fr] < 0) candidates.push_back(fr);
         }
         return dupes_found;
     }
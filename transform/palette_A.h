@@ -4,8 +4,9 @@
 #include "../image/image.h"
 #include "../image/color_range.h"
 #include "transform.h"
+#include "palette_hash.h"
 #include <tuple>
-#include <set>
+#include <algorithm>
 
 #define MAX_PALETTE_SIZE 30000
 
@@ -38,11 +39,12 @@ public:
 };
 
 
-class TransformPaletteA : public Transform {
+template <typename IO>
+class TransformPaletteA : public Transform<IO> {
 protected:
     typedef std::tuple<ColorVal,ColorVal,ColorVal,ColorVal> Color;
-    std::set<Color> Palette;
-    std::vector<Color> Palette_vector;
+    PaletteHash<Color> Palette;         // color -> index in Palette_vector
+    std::vector<Color> Palette_vector;  // sorted
     unsigned int max_palette_size;
 
 public:
@@ -59,17 +61,34 @@ public:
         return new ColorRangesPaletteA(srcRanges, Palette_vector.size());
     }
 
-    bool process(const ColorRanges *srcRanges, const Images &images) {
-        for (const Image& image : images)
-        for (uint32_t r=0; r<image.rows(); r++) {
+    bool process(const ColorRanges *srcRanges, const Images &images, ImageAnalysis &analysis) {
+        analysis.update(images);
+        if (analysis.colors_complete) {
+            std::vector<ImageAnalysis::Color> colors;
+            analysis.colors.colors(colors);
+            for (const ImageAnalysis::Color &C : colors) {
+                int Y=std::get<0>(C), I=std::get<1>(C), Q=std::get<2>(C), A=std::get<3>(C);
+                if (A==0) { Y=I=Q=0; }
+                if (Palette.insert(Color(A,Y,I,Q), 0) && Palette.size() > max_palette_size) return false;
+            }
+        } else {
+          Color prev(-1,-1,-1,-1);
+          for (const Image& image : images)
+          for (uint32_t r=0; r<image.rows(); r++) {
             for (uint32_t c=0; c<image.cols(); c++) {
                 int Y=image(0,r,c), I=image(1,r,c), Q=image(2,r,c), A=image(3,r,c);
                 if (A==0) { Y=I=Q=0; }
-                Palette.insert(Color(A,Y,I,Q));  // alpha first so sorting makes more sense
-                if (Palette.size() > max_palette_size) return false;
+                Color C(A,Y,I,Q);  // alpha first so sorting makes more sense
+                if (C == prev && Palette.size()) continue;
+                prev = C;
+                if (Palette.insert(C, 0) && Palette.size() > max_palette_size) return false;
             }
+          }
         }
-        for (Color c : Palette) Palette_vector.push_back(c);
+        Palette.colors(Palette_vector);
+        std::sort(Palette_vector.begin(), Palette_vector.end());
+        Palette.clear();
+        for (unsigned int i=0; i<Palette_vector.size(); i++) Palette.insert(Palette_vector[i], i);
 //        printf("Palette size: %lu\n",Palette.size());
         return true;
     }
@@ -80,8 +99,7 @@ public:
             for (uint32_t c=0; c<image.cols(); c++) {
                 Color C(image(3,r,c), image(0,r,c), image(1,r,c), image(2,r,c));
                 if (std::get<0>(C) == 0) { std::get<1>(C) = std::get<2>(C) = std::get<3>(C) = 0; }
-                ColorVal P=0;
-                for (Color c : Palette_vector) {if (c==C) break; else P++;}
+                ColorVal P=Palette.find(C);
                 image.set(0,r,c, P);
                 image.set(1,r,c, 0);
                 image.set(2,r,c, 0);
@@ -104,12 +122,12 @@ public:
           image.palette=false;
         }
     }
-    void save(const ColorRanges *srcRanges, RacOut &rac) const {
-        SimpleSymbolCoder<FLIFBitChanceMeta, RacOut, 24> coder(rac);
-        SimpleSymbolCoder<FLIFBitChanceMeta, RacOut, 24> coderY(rac);
-        SimpleSymbolCoder<FLIFBitChanceMeta, RacOut, 24> coderI(rac);
-        SimpleSymbolCoder<FLIFBitChanceMeta, RacOut, 24> coderQ(rac);
-        SimpleSymbolCoder<FLIFBitChanceMeta, RacOut, 24> coderA(rac);
+    void save(const ColorRanges *srcRanges, RacOut<IO> &rac) const {
+        SimpleSymbolCoder<FLIFBitChanceMeta, RacOut<IO>, 24> coder(rac);
+        SimpleSymbolCoder<FLIFBitChanceMeta, RacOut<IO>, 24> coderY(rac);
+        SimpleSymbolCoder<FLIFBitChanceMeta, RacOut<IO>, 24> coderI(rac);
+        SimpleSymbolCoder<FLIFBitChanceMeta, RacOut<IO>, 24> coderQ(rac);
+        SimpleSymbolCoder<FLIFBitChanceMeta, RacOut<IO>, 24> coderA(rac);
         Color min(srcRanges->min(3), srcRanges->min(0), srcRanges->min(1), srcRanges->min(2));
         Color max(srcRanges->max(3), srcRanges->max(0), srcRanges->max(1), srcRanges->max(2));
         coder.write_int(1, MAX_PALETTE_SIZE, Palette_vector.size());
@@ -135,12 +153,12 @@ public:
 //        printf("\nSaved palette of size: %lu\n",Palette_vector.size());
         v_printf(5,"[%lu]",Palette_vector.size());
     }
-    void load(const ColorRanges *srcRanges, RacIn &rac) {
-        SimpleSymbolCoder<FLIFBitChanceMeta, RacIn, 24> coder(rac);
-        SimpleSymbolCoder<FLIFBitChanceMeta, RacIn, 24> coderY(rac);
-        SimpleSymbolCoder<FLIFBitChanceMeta, RacIn, 24> coderI(rac);
-        SimpleSymbolCoder<FLIFBitChanceMeta, RacIn, 24> coderQ(rac);
-        SimpleSymbolCoder<FLIFBitChanceMeta, RacIn, 24> coderA(rac);
+    void load(const ColorRanges *srcRanges, RacIn<IO> &rac) {
+        SimpleSymbolCoder<FLIFBitChanceMeta, RacIn<IO>, 24> coder(rac);
+        SimpleSymbolCoder<FLIFBitChanceMeta, RacIn<IO>, 24> coderY(rac);
+        SimpleSymbolCoder<FLIFBitChanceMeta, RacIn<IO>, 24> coderI(rac);
+        SimpleSymbolCoder<FLIFBitChanceMeta, RacIn<IO>, 24> coderQ(rac);
+        SimpleSymbolCoder<FLIFBitChanceMeta, RacIn<IO>, 24> coderA(rac);
         Color min(srcRanges->min(3), srcRanges->min(0), srcRanges->min(1), srcRanges->min(2));
         Color max(srcRanges->max(3), srcRanges->max(0), srcRanges->max(1), srcRanges->max(2));
         long unsigned size = coder.read_int(1, MAX_PALETTE_SIZE);
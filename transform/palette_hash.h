@@ -0,0 +1,78 @@
+#ifndef _PALETTE_HASH_H_
+#define _PALETTE_HASH_H_ 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <tuple>
+#include <vector>
+
+#include "../image/image.h"
+
+inline uint64_t color_hash_mix(uint64_t h, ColorVal v) {
+    return (h ^ (uint32_t)v) * 0x9E3779B97F4A7C15ULL;
+}
+inline uint64_t color_hash(const std::tuple<ColorVal,ColorVal,ColorVal> &c) {
+    uint64_t h = color_hash_mix(color_hash_mix(color_hash_mix(0, std::get<0>(c)), std::get<1>(c)), std::get<2>(c));
+    return h ^ (h >> 32);
+}
+inline uint64_t color_hash(const std::tuple<ColorVal,ColorVal,ColorVal,ColorVal> &c) {
+    uint64_t h = color_hash_mix(color_hash_mix(color_hash_mix(color_hash_mix(0, std::get<0>(c)), std::get<1>(c)), std::get<2>(c)), std::get<3>(c));
+    return h ^ (h >> 32);
+}
+
+// open addressing (linear probing) hash map from palette colors to palette indices
+template <typename Color> class PaletteHash {
+    std::vector<Color> keys;
+    std::vector<int32_t> values;  // -1 = empty slot
+    size_t mask;
+    size_t count;
+
+    size_t slot(const Color &c) const {
+        size_t i = color_hash(c) & mask;
+        while (values[i] >= 0 && !(keys[i] == c)) i = (i+1) & mask;
+        return i;
+    }
+    void grow() {
+        std::vector<Color> old_keys;
+        std::vector<int32_t> old_values;
+        old_keys.swap(keys);
+        old_values.swap(values);
+        keys.resize(old_keys.size()*2);
+        values.assign(old_values.size()*2, -1);
+        mask = keys.size()-1;
+        for (size_t i = 0; i < old_keys.size(); i++) if (old_values[i] >= 0) {
+            size_t j = slot(old_keys[i]);
+            keys[j] = old_keys[i];
+            values[j] = old_values[i];
+        }
+    }
+public:
+    PaletteHash() : keys(256), values(256, -1), mask(255), count(0) {}
+
+    // returns false if the color was already present (its value is left unchanged)
+    bool insert(const Color &c, int32_t value) {
+        size_t i = slot(c);
+        if (values[i] >= 0) return false;
+        keys[i] = c;
+        values[i] = value;
+        if (2 * ++count > keys.size()) grow();
+        return true;
+    }
+    // returns -1 if the color is not present
+    int32_t find(const Color &c) const {
+        return values[slot(c)];
+    }
+    size_t size() const { return count; }
+
+    void colors(std::vector<Color> &out) const {
+        for (size_t i = 0; i < keys.size(); i++) if (values[i] >= 0) out.push_back(keys[i]);
+    }
+    void clear() {
+        keys.assign(256, Color());
+        values.assign(256, -1);
+        mask = 255;
+        count = 0;
+    }
+};
+
+#endif
@@ -6,25 +6,60 @@
 #include "../maniac/rac.h"
 #include "../flif_config.h"
 #include "../flif.h"
+#include "analysis.h"
 
+#include <thread>
+#include <algorithm>
 
+// calls f(image, r) for every row r of every image, with the rows split in blocks over at most max_threads threads
+template <typename F> void for_each_row_parallel(Images &images, const unsigned int max_threads, F f) {
+    uint64_t pixels = 0;
+    for (const Image& image : images) pixels += (uint64_t)image.rows() * image.cols();
+    unsigned int nb_threads = std::max(1u, max_threads);
+    if (pixels < 0x10000) nb_threads = 1;
+    for (Image& image : images) {
+        const uint32_t rows = image.rows();
+        const uint32_t block = std::max(1u, (rows + nb_threads - 1) / nb_threads);
+        if (nb_threads == 1 || rows < 2) {
+            for (uint32_t r = 0; r < rows; r++) f(image, r);
+            continue;
+        }
+        std::vector<std::thread> workers;
+        for (uint32_t begin = 0; begin < rows; begin += block) {
+            const uint32_t end = std::min(rows, begin + block);
+            workers.push_back(std::thread([&image, &f, begin, end]() {
+                for (uint32_t r = begin; r < end; r++) f(image, r);
+            }));
+        }
+        for (std::thread &w : workers) w.join();
+    }
+}
+
+
+template <typename IO>
 class Transform {
 protected:
+    unsigned int threads;   // the most threads data() and invData() may use
 
 public:
+    Transform() : threads(1) {}
     virtual ~Transform() {};
+    void set_threads(const unsigned int t) { threads = t; }
 
     // On encode: init, process, save, meta, data, <processing>
     // On decode: init,          load, meta,       <processing>, invData           ( + optional configure anywhere)
+    // process() can use the statistics in analysis (call analysis.update(images) first)
 
     bool virtual init(const ColorRanges *srcRanges) { return true; }
     void virtual configure(const int setting) { }
-    bool virtual process(const ColorRanges *srcRanges, const Images &images) { return true; };
-    void virtual load(const ColorRanges *srcRanges, RacIn &rac) {};
-    void virtual save(const ColorRanges *srcRanges, RacOut &rac) const {};
+    bool virtual process(const ColorRanges *srcRanges, const Images &images, ImageAnalysis &analysis) { return true; };
+    void virtual load(const ColorRanges *srcRanges, RacIn<IO> &rac) {};
+    void virtual save(const ColorRanges *srcRanges, RacOut<IO> &rac) const {};
     const ColorRanges virtual *meta(Images& images, const ColorRanges *srcRanges) { return new DupColorRanges(srcRanges); }
     void virtual data(Images& images) const {}
     void virtual invData(Images& images) const {}
+    // false if data() does not change the pixel values (so the analysis stays valid)
+    bool virtual changes_data() const { return true; }
 
 };
 
@@ -5,6 +5,9 @@
 #include "../image/color_range.h"
 #include "transform.h"
 #include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define clip(x,l,u)   if (x < l) x=l; if (x > u) x=u
 
@@ -108,7 +111,81 @@ public:
 };
 
 
-class TransformYIQ : public Transform {
+// Row kernels working on the plane storage: plane 0 is y_t (int16_t for 8-bit images, int32_t otherwise),
+// planes 1 and 2 are always int32_t. The SSE2 versions do 4 pixels at a time, the rest is done by the scalar loop.
+#ifdef __SSE2__
+static inline __m128i yiq_load(const int16_t *p) { __m128i x = _mm_loadl_epi64((const __m128i*)p); return _mm_srai_epi32(_mm_unpacklo_epi16(x,x),16); }
+static inline __m128i yiq_load(const int32_t *p) { return _mm_loadu_si128((const __m128i*)p); }
+static inline void yiq_store(int16_t *p, __m128i x) { _mm_storel_epi64((__m128i*)p, _mm_packs_epi32(x,x)); }
+static inline void yiq_store(int32_t *p, __m128i x) { _mm_storeu_si128((__m128i*)p, x); }
+// x/2, rounding towards zero like the C division
+static inline __m128i yiq_div2(__m128i x) { return _mm_srai_epi32(_mm_add_epi32(x, _mm_srli_epi32(x,31)),1); }
+static inline __m128i yiq_clip(__m128i x, __m128i l, __m128i u) {
+    __m128i m = _mm_cmplt_epi32(x,l);
+    x = _mm_or_si128(_mm_and_si128(m,l), _mm_andnot_si128(m,x));
+    m = _mm_cmpgt_epi32(x,u);
+    return _mm_or_si128(_mm_and_si128(m,u), _mm_andnot_si128(m,x));
+}
+#endif
+
+template <typename y_t>
+static void yiq_forward_row(y_t *p0, int32_t *p1, int32_t *p2, const uint32_t n, const int par) {
+    uint32_t c=0;
+#ifdef __SSE2__
+    const __m128i offset = _mm_set1_epi32(par*4-1);
+    for (; c+4 <= n; c+=4) {
+        __m128i R = yiq_load(p0+c), G = yiq_load(p1+c), B = yiq_load(p2+c);
+        __m128i RB = yiq_div2(_mm_add_epi32(R,B));
+        yiq_store(p0+c, yiq_div2(_mm_add_epi32(RB,G)));
+        yiq_store(p1+c, _mm_add_epi32(_mm_sub_epi32(R,B), offset));
+        yiq_store(p2+c, _mm_add_epi32(_mm_sub_epi32(RB,G), offset));
+    }
+#endif
+    for (; c<n; c++) {
+        int R=p0[c], G=p1[c], B=p2[c];
+        p0[c] = ((R + B) / 2 + G) / 2;
+        p1[c] = R - B + par*4 - 1;
+        p2[c] = (R + B) / 2 - G + par*4 - 1;
+    }
+}
+
+template <typename y_t>
+static void yiq_inverse_row(y_t *p0, int32_t *p1, int32_t *p2, const uint32_t n, const int par) {
+    uint32_t c=0;
+#ifdef __SSE2__
+    const __m128i two = _mm_set1_epi32(2), one = _mm_set1_epi32(1);
+    const __m128i zero = _mm_setzero_si128(), max = _mm_set1_epi32(par*4-1);
+    const __m128i par4 = _mm_set1_epi32(4*par), par2 = _mm_set1_epi32(2*par);
+    for (; c+4 <= n; c+=4) {
+        __m128i Y = yiq_load(p0+c), I = yiq_load(p1+c), Q = yiq_load(p2+c);
+        __m128i Q2 = yiq_div2(_mm_add_epi32(Q,two)), I2 = yiq_div2(_mm_add_epi32(I,two));
+        __m128i R = _mm_sub_epi32(_mm_add_epi32(_mm_add_epi32(Y,Q2),I2),par4);
+        __m128i G = _mm_add_epi32(_mm_sub_epi32(Y,yiq_div2(_mm_add_epi32(Q,one))),par2);
+        __m128i B = _mm_sub_epi32(_mm_add_epi32(Y,Q2),yiq_div2(_mm_add_epi32(I,one)));
+        yiq_store(p0+c, yiq_clip(R,zero,max));
+        yiq_store(p1+c, yiq_clip(G,zero,max));
+        yiq_store(p2+c, yiq_clip(B,zero,max));
+    }
+#endif
+    for (; c<n; c++) {
+        int Y=p0[c], I=p1[c], Q=p2[c];
+
+        int R = Y + (Q + 2) / 2 + (I + 2) / 2 - 4*par;
+        int G = Y - (Q + 1) / 2 + 2*par;
+        int B = Y + (Q + 2) / 2 - (I + 1) / 2;
+
+        // clipping only needed in case of lossy/partial decoding
+        clip(R, 0, par*4-1);
+        clip(G, 0, par*4-1);
+        clip(B, 0, par*4-1);
+        p0[c] = R;
+        p1[c] = G;
+        p2[c] = B;
+    }
+}
+
+template <typename IO>
+class TransformYIQ : public Transform<IO> {
 protected:
     int par;
 
@@ -127,41 +204,21 @@ public:
 
     void data(Images& images) const {
 //        printf("TransformYIQ::data: par=%i\n", par);
-        for (Image& image : images)
-        for (uint32_t r=0; r<image.rows(); r++) {
-            for (uint32_t c=0; c<image.cols(); c++) {
-                int R=image(0,r,c), G=image(1,r,c), B=image(2,r,c);
-
-                int Y = ((R + B) / 2 + G) / 2;
-                int I = R - B + par*4 - 1;
-                int Q = (R + B) / 2 - G + par*4 - 1;
-
-                image.set(0,r,c, Y);
-                image.set(1,r,c, I);
-                image.set(2,r,c, Q);
-            }
-        }
+        const int par = this->par;
+        for_each_row_parallel(images, this->threads, [par](Image& image, uint32_t r) {
+            int32_t *p1 = (int32_t*) image.row_pointer(1,r), *p2 = (int32_t*) image.row_pointer(2,r);
+            if (image.wide_plane(0)) yiq_forward_row((int32_t*) image.row_pointer(0,r), p1, p2, image.cols(), par);
+            else yiq_forward_row((int16_t*) image.row_pointer(0,r), p1, p2, image.cols(), par);
+        });
     }
 
     void invData(Images& images) const {
-        for (Image& image : images)
-        for (uint32_t r=0; r<image.rows(); r++) {
-            for (uint32_t c=0; c<image.cols(); c++) {
-                int Y=image(0,r,c), I=image(1,r,c), Q=image(2,r,c);
-
-                int R = Y + (Q + 2) / 2 + (I + 2) / 2 - 4*par;
-                int G = Y - (Q + 1) / 2 + 2*par;
-                int B = Y + (Q + 2) / 2 - (I + 1) / 2;
-
-                // clipping only needed in case of lossy/partial decoding
-                clip(R, 0, par*4-1);
-                clip(G, 0, par*4-1);
-                clip(B, 0, par*4-1);
-                image.set(0,r,c, R);
-                image.set(1,r,c, G);
-                image.set(2,r,c, B);
-            }
-        }
+        const int par = this->par;
+        for_each_row_parallel(images, this->threads, [par](Image& image, uint32_t r) {
+            int32_t *p1 = (int32_t*) image.row_pointer(1,r), *p2 = (int32_t*) image.row_pointer(2,r);
+            if (image.wide_plane(0)) yiq_inverse_row((int32_t*) image.row_pointer(0,r), p1, p2, image.cols(), par);
+            else yiq_inverse_row((int16_t*) image.row_pointer(0,r), p1, p2, image.cols(), par);
+        });
     }
 };
 